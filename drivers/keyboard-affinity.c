@@ -0,0 +1,121 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/device.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-affinity.h"
+
+static struct cpumask irq_cpus;		//Empty when not restricted, written with config_lock held
+static int work_cpu = WORK_CPU_UNBOUND;	//First online CPU of irq_cpus
+static int wake_cpu = -1;
+
+static ssize_t cpus_show(struct device *device, struct device_attribute *attr, char *buf);
+static ssize_t cpus_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t wake_cpu_show(struct device *device, struct device_attribute *attr, char *buf);
+static ssize_t wake_cpu_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count);
+
+static DEVICE_ATTR(cpus, 0644, cpus_show, cpus_store);
+static DEVICE_ATTR(wake_cpu, 0644, wake_cpu_show, wake_cpu_store);
+
+
+/**
+ *		ATTRIBUTES
+ */
+
+static ssize_t cpus_show(struct device *device, struct device_attribute *attr, char *buf){
+	return sprintf(buf, "%*pbl\n", cpumask_pr_args(&irq_cpus));
+}
+
+/* A CPU list such as "0" or "2-3", empty to lift the restriction. The irqs
+ * of a configured keyboard move right away, the work and timers the next time
+ * they are queued. Irqs of chained gpio controllers cannot be moved on their
+ * own, their error is returned once everything else has moved.
+ */
+static ssize_t cpus_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count){
+	struct keyboard_dev *data = dev_get_drvdata(device);
+	cpumask_var_t mask;
+	int err;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL)) return -ENOMEM;
+	err = cpulist_parse(buf, mask);
+	if (err < 0) goto out;
+	if (!cpumask_empty(mask) && !cpumask_intersects(mask, cpu_online_mask)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	mutex_lock(&data->config_lock);
+	cpumask_copy(&irq_cpus, mask);
+	WRITE_ONCE(work_cpu, cpumask_empty(mask) ? WORK_CPU_UNBOUND : cpumask_any_and(mask, cpu_online_mask));
+	err = affine_system(data);
+	mutex_unlock(&data->config_lock);
+
+	out:
+		free_cpumask_var(mask);
+		return err < 0 ? err : count;
+}
+
+static ssize_t wake_cpu_show(struct device *device, struct device_attribute *attr, char *buf){
+	return sprintf(buf, "%d\n", READ_ONCE(wake_cpu));
+}
+
+static ssize_t wake_cpu_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count){
+	int cpu, err;
+
+	err = kstrtoint(buf, 0, &cpu);
+	if (err < 0) return err;
+	if (cpu < -1 || cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu))) return -EINVAL;
+	WRITE_ONCE(wake_cpu, cpu);
+	return count;
+}
+
+
+/**
+ *		USERS
+ */
+
+/* Called with config_lock held, NULL when not restricted */
+const struct cpumask *affinity_irq_mask(void){
+	return cpumask_empty(&irq_cpus) ? NULL : &irq_cpus;
+}
+
+/* CPU to queue work on, WORK_CPU_UNBOUND when not restricted or offline */
+int affinity_work_cpu(void){
+	int cpu = READ_ONCE(work_cpu);
+
+	if (cpu != WORK_CPU_UNBOUND && !cpu_online(cpu)) return WORK_CPU_UNBOUND;
+	return cpu;
+}
+
+/* -1 when readers are woken where the events are dispatched */
+int affinity_wake_cpu(void){
+	int cpu = READ_ONCE(wake_cpu);
+
+	return (cpu >= 0 && cpu_online(cpu)) ? cpu : -1;
+}
+
+
+/**
+ *		SETUP
+ */
+
+/* The drvdata of device must be the keyboard_dev */
+int affinity_setup(struct device *device){
+	int err;
+
+	err = device_create_file(device, &dev_attr_cpus);
+	if (err < 0) return err;
+	err = device_create_file(device, &dev_attr_wake_cpu);
+	if (err < 0) device_remove_file(device, &dev_attr_cpus);
+	return err;
+}
+
+void affinity_teardown(struct device *device){
+	device_remove_file(device, &dev_attr_wake_cpu);
+	device_remove_file(device, &dev_attr_cpus);
+}
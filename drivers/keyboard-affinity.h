@@ -0,0 +1,21 @@
+#ifndef keyboard_affinity_h
+#define keyboard_affinity_h
+
+#include <linux/device.h>
+#include <linux/cpumask.h>
+
+/* Where the keyboard does its work, set in sysfs so keypad traffic can be
+ * kept off isolated cores:
+ *   cpus     -> CPU list for the key irqs, their handler threads, the edge
+ *               merge, the polling work, the gesture timer and the netlink
+ *               work. Empty (the default) leaves them to the kernel.
+ *   wake_cpu -> CPU that wakes up the readers (read, poll, eventfd), -1 (the
+ *               default) wakes them right from the event path
+ */
+int affinity_setup(struct device *device);
+void affinity_teardown(struct device *device);
+const struct cpumask *affinity_irq_mask(void);
+int affinity_work_cpu(void);
+int affinity_wake_cpu(void);
+
+#endif
@@ -0,0 +1,190 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/gpio.h>
+#include <linux/ioport.h>
+#include <asm/io.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-backend.h"
+
+/* AM335x backend: pins are given as BeagleBone header pins (see
+ * "keyboard-public.h") and are muxed as gpios by writing the pad configuration
+ * registers of the AM335x control module.
+ */
+
+#define AM33XX_CONTROL_BASE 0x44e10000
+#define AM33XX_GPIOS_PER_BANK 32
+#define AM33XX_BANK_IRQS 2	//Edge irqs usable per bank, see "keyboard-public.h"
+
+/* Bit 5: 1 - Input, 0 - Output
+ * Bit 4: 1 - Pull up, 0 - Pull down
+ * Bit 3: 1 - Pull disabled, 0 - Pull enabled
+ * Bit 2 \
+ * Bit 1 |- Mode
+ * Bit 0 /
+*/
+#define OUTPUT_PULLUP 0x7 | (2 << 3)
+#define INPUT_PULLUP 0x7 | (2 << 3) | (1 << 5)
+#define OUTPUT_PULLDOWN 0x7
+#define INPUT_PULLDOWN 0x7 | (1 << 5)
+
+/* These are the arrays containing offsets and value for the GPIO pines on the
+ * BeagleBone.
+ *
+ * FOR P8_X:
+ * 	Note that the first element and the second one are for DGND so they
+ * 	cannot be mapped neither have value.
+ *
+ * FOR P9_X:
+ * 	Note that the first 10 elements are for voltage output and ground. In addition
+ *	this port has more pins since P9_41 and P9_42 have two modes each one (A and B)
+ *	so this extra offsets and values have been appended at the end of the usual
+ * 	pins. This follows the notation for pins published within "keyboard-public.h"
+ */
+static const uint32_t pins8_offset[46] = {0,0,0x818,0x81C,0x808,0x80C,0x890,0x894,
+				0x89C,0x898,0x834,0x830,0x824,0x828,0x83C,0x838,0x82C,0x88C,0x820,0x884,
+				0x880,0x814,0x810,0x804,0x800,0x87C,0x8E0,0x8E8,0x8E4,0x8EC,0x8D8,0x8DC,
+				0x8D4,0x8CC,0x8D0,0x8C8,0x8C0,0x8C4,0x8B8,0x8BC,0x8B0,0x8B4,0x8A8,0x8AC,
+				0x8A0,0x8A4
+};
+static const uint32_t pins8_value[46] = {0,0,38,39,34,35,66,67,69,68,45,44,23,26,
+				47,46,27,65,22,63,62,37,36,33,32,61,86,88,87,89,10,11,9,81,8,80,78,79,76,
+				77,74,75,72,73,70,71
+};
+static const uint32_t pins9_offset[48] = {0,0,0,0,0,0,0,0,0,0,0x870,0x878,0x874,
+				0x848,0x840,0x84C,0x95C,0x958,0x97C,0x978,0x954,0x950,0x844,0x984,0x9AC,
+				0x980,0x9A4,0x99C,0x994,0x998,0x990,0,0,0,0,0,0,0,0,0,0x9B4,0x964,0,0,0,
+				0,0x9A8,0x9A0
+};
+static const uint32_t pins9_value[48] = {0,0,0,0,0,0,0,0,0,0,30,60,31,50,48,51,5,
+				4,13,12,3,2,49,15,117,14,115,113,111,112,110,0,0,0,0,0,0,0,0,0,20,7,0,0,
+				0,0,116,114
+};
+
+static int translate_gpio_num(uint16_t gpio_num, uint16_t *val_ptr, uint32_t *mmap_ptr);
+
+
+/*
+ *		BACKEND FUNCTIONS
+ */
+int backend_setup_pinmux(const struct pin_conf *conf, struct keyboard_pins *k_pins, uint8_t pollable){
+	int i, err = 0;
+	void* addr;
+	uint32_t pins[] = { 					// Memory mapped gpios in AM335x
+																// calculated as (AM33XX_CONTROL_BASE + offset) ref man Table 9-10,
+																// upon pin names names: from table/mode0 in BB ref manual
+		0,
+		OUTPUT_PULLUP,                					//	mode 7 (gpio), PULLUP, OUTPUT
+		0,
+		INPUT_PULLDOWN,     						//      mode 7 (gpio), PULLDOWN, INPUT
+		0,
+		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
+		0,
+		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
+		0,
+		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
+		0,
+		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
+		0,
+		INPUT_PULLDOWN,							//      mode 7 (gpio), PULLDOWN, INPUT
+	};
+	keyboard_trace("DONE WITH PIN ARRAY \n");
+	keyboard_trace("POPULATE ARRAY WITH PIN NUMBERS \n");
+
+	/* This populates both mmap&configuration array (pins) and the real on board
+	 * values for the gpios used with this driver.
+	 */
+	err |= translate_gpio_num(conf->vcc_pin, &k_pins->vcc_pin, &pins[0]); // VCC Pin -> Will serve as power for keyboard
+	err |= translate_gpio_num(conf->right_key_pin, &k_pins->right_key_pin, &pins[2]); // RIGHT_KEY Pin ->    will be interrupt
+	err |= translate_gpio_num(conf->start_key_pin, &k_pins->start_key_pin, &pins[4]); // START_KEY Pin ->    will be interrupt
+	err |= translate_gpio_num(conf->up_key_pin, &k_pins->up_key_pin, &pins[6]); // UP_KEY Pin ->    will be interrupt
+	err |= translate_gpio_num(conf->down_key_pin, &k_pins->down_key_pin, &pins[8]); // DOWN_KEY Pin ->    will be interrupt
+	err |= translate_gpio_num(conf->escape_key_pin, &k_pins->escape_key_pin, &pins[10]); // ESCAPE_KEY Pin ->    will be interrupt
+	err |= translate_gpio_num(conf->left_key_pin, &k_pins->left_key_pin, &pins[12]); // LEFT_KEY Pin ->    will be interrupt
+
+	if (err) {
+		pr_err(DEVICE_NAME ": INVALID PIN NUMBER IN CONFIGURATION \n");
+		return -EINVAL;
+	}
+
+	keyboard_trace("DONE WITH POPULATING PIN NUMBERS \n");
+	keyboard_trace("STARTING POPULATING PIN FIELDS WITHIN PIN STRUCT \n");
+
+	for (i=0; i<GPIO_USED_NUM*2; i+=2) {	// map the mapped i/o addresses to kernel high memory
+		addr = ioremap(pins[i], 4);
+		keyboard_trace("GPIO NUMBER %d\n",pins[i]);
+		if (NULL == addr)
+			return -EBUSY;
+
+		iowrite32(pins[i+1], addr); // write settings for each pin
+		iounmap(addr);
+	}
+
+	/* IF DEVICE IS CONFIGURED AS POLLABLE, THEN IT IS NEEDED TO CONFIGURE THE
+	* IRQ PIN
+	*/
+	if (pollable){
+		uint32_t gpio;
+		if (translate_gpio_num(conf->irq_pin, &k_pins->poll_interrupt_pin, &gpio) < 0) // IRQ_POLL Pin ->    will be interrupt
+			return -EINVAL;
+		addr = ioremap(gpio, 4);
+		keyboard_trace("GPIO NUMBER %d\n",gpio);
+		if (NULL == addr)
+			return -EBUSY;
+
+		iowrite32(INPUT_PULLDOWN, addr); // write settings for pin
+		iounmap(addr);
+	}
+
+	return 0;
+}
+
+void backend_ack_pin(unsigned int gpio){
+	gpio_set_value(gpio, 0);
+}
+
+int backend_translate_pin(uint16_t pin, unsigned int *gpio){
+	uint16_t val;
+	uint32_t mmap;
+
+	if (translate_gpio_num(pin, &val, &mmap) < 0) return -EINVAL;
+	*gpio = val;
+	return 0;
+}
+
+int backend_pin_bank(unsigned int gpio){
+	return gpio / AM33XX_GPIOS_PER_BANK;
+}
+
+int backend_bank_irqs(int bank){
+	return AM33XX_BANK_IRQS;
+}
+
+
+/*
+ *		LOCAL FUNCTIONS
+ */
+static int translate_gpio_num(uint16_t gpio_num, uint16_t *val_ptr, uint32_t *mmap_ptr){
+	int num = (gpio_num % 100) - 1;
+	// pin is in P9
+	if (gpio_num >= 900 && gpio_num < 1000) {
+		// Check gpio_num range, power and ground pins have no offset
+		if((num) >= 0 && (num) <= 47 && pins9_offset[num]) {
+			*mmap_ptr = AM33XX_CONTROL_BASE + pins9_offset[num];
+			*val_ptr = pins9_value[num];
+			return 0;
+		}
+	}
+	// pin is in P8
+	else if(gpio_num >= 800 && gpio_num < 900) {
+		if((num) >= 0 && (num) <= 45 && pins8_offset[num]) {
+			*mmap_ptr = AM33XX_CONTROL_BASE + pins8_offset[num];
+			*val_ptr = pins8_value[num];
+			return 0;
+		}
+	}
+	*mmap_ptr = 0;
+	*val_ptr = 0;
+	return -EINVAL;
+}
@@ -0,0 +1,36 @@
+#ifndef keyboard_backend_h
+#define keyboard_backend_h
+
+#include "keyboard-interrupt.h"
+
+/* A backend knows how the pin numbers given by the user (struct pin_conf) map
+ * to kernel gpio numbers and how these pins must be set up before requesting
+ * them. Only one backend is linked into the module, it is chosen at build time
+ * with BACKEND=<name> (see drivers/Makefile):
+ *
+ *   am335x  -> BeagleBone P8/P9 header pins, pinmux done through the AM335x
+ *              control module (default)
+ *   gpiosim -> Line offsets of a gpio-sim/gpio-mockup chip, no pinmux needed.
+ *              Builds and runs on any kernel with one of those drivers
+ */
+
+/* Resolves every pin in conf into k_pins and applies the pin configuration.
+ * The irq pin is only taken into account if pollable is set.
+ */
+int backend_setup_pinmux(const struct pin_conf *conf, struct keyboard_pins *k_pins, uint8_t pollable);
+
+/* Called by the irq handlers once the key has been read */
+void backend_ack_pin(unsigned int gpio);
+
+/* Resolves one user pin into its kernel gpio number without touching the
+ * hardware, -EINVAL if the pin does not exist or is not a gpio
+ */
+int backend_translate_pin(uint16_t pin, unsigned int *gpio);
+
+/* Bank (gpio controller) of a gpio and how many edge irqs a bank can feed,
+ * used by the acquisition planner (see "keyboard-plan.h")
+ */
+int backend_pin_bank(unsigned int gpio);
+int backend_bank_irqs(int bank);
+
+#endif
@@ -0,0 +1,114 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/errno.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-affinity.h"
+#include "keyboard-pm.h"
+#include "keyboard-clock.h"
+
+static unsigned int clock_sync_ms = 1000;
+module_param(clock_sync_ms, uint, 0644);
+MODULE_PARM_DESC(clock_sync_ms, "Period of the CLOCK_REALTIME correlation records (ms)");
+
+static struct keyboard_dev *dev;
+static struct delayed_work sync_work;	//Queues the correlation records
+static unsigned int clock_users;	//Readers on another clock than MONOTONIC, device lock
+static unsigned int sync_users;		//Readers getting correlation records, device lock
+
+static void sync_work_handler(struct work_struct *work);
+static void schedule_sync(unsigned long delay);
+
+
+/**
+ *		EVENT PATH
+ */
+
+/* Device lock held. Both clocks are read back to back so the offset is the
+ * one of the moment, MONOTONIC_RAW drifts from MONOTONIC as NTP slews it.
+ */
+void clock_dispatch(struct keyboard_dev *data, const struct keyboard_event *events, int num){
+	int64_t mono;
+
+	if (unlikely(clock_users) && num) {
+		mono = ktime_to_ns(ktime_get());
+		data->hub.clock_offset[KEYBOARD_CLOCK_MONOTONIC_RAW] = ktime_to_ns(ktime_get_raw()) - mono;
+		data->hub.clock_offset[KEYBOARD_CLOCK_BOOTTIME] = ktime_to_ns(ktime_get_boottime()) - mono;
+	}
+	event_hub_dispatch(&data->hub, events, num);
+}
+
+/* The record is built in CLOCK_MONOTONIC as every event, the hub moves it to
+ * the clock of each file. Edges still staged go first.
+ */
+static void sync_work_handler(struct work_struct *work){
+	struct keyboard_event event;
+	unsigned long flags;
+	uint64_t real, mono;
+	uint32_t rem;
+	int staged;
+	unsigned int users;
+
+	memset(&event, 0, sizeof(struct keyboard_event));
+	event.type = KEYBOARD_EVENT_CLOCK_SYNC;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	staged = merge_edges(dev);
+	real = ktime_to_ns(ktime_get_real());
+	mono = ktime_to_ns(ktime_get());
+	event.sequence = div_u64_rem(real, NSEC_PER_SEC, &rem);
+	event.timestamp = mono - rem;	//When the current second began
+	event.state = dev->keys.state;
+	clock_dispatch(dev, &event, 1);
+	users = sync_users;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (staged) pm_key_activity();
+	if (users) schedule_sync(msecs_to_jiffies(READ_ONCE(clock_sync_ms)));
+}
+
+static void schedule_sync(unsigned long delay){
+	queue_delayed_work_on(affinity_work_cpu(), system_wq, &sync_work, delay ? delay : 1);
+}
+
+
+/*
+ *		CLOCK GLOBAL FUNCTIONS
+ */
+void clock_init(struct keyboard_dev *device){
+	dev = device; //Store pointer to device struct
+	INIT_DELAYED_WORK(&sync_work, sync_work_handler);
+}
+
+void clock_exit(void){
+	cancel_delayed_work_sync(&sync_work);
+}
+
+/* IO_KEYBOARD_SET_CLOCK for reader, also called with 0 when its file is
+ * closed. The first file asking for correlation records gets one right away.
+ */
+int set_clock(struct keyboard_dev *data, struct event_reader *reader, unsigned long arg){
+	uint8_t clock = arg & ~KEYBOARD_CLOCK_SYNC, sync = !!(arg & KEYBOARD_CLOCK_SYNC);
+	unsigned long flags;
+	int start;
+
+	if ((arg & ~(unsigned long)KEYBOARD_CLOCK_SYNC) >= KEYBOARD_CLOCK_NUM) return -EINVAL;
+
+	spin_lock_irqsave(&data->lock, flags);
+	clock_users += (clock != KEYBOARD_CLOCK_MONOTONIC) - (reader->clock != KEYBOARD_CLOCK_MONOTONIC);
+	start = sync && !sync_users;
+	sync_users += sync - reader->clock_sync;
+	reader->clock = clock;
+	reader->clock_sync = sync;
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	if (start) schedule_sync(0);
+	return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef keyboard_clock_h
+#define keyboard_clock_h
+
+#include "keyboard-interrupt.h"
+
+/* Timestamp clocks of the open files (see IO_KEYBOARD_SET_CLOCK). Every
+ * source of events dispatches them through clock_dispatch(), which keeps the
+ * clock offsets of the hub current while some file uses another clock. A work
+ * item queues the KEYBOARD_EVENT_CLOCK_SYNC records while some file wants them.
+ */
+void clock_init(struct keyboard_dev *device);
+void clock_exit(void);
+void clock_dispatch(struct keyboard_dev *data, const struct keyboard_event *events, int num);
+int set_clock(struct keyboard_dev *data, struct event_reader *reader, unsigned long arg);
+
+#endif
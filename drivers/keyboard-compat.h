@@ -0,0 +1,119 @@
+#ifndef keyboard_compat_h
+#define keyboard_compat_h
+
+#include <linux/version.h>
+#include <linux/interrupt.h>
+#include <linux/device.h>
+#include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/eventfd.h>
+
+/* The driver was written against the BeagleBone 3.x kernels, these wrappers
+ * keep it building on the recent kernels used for the host (gpiosim) build.
+ */
+
+/* IRQF_DISABLED is a no-op since 2.6.35 and was removed in 4.1 */
+#ifndef IRQF_DISABLED
+#define IRQF_DISABLED 0
+#endif
+
+/* access_ok() lost its type argument in 5.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define keyboard_access_ok(type, addr, size) access_ok(addr, size)
+#else
+#define keyboard_access_ok(type, addr, size) access_ok(type, addr, size)
+#endif
+
+/* class_create() lost its owner argument in 6.4 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define keyboard_class_create(owner, name) class_create(name)
+#else
+#define keyboard_class_create(owner, name) class_create(owner, name)
+#endif
+
+/* hrtimer_setup() replaced hrtimer_init() + .function in 6.13 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define keyboard_hrtimer_setup(timer, fn, clock, mode) hrtimer_setup(timer, fn, clock, mode)
+#else
+#define keyboard_hrtimer_setup(timer, fn, clock, mode) \
+	do { hrtimer_init(timer, clock, mode); (timer)->function = fn; } while (0)
+#endif
+
+/* eventfd_signal() lost its count argument in 6.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define keyboard_eventfd_signal(ctx) eventfd_signal(ctx)
+#else
+#define keyboard_eventfd_signal(ctx) eventfd_signal(ctx, 1)
+#endif
+
+/* Event filters are classic BPF programs converted by the kernel, which needs
+ * the networking core and bpf_prog_create_from_user() (4.4). bpf_prog_run()
+ * replaced BPF_PROG_RUN() in 5.15.
+ */
+#if defined(CONFIG_NET) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+#define KEYBOARD_HAVE_FILTER
+#include <linux/filter.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+#define keyboard_bpf_run(prog, ctx) bpf_prog_run(prog, ctx)
+#else
+#define keyboard_bpf_run(prog, ctx) BPF_PROG_RUN(prog, ctx)
+#endif
+#endif
+
+/* genlmsg_multicast_allns() lost its flags argument in 6.10 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define keyboard_genlmsg_multicast_allns(family, skb, portid, group) \
+	genlmsg_multicast_allns(family, skb, portid, group)
+#else
+#define keyboard_genlmsg_multicast_allns(family, skb, portid, group) \
+	genlmsg_multicast_allns(family, skb, portid, group, GFP_KERNEL)
+#endif
+
+/* irq_set_affinity_hint() became irq_set_affinity_and_hint() in 5.17 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define keyboard_irq_set_affinity_hint(irq, mask) irq_set_affinity_and_hint(irq, mask)
+#else
+#define keyboard_irq_set_affinity_hint(irq, mask) irq_set_affinity_hint(irq, mask)
+#endif
+
+/* .read_iter (3.16) lets io_uring and aio submit reads without a worker
+ * thread, the read path writes through keyboard_read_copy() so older kernels
+ * keep the plain .read. IOCB_NOWAIT (4.13) asks for -EAGAIN instead of
+ * sleeping, which io_uring only tries on files flagged as supporting it:
+ * FMODE_NOWAIT at open time until 6.12, FOP_NOWAIT in the fops since.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+#define KEYBOARD_HAVE_READ_ITER
+#include <linux/uio.h>
+typedef struct iov_iter keyboard_read_dest;
+static inline int keyboard_read_copy(keyboard_read_dest *to, const void *src, size_t len){
+	return copy_to_iter(src, len, to) == len ? 0 : -EFAULT;
+}
+#define keyboard_read_left(to) iov_iter_count(to)
+#else
+typedef struct { char __user *buf; size_t left; } keyboard_read_dest;
+static inline int keyboard_read_copy(keyboard_read_dest *to, const void *src, size_t len){
+	if (copy_to_user(to->buf, src, len)) return -EFAULT;
+	to->buf += len;
+	to->left -= len;
+	return 0;
+}
+#define keyboard_read_left(to) ((to)->left)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+#define keyboard_iocb_nowait(iocb) ((iocb)->ki_flags & IOCB_NOWAIT)
+#else
+#define keyboard_iocb_nowait(iocb) 0
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#define KEYBOARD_HAVE_FOP_NOWAIT
+#define keyboard_set_nowait(filp) do { } while (0)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+#define keyboard_set_nowait(filp) ((filp)->f_mode |= FMODE_NOWAIT)
+#else
+#define keyboard_set_nowait(filp) do { } while (0)
+#endif
+
+#endif
@@ -14,28 +14,115 @@
 #include <linux/slab.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/capability.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/eventfd.h>
+#include <linux/irq_work.h>
 #include <asm/io.h>
 
 #include "keyboard-interrupt.h"
 #include "keyboard-driver.h"
 #include "keyboard-public.h"
+#include "keyboard-inject.h"
+#include "keyboard-pm.h"
+#include "keyboard-plan.h"
+#include "keyboard-filter.h"
+#include "keyboard-gesture.h"
+#include "keyboard-netlink.h"
+#include "keyboard-record.h"
+#include "keyboard-affinity.h"
+#include "keyboard-clock.h"
 
 int keyboard_init(void);
 void keyboard_exit(void);
+#ifdef KEYBOARD_HAVE_READ_ITER
+ssize_t keyboard_read_iter(struct kiocb *iocb, struct iov_iter *to);
+#else
 ssize_t keyboard_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos);
+#endif
 long keyboard_unlocked_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+unsigned int keyboard_poll(struct file *filp, poll_table *wait);
+int keyboard_mmap(struct file *filp, struct vm_area_struct *vma);
 int keyboard_open(struct inode *inode, struct file *filp);
 int keyboard_release(struct inode *inode, struct file *filp);
+static void reader_notify(struct event_reader *node, uint8_t keys);
+static void reader_wake(struct keyboard_reader *reader, uint8_t keys);
+static void reader_wake_work(struct irq_work *work);
+static int reader_filter(struct event_reader *node, struct keyboard_event *event);
+static int set_filter(struct keyboard_reader *reader, const struct keyboard_filter *conf);
+static int set_eventfd(struct keyboard_reader *reader, const struct keyboard_eventfd *conf);
+static ssize_t state_show(struct device *device, struct device_attribute *attr, char *buf);
+static ssize_t recovered_show(struct device *device, struct device_attribute *attr, char *buf);
+static void get_config(struct keyboard_dev *local_dev, struct keyboard_config *conf);
+static int set_config(struct keyboard_dev *local_dev, const struct keyboard_config *conf);
+static int start_mode(struct keyboard_dev *local_dev, uint32_t mode);
+static int configure_mode(struct keyboard_dev *local_dev, uint32_t mode);
+static void get_plan(struct keyboard_dev *local_dev, struct keyboard_plan *plan);
+static int valid_queue(uint32_t depth, uint32_t policy);
+static void get_queue(struct keyboard_reader *reader, struct keyboard_queue *conf);
+static int set_queue(struct keyboard_reader *reader, const struct keyboard_queue *conf);
+static long file_ioctl(struct keyboard_reader *reader, unsigned int cmd, unsigned long arg);
+
+/* Default events queued for every open file, a press and its release take
+ * two slots. The ring lives in its own pages so it can be mapped by user space.
+ */
+#define READER_QUEUE_SIZE 128
+#define READER_RING_BYTES(depth) PAGE_ALIGN(EVENT_RING_BYTES(depth))
+
+struct keyboard_reader {
+	struct event_reader node;	//Linked into the hub of the device
+	struct keyboard_dev *dev;
+	struct mutex read_lock;		//The queue has a single consumer, serialize read()
+	struct mutex ring_lock;		//Ring swap against mmap(), never held across a sleep or user copy
+	wait_queue_head_t wait;		//Woken when events are queued for this file
+	uint8_t format;			//KEYBOARD_FORMAT_*
+	uint8_t eventfd_mask;		//Keys that signal eventfd
+	struct eventfd_ctx *eventfd;	//Signalled when events are queued, may be NULL
+	struct reader_filter filter;	//IO_KEYBOARD_SET_FILTER program and its state
+	uint32_t ring_bytes;		//Size of the ring mapping
+	uint8_t mapped;			//Ring mapped, its size and tail handling are fixed
+	struct irq_work wake_work;	//Wakes the file up from the wake_cpu of the keyboard
+	uint8_t wake_keys;		//Keys queued since the last wake_work, device lock
+};
+
+static unsigned int debounce_us = 0;
+module_param(debounce_us, uint, 0444);
+MODULE_PARM_DESC(debounce_us, "Edges of a key closer than this to the previous one are ignored (us)");
+
+static unsigned int queue_depth = READER_QUEUE_SIZE;
+module_param(queue_depth, uint, 0644);
+MODULE_PARM_DESC(queue_depth, "Events queued for a newly opened file, power of 2 (see IO_KEYBOARD_SET_QUEUE)");
+
+static unsigned int queue_policy = KEYBOARD_QUEUE_DROP_NEWEST;
+module_param(queue_policy, uint, 0644);
+MODULE_PARM_DESC(queue_policy, "What a full queue of a newly opened file does: 0 drop newest, 1 drop oldest, 2 coalesce");
 
 static dev_t devno;
 static atomic_t tmp_atomic = ATOMIC_INIT(0);
 struct keyboard_dev *dev;	//Keyboard device custom data
 static struct class* keyboard_class;	//Class for /sys/
+static struct device* keyboard_device;	//Device in /sys/, holds the attributes
+static struct keyboard_plan active_plan;	//Plan of the running configuration
+static DEVICE_ATTR(state, 0444, state_show, NULL);
+static DEVICE_ATTR(recovered, 0444, recovered_show, NULL);
 static struct file_operations keyboard_fops = {	//Struct for operations
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = keyboard_unlocked_ioctl,
 	.open = keyboard_open,
+#ifdef KEYBOARD_HAVE_READ_ITER
+	.read_iter = keyboard_read_iter,
+#else
 	.read = keyboard_read,
+#endif
+#ifdef KEYBOARD_HAVE_FOP_NOWAIT
+	.fop_flags = FOP_NOWAIT,
+#endif
+	.poll = keyboard_poll,
+	.mmap = keyboard_mmap,
 	.release = keyboard_release
 };
 
@@ -54,22 +141,27 @@ int keyboard_init(void){
 	printk(KERN_INFO DEVICE_NAME ": Device successfully allocated, major number: %d \n", major);
 
 	/* Create class for device */
-	keyboard_class = class_create(THIS_MODULE, DEVICE_NAME);
-	if (keyboard_class < 0){
-		unregister_chrdev_region(devno,COUNT);
+	keyboard_class = keyboard_class_create(THIS_MODULE, DEVICE_NAME);
+	if (IS_ERR(keyboard_class)){
 		printk(KERN_DEBUG DEVICE_NAME ": Unable to create class for device\n");
-		return err;
+		err = PTR_ERR(keyboard_class);
+		goto err_region;
 	}
 
 	printk(KERN_INFO DEVICE_NAME ": Class created\n");
 
-	dev = kmalloc(sizeof(struct keyboard_dev), GFP_KERNEL);	//Allocate memory for the device struct, GFP_KERNEL flag for kernel context
+	dev = kzalloc(sizeof(struct keyboard_dev), GFP_KERNEL);	//Allocate memory for the device struct, GFP_KERNEL flag for kernel context
+	if (!dev){
+		err = -ENOMEM;
+		goto err_class;
+	}
 
-	if (device_create(keyboard_class, NULL, devno, NULL, DEVICE_NAME) == 0){
-		class_destroy(keyboard_class);
-    unregister_chrdev_region(devno,COUNT);
+	keyboard_class->pm = &keyboard_pm_ops;	//Runtime PM callbacks of the device
+	keyboard_device = device_create(keyboard_class, NULL, devno, dev, DEVICE_NAME);
+	if (IS_ERR(keyboard_device)){
 		printk(KERN_DEBUG DEVICE_NAME ": Unable to create device from class\n");
-		return err;
+		err = PTR_ERR(keyboard_device);
+		goto err_dev;
 	}
 
 	printk(KERN_INFO DEVICE_NAME ": Device created\n");
@@ -81,92 +173,694 @@ int keyboard_init(void){
 
 	/* Init the fields within the keyboard_dev struct */
 	dev->is_pollable = 0;
+	dev->timer_polled = 0;
 	dev->configured = 0;
-	dev->key = UNDEFINED_KEY;
+	dev->injecting = 0;
+	dev->recovered_presses = 0;
+	dev->recovered_releases = 0;
+	dev->merge_gen = 0;
+	spin_lock_init(&dev->lock);
+	mutex_init(&dev->config_lock);
+	key_state_init(&dev->keys, (uint64_t)debounce_us * NSEC_PER_USEC);
+	event_hub_init(&dev->hub);
 	dev->readers_count = tmp_atomic;
-	init_waitqueue_head(&dev->readers_queue);
+	inject_init(dev);
+	gesture_init(dev);
+	clock_init(dev);
+
+	/* Per CPU staging of the key edges, see report_edge() */
+	err = edges_init(dev);
+	if (err < 0){
+		printk(KERN_DEBUG DEVICE_NAME ": Unable to allocate the edge stages\n");
+		goto err_device;
+	}
+
+	/* Before cdev_add(), opening the device takes a PM reference */
+	err = pm_setup(keyboard_device);
+	if (err < 0){
+		printk(KERN_DEBUG DEVICE_NAME ": Unable to set up power management\n");
+		goto err_edges;
+	}
 
 	printk(KERN_INFO DEVICE_NAME ": Everything initialized \n");
 
 	err = cdev_add(&dev->cdev,devno,1);	//Register char device into kernel
-
 	if (err < 0){
-		/* If error while registering then undo everything done before to register
-		 * device into the kernel
-		 */
-		device_destroy(keyboard_class,devno);
-		class_destroy(keyboard_class);
-    unregister_chrdev_region(devno,COUNT);
 		printk(KERN_DEBUG DEVICE_NAME ": Unable to register char device\n");
-		return err;
+		goto err_pm;
+	}
+
+	/* Attributes go last, they use dev as soon as they exist */
+	err = device_create_file(keyboard_device, &dev_attr_state);
+	if (err < 0){
+		printk(KERN_DEBUG DEVICE_NAME ": Unable to create sysfs attributes\n");
+		goto err_cdev;
+	}
+	err = device_create_file(keyboard_device, &dev_attr_recovered);
+	if (err < 0){
+		printk(KERN_DEBUG DEVICE_NAME ": Unable to create sysfs attributes\n");
+		goto err_state;
+	}
+	err = affinity_setup(keyboard_device);
+	if (err < 0){
+		printk(KERN_DEBUG DEVICE_NAME ": Unable to create sysfs attributes\n");
+		goto err_recovered;
+	}
+
+	/* Only does something in NETLINK=y builds */
+	err = netlink_init(dev);
+	if (err < 0){
+		printk(KERN_DEBUG DEVICE_NAME ": Unable to register netlink family\n");
+		goto err_affinity;
 	}
 
+	/* Record and replay files in debugfs, if there is debugfs */
+	record_init(dev);
+
 	return 0; 	//Success
+
+	/* Undo everything done before the failure, in reverse order */
+	err_affinity:
+		affinity_teardown(keyboard_device);
+	err_recovered:
+		device_remove_file(keyboard_device, &dev_attr_recovered);
+	err_state:
+		device_remove_file(keyboard_device, &dev_attr_state);
+	err_cdev:
+		cdev_del(&dev->cdev);
+	err_pm:
+		pm_teardown(keyboard_device);
+	err_edges:
+		edges_exit();
+	err_device:
+		device_destroy(keyboard_class,devno);
+	err_dev:
+		kfree(dev);
+	err_class:
+		class_destroy(keyboard_class);
+	err_region:
+		unregister_chrdev_region(devno,COUNT);
+		return err;
 }
 
 int keyboard_open(struct inode *inode, struct file *filp){
 	struct keyboard_dev *local_dev; /* device information */
+	struct keyboard_reader *reader;
+	struct keyboard_ring *ring;
+	unsigned long flags;
+	uint32_t depth = READ_ONCE(queue_depth), policy = READ_ONCE(queue_policy);
+	int err;
 
-	printk(KERN_DEBUG DEVICE_NAME ": Opening\n");
+	keyboard_trace("Opening\n");
 	local_dev = container_of(inode->i_cdev, struct keyboard_dev, cdev);
 
-	printk(KERN_DEBUG DEVICE_NAME ": obtained struct\n");
-	filp->private_data = local_dev; /* for other methods */
+	keyboard_trace("obtained struct\n");
 	/* No need to limit the open devices to one as multiple processes can read from the
-	keyboard at the same time */
-	printk(KERN_DEBUG DEVICE_NAME ":returning\n");
+	keyboard at the same time, each one gets its own queue of events */
+	reader = kmalloc(sizeof(struct keyboard_reader), GFP_KERNEL);
+	if (!reader) return -ENOMEM;
+	if (valid_queue(depth, policy) < 0) {
+		printk(KERN_ALERT DEVICE_NAME ": Bad queue_depth or queue_policy, using the defaults\n");
+		depth = READER_QUEUE_SIZE;
+		policy = KEYBOARD_QUEUE_DROP_NEWEST;
+	}
+	ring = vmalloc_user(READER_RING_BYTES(depth));
+	if (!ring) {
+		kfree(reader);
+		return -ENOMEM;
+	}
+	err = pm_get();		//Keyboard powered while the file is open
+	if (err < 0) {
+		vfree(ring);
+		kfree(reader);
+		return err;
+	}
+	reader->dev = local_dev;
+	reader->format = KEYBOARD_FORMAT_ASCII;
+	reader->eventfd = NULL;
+	reader->eventfd_mask = 0;
+	filter_init(&reader->filter);
+	mutex_init(&reader->read_lock);
+	mutex_init(&reader->ring_lock);
+	init_waitqueue_head(&reader->wait);
+	reader->ring_bytes = READER_RING_BYTES(depth);
+	reader->mapped = 0;
+	reader->wake_keys = 0;
+	init_irq_work(&reader->wake_work, reader_wake_work);
+	event_queue_init(&reader->node.queue, ring, depth);
+	reader->node.queue.policy = policy;
+
+	spin_lock_irqsave(&local_dev->lock, flags);
+	event_hub_add(&local_dev->hub, &reader->node);
+	reader->node.notify = reader_notify;
+	spin_unlock_irqrestore(&local_dev->lock, flags);
+
+	filp->private_data = reader; /* for other methods */
+	keyboard_set_nowait(filp);	//read_iter honours IOCB_NOWAIT
+	keyboard_trace("returning\n");
 
 	return 0;
 }
 
-ssize_t keyboard_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos){
-	/* Blocking IO */
-	struct keyboard_dev *local_dev = filp->private_data; /* device information */
-	unsigned long retval;
-	uint8_t pressed_key;
+/* Takes as many presses as fit in the user buffer, releases are not reported
+ * through this format. Like read_events() a key leaves the queue only once
+ * copied.
+ */
+static ssize_t read_ascii(struct keyboard_reader *reader, keyboard_read_dest *to){
+	struct keyboard_event event;
+	size_t num = 0, count = keyboard_read_left(to);
+	uint32_t pos;
+	char key;
 
-	if (count <= 0) return -EINVAL;	//Invalid argument
-	if (!local_dev->configured) return -EFAULT;
-	printk(KERN_DEBUG DEVICE_NAME ":INSIDE KERNEL READING....\n");
-	printk(KERN_DEBUG DEVICE_NAME ": Increment readers count\n");
-	/* Increment readers count */
-	atomic_inc(&local_dev->readers_count);
+	while (num < count && event_queue_peek(&reader->node.queue, &event, &pos) == 0) {
+		if (event.type == KEYBOARD_EVENT_PRESS) {
+			key = event.key + '0';	//ASCII code of number
+			if (keyboard_read_copy(to, &key, NUM_CHARS_PER_KEY)) {
+				if (num) break;
+				return -EFAULT;
+			}
+			num++;
+		}
+		event_queue_advance(&reader->node.queue, pos);
+	}
+	return num * NUM_CHARS_PER_KEY;
+}
 
-	printk(KERN_DEBUG DEVICE_NAME ": Queueing reader\n");
-	/* Wait for key to be pressed through interrupt handler */
-	wait_event_interruptible(local_dev->readers_queue,(atomic_read(&local_dev->readers_count) > 0 && (local_dev->key != UNDEFINED_KEY)));
+/* Takes as many whole event records as fit in the user buffer. An event is
+ * released from the queue only after it was copied, a fault keeps it queued
+ * and returns the records already copied.
+ */
+static ssize_t read_events(struct keyboard_reader *reader, keyboard_read_dest *to){
+	struct keyboard_event event;
+	size_t num = 0, max = keyboard_read_left(to) / sizeof(struct keyboard_event);
+	uint32_t pos;
 
-	printk(KERN_DEBUG DEVICE_NAME ": Awake reader \n");
+	while (num < max && event_queue_peek(&reader->node.queue, &event, &pos) == 0) {
+		if (keyboard_read_copy(to, &event, sizeof(event))) {
+			if (num) break;
+			return -EFAULT;
+		}
+		event_queue_advance(&reader->node.queue, pos);
+		num++;
+	}
+	return num * sizeof(struct keyboard_event);
+}
+
+/* Common to both read entry points. A nowait read never sleeps, neither for
+ * events nor behind another read of the same file.
+ */
+static ssize_t read_queue(struct keyboard_reader *reader, keyboard_read_dest *to, int nowait){
+	struct keyboard_dev *local_dev = reader->dev; /* device information */
+	size_t count = keyboard_read_left(to);
+	ssize_t retval = 0;
+	int err;
 
-	/* Decrement readers count and read key as this has been waken up */
-	pressed_key = local_dev->key;
-	if (!atomic_dec_and_test (&local_dev->readers_count)){
-			local_dev->key = UNDEFINED_KEY;	//All readers have already read the pressed key
+	if (count == 0) return -EINVAL;	//Invalid argument
+	if (reader->format != KEYBOARD_FORMAT_ASCII && count < sizeof(struct keyboard_event)) return -EINVAL;
+#ifndef CONFIG_SIMPLE_KEYBOARD_INJECT
+	/* Injection builds deliver synthetic keys even without a configured keyboard */
+	if (!local_dev->configured) return -EFAULT;
+#endif
+
+	/* The irq path only produces into the queue, consuming it just needs
+	 * reads on the same file to be serialized */
+	if (nowait) {
+		if (!mutex_trylock(&reader->read_lock)) return -EAGAIN;
+	} else if (mutex_lock_interruptible(&reader->read_lock)) {
+		return -ERESTARTSYS;
 	}
 
-	/* Copy pressed key to user buffer */
-	pressed_key += '0';	//ASCII code of number
-	if (copy_to_user(buf, &pressed_key, sizeof(uint8_t))) retval = -EFAULT;
-	else retval = NUM_CHARS_PER_KEY;
+	while (retval == 0) {
+		flush_edges(local_dev);	//Edges still staged by the irqs of other CPUs
+		if (event_queue_empty(&reader->node.queue)) {
+			if (nowait) {
+				retval = -EAGAIN;
+				break;
+			}
+
+			/* Wait for key to be pressed through interrupt handler */
+			atomic_inc(&local_dev->readers_count);
+			err = wait_event_interruptible(reader->wait, !event_queue_empty(&reader->node.queue));
+			atomic_dec(&local_dev->readers_count);
+			if (err) {
+				retval = err;
+				break;
+			}
+		}
 
+		if (reader->format != KEYBOARD_FORMAT_ASCII) retval = read_events(reader, to);
+		else retval = read_ascii(reader, to);
+	}
+
+	mutex_unlock(&reader->read_lock);
 	return retval;
 }
 
+#ifdef KEYBOARD_HAVE_READ_ITER
+/* Blocking IO unless O_NONBLOCK or IOCB_NOWAIT (io_uring, RWF_NOWAIT) */
+ssize_t keyboard_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	struct file *filp = iocb->ki_filp;
+
+	return read_queue(filp->private_data, to, (filp->f_flags & O_NONBLOCK) || keyboard_iocb_nowait(iocb));
+}
+#else
+/* Blocking IO unless O_NONBLOCK */
+ssize_t keyboard_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos){
+	keyboard_read_dest to = { .buf = buf, .left = count };
+
+	return read_queue(filp->private_data, &to, filp->f_flags & O_NONBLOCK);
+}
+#endif
+
+unsigned int keyboard_poll(struct file *filp, poll_table *wait){
+	struct keyboard_reader *reader = filp->private_data;
+	unsigned int mask = 0;
+
+	/* Same wake up source as blocking readers */
+	poll_wait(filp, &reader->wait, wait);
+	flush_edges(reader->dev);
+	if (!event_queue_empty(&reader->node.queue)) mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+int keyboard_mmap(struct file *filp, struct vm_area_struct *vma){
+	struct keyboard_reader *reader = filp->private_data;
+	int ret;
+
+	/* Only the whole ring, from its start */
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > reader->ring_bytes) return -EINVAL;
+
+	/* Serialized with IO_KEYBOARD_SET_QUEUE, which swaps the ring. mmap_lock
+	 * is held here and read() may fault with read_lock held, so only ring_lock
+	 */
+	mutex_lock(&reader->ring_lock);
+	if (reader->node.queue.policy == KEYBOARD_QUEUE_DROP_OLDEST) {
+		ret = -EBUSY;	//User space cannot take part in the tail swaps
+	} else {
+		ret = remap_vmalloc_range(vma, reader->node.queue.ring, 0);
+		if (!ret) reader->mapped = 1;
+	}
+	mutex_unlock(&reader->ring_lock);
+	return ret;
+}
+
+/* Called by the event hub with the device lock held, possibly in irq context.
+ * Only files that got events are woken up, from the wake_cpu of the keyboard
+ * if there is one.
+ */
+static void reader_notify(struct event_reader *node, uint8_t keys){
+	struct keyboard_reader *reader = container_of(node, struct keyboard_reader, node);
+	int cpu = affinity_wake_cpu();
+
+	if (cpu >= 0 && cpu != raw_smp_processor_id()) {
+		reader->wake_keys |= keys;
+		irq_work_queue_on(&reader->wake_work, cpu);
+		return;
+	}
+	reader_wake(reader, keys);
+}
+
+/* Device lock held, it keeps the eventfd alive */
+static void reader_wake(struct keyboard_reader *reader, uint8_t keys){
+	wake_up_interruptible_poll(&reader->wait, POLLIN | POLLRDNORM);	//Keyed for io_uring and epoll
+	if (reader->eventfd && (keys & (reader->eventfd_mask | EVENT_NOTIFY_RECORD))) keyboard_eventfd_signal(reader->eventfd);
+}
+
+static void reader_wake_work(struct irq_work *work){
+	struct keyboard_reader *reader = container_of(work, struct keyboard_reader, wake_work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&reader->dev->lock, flags);
+	reader_wake(reader, reader->wake_keys);
+	reader->wake_keys = 0;
+	spin_unlock_irqrestore(&reader->dev->lock, flags);
+}
+
+/* Same context as reader_notify(), before the event is queued */
+static int reader_filter(struct event_reader *node, struct keyboard_event *event){
+	struct keyboard_reader *reader = container_of(node, struct keyboard_reader, node);
+
+	return filter_run(&reader->filter, event);
+}
+
+/* Swaps the filter program of a reader, the old one is freed once the hub
+ * cannot be running it anymore
+ */
+static int set_filter(struct keyboard_reader *reader, const struct keyboard_filter *conf){
+	struct bpf_prog *prog, *old;
+	unsigned long flags;
+	int ret;
+
+	ret = filter_create(conf, &prog);
+	if (ret < 0) return ret;
+
+	spin_lock_irqsave(&reader->dev->lock, flags);
+	old = reader->filter.prog;
+	reader->filter.prog = prog;
+	reader->node.filter = prog ? reader_filter : NULL;
+	spin_unlock_irqrestore(&reader->dev->lock, flags);
+
+	filter_destroy(old);
+	return 0;
+}
+
+/* Swaps the eventfd of a reader, the hub only sees it under the device lock */
+static int set_eventfd(struct keyboard_reader *reader, const struct keyboard_eventfd *conf){
+	struct eventfd_ctx *ctx = NULL, *old;
+	unsigned long flags;
+
+	if (conf->fd >= 0) {
+		if (!(conf->key_mask & ALL_KEYS_MASK)) return -EINVAL;
+		ctx = eventfd_ctx_fdget(conf->fd);
+		if (IS_ERR(ctx)) return PTR_ERR(ctx);
+	}
+
+	spin_lock_irqsave(&reader->dev->lock, flags);
+	old = reader->eventfd;
+	reader->eventfd = ctx;
+	reader->eventfd_mask = ctx ? (conf->key_mask & ALL_KEYS_MASK) : 0;
+	spin_unlock_irqrestore(&reader->dev->lock, flags);
+
+	if (old) eventfd_ctx_put(old);
+	return 0;
+}
+
+static int valid_queue(uint32_t depth, uint32_t policy){
+	if (depth < KEYBOARD_QUEUE_MIN_DEPTH || depth > KEYBOARD_QUEUE_MAX_DEPTH || (depth & (depth - 1))) return -EINVAL;
+	if (policy > KEYBOARD_QUEUE_COALESCE) return -EINVAL;
+	return 0;
+}
+
+static void get_queue(struct keyboard_reader *reader, struct keyboard_queue *conf){
+	struct event_queue *q = &reader->node.queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(&reader->dev->lock, flags);
+	conf->depth = q->mask + 1;
+	conf->policy = q->policy;
+	conf->len = event_queue_len(q);
+	conf->dropped = q->ring->dropped;
+	conf->coalesced = q->coalesced;
+	conf->overruns = q->overruns;
+	spin_unlock_irqrestore(&reader->dev->lock, flags);
+}
+
+/* Both ends of the queue are stopped while it changes: read() through
+ * read_lock (EBUSY if one is blocked on the file), mmap() through ring_lock
+ * and the hub through the device lock. Waiting events move to the new ring
+ * under its policy.
+ */
+static int set_queue(struct keyboard_reader *reader, const struct keyboard_queue *conf){
+	struct event_queue *q = &reader->node.queue, resized;
+	struct keyboard_ring *ring = NULL, *old = NULL;
+	struct keyboard_event event;
+	unsigned long flags;
+	int ret;
+
+	ret = valid_queue(conf->depth, conf->policy);
+	if (ret < 0) return ret;
+	if (!mutex_trylock(&reader->read_lock)) return -EBUSY;
+	mutex_lock(&reader->ring_lock);
+
+	if (reader->mapped && (conf->depth != q->mask + 1 || conf->policy == KEYBOARD_QUEUE_DROP_OLDEST)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+	if (conf->depth != q->mask + 1) {
+		ring = vmalloc_user(READER_RING_BYTES(conf->depth));
+		if (!ring) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+		event_queue_init(&resized, ring, conf->depth);
+		resized.policy = conf->policy;
+	}
+
+	spin_lock_irqsave(&reader->dev->lock, flags);
+	if (ring) {
+		resized.lost = q->lost;
+		resized.coalesced = q->coalesced;
+		resized.overruns = q->overruns;
+		ring->dropped = q->ring->dropped;
+		while (event_queue_pop(q, &event) == 0) event_queue_push(&resized, &event);
+		old = q->ring;
+		*q = resized;
+		reader->ring_bytes = READER_RING_BYTES(conf->depth);
+	} else {
+		q->policy = conf->policy;
+	}
+	spin_unlock_irqrestore(&reader->dev->lock, flags);
+	vfree(old);
+
+unlock:
+	mutex_unlock(&reader->ring_lock);
+	mutex_unlock(&reader->read_lock);
+	return ret;
+}
+
+/* sysfs "state": same answer as IO_KEYBOARD_GET_STATE */
+static ssize_t state_show(struct device *device, struct device_attribute *attr, char *buf){
+	struct keyboard_state state;
+
+	get_key_state(dev, &state);
+	return sprintf(buf, "%02x %llu %u\n", state.keys, (unsigned long long)state.timestamp, state.sequence);
+}
+
+/* sysfs "recovered": "<presses> <releases>" the line resampling made up for */
+static ssize_t recovered_show(struct device *device, struct device_attribute *attr, char *buf){
+	return sprintf(buf, "%u %u\n", READ_ONCE(dev->recovered_presses), READ_ONCE(dev->recovered_releases));
+}
+
+/* Configuration snapshot, called with config_lock held */
+static void get_config(struct keyboard_dev *local_dev, struct keyboard_config *conf){
+	unsigned long flags;
+
+	memset(conf, 0, sizeof(struct keyboard_config));
+	conf->version = KEYBOARD_CONFIG_VERSION;
+	if (!local_dev->configured)
+		conf->mode = KEYBOARD_MODE_NONE;
+	else if (local_dev->timer_polled)
+		conf->mode = KEYBOARD_MODE_TIMER_POLL;
+	else
+		conf->mode = local_dev->is_pollable ? KEYBOARD_MODE_SINGLE_LINE : KEYBOARD_MODE_MULTI_LINE;
+	export_config(&conf->pins);
+	spin_lock_irqsave(&local_dev->lock, flags);
+	conf->debounce_ns = local_dev->keys.debounce_ns;
+	spin_unlock_irqrestore(&local_dev->lock, flags);
+}
+
+/* Sets up pins and irqs for mode with the current pin_config, the mode must
+ * have been checked by the planner
+ */
+static int start_mode(struct keyboard_dev *local_dev, uint32_t mode){
+	int ret;
+
+	if (mode == KEYBOARD_MODE_NONE) return 0;
+	local_dev->is_pollable = (mode == KEYBOARD_MODE_SINGLE_LINE);
+	local_dev->timer_polled = (mode == KEYBOARD_MODE_TIMER_POLL);
+	ret = init_system(local_dev);
+	if (!ret) local_dev->configured = 0x1;
+	return ret;
+}
+
+/* Plans mode (KEYBOARD_MODE_AUTO included) for the current pin_config and
+ * sets it up, nothing is requested if the plan does not fit
+ */
+static int configure_mode(struct keyboard_dev *local_dev, uint32_t mode){
+	struct keyboard_plan plan;
+	struct pin_conf pins;
+	int ret;
+
+	export_config(&pins);
+	ret = plan_acquisition(&pins, mode, &plan);
+	if (ret) return ret;
+	ret = start_mode(local_dev, plan.mode);
+	if (!ret) active_plan = plan;
+	return ret;
+}
+
+/* Plan of the running configuration, or what AUTO would do with the pins */
+static void get_plan(struct keyboard_dev *local_dev, struct keyboard_plan *plan){
+	struct pin_conf pins;
+
+	if (local_dev->configured) {
+		*plan = active_plan;
+		return;
+	}
+	export_config(&pins);
+	plan_acquisition(&pins, KEYBOARD_MODE_AUTO, plan);
+}
+
+/* Applies a whole configuration, called with config_lock held. The running
+ * setup is only torn down when mode or pins change.
+ */
+static int set_config(struct keyboard_dev *local_dev, const struct keyboard_config *conf){
+	struct keyboard_config old;
+	struct keyboard_plan plan;
+	struct pin_conf pins = conf->pins;
+	unsigned long flags;
+	uint32_t mode = conf->mode;
+	int changed, ret;
+
+	if (conf->version != KEYBOARD_CONFIG_VERSION || conf->mode > KEYBOARD_MODE_AUTO) return -EINVAL;
+
+	/* Check the new pins before anything running is touched */
+	if (mode != KEYBOARD_MODE_NONE) {
+		ret = plan_acquisition(&pins, mode, &plan);
+		if (ret) return ret;
+		mode = plan.mode;
+	}
+
+	get_config(local_dev, &old);
+	changed = old.mode != mode || memcmp(&old.pins, &conf->pins, sizeof(struct pin_conf));
+	if (changed) {
+		if (local_dev->configured) {
+			if (atomic_read(&local_dev->readers_count) != 0) return -EBUSY;
+			shutdown_system();
+			local_dev->configured = 0;
+			local_dev->is_pollable = 0;
+			local_dev->timer_polled = 0;
+		}
+		populate_config(&pins);
+		ret = start_mode(local_dev, mode);
+		if (!ret && mode != KEYBOARD_MODE_NONE) active_plan = plan;
+		if (ret) {
+			keyboard_trace("NEW CONFIG FAILED, RESTORING THE OLD ONE \n");
+			populate_config(&old.pins);
+			if (start_mode(local_dev, old.mode))
+				pr_err(DEVICE_NAME ": Unable to restore the old config, device left unconfigured\n");
+			return ret;
+		}
+	}
+
+	spin_lock_irqsave(&local_dev->lock, flags);
+	if (changed)
+		key_state_init(&local_dev->keys, conf->debounce_ns);	//New lines, all keys up again
+	else
+		local_dev->keys.debounce_ns = conf->debounce_ns;
+	spin_unlock_irqrestore(&local_dev->lock, flags);
+	return 0;
+}
+
+/* Commands that only touch this file, and GET_STATE, never wait for the
+ * configuration lock. Returns -ENOIOCTLCMD for any other command.
+ */
+static long file_ioctl(struct keyboard_reader *reader, unsigned int cmd, unsigned long arg){
+	struct keyboard_dev *local_dev = reader->dev;
+	struct keyboard_eventfd eventfd_conf;
+	struct keyboard_state state;
+	struct keyboard_filter filter_conf;
+	struct keyboard_queue queue;
+	unsigned long flags;
+	long ret;
+
+	switch (cmd) {
+
+		case IO_KEYBOARD_SET_FORMAT://Select what read() returns
+			if (arg != KEYBOARD_FORMAT_ASCII && arg != KEYBOARD_FORMAT_EVENTS && arg != KEYBOARD_FORMAT_GESTURES) {
+				ret = -EINVAL;
+			} else {
+				spin_lock_irqsave(&local_dev->lock, flags);
+				reader->format = arg;
+				reader->node.gestures = (arg == KEYBOARD_FORMAT_GESTURES);
+				spin_unlock_irqrestore(&local_dev->lock, flags);
+				ret = 0;
+			}
+			break;
+
+		case IO_KEYBOARD_SET_CLOCK://Clock of the timestamps of this file
+			ret = set_clock(local_dev, &reader->node, arg);
+			break;
+
+		case IO_KEYBOARD_GET_RING_SIZE://Length to map the ring of this file
+			ret = put_user(reader->ring_bytes, (uint32_t __user *)arg);
+			break;
+
+		case IO_KEYBOARD_SET_EVENTFD://Notify an eventfd instead of waking read()
+			if (copy_from_user(&eventfd_conf, (struct keyboard_eventfd __user *)arg, sizeof(struct keyboard_eventfd))) {
+				ret = -EFAULT;
+			} else {
+				ret = set_eventfd(reader, &eventfd_conf);
+			}
+			break;
+
+		case IO_KEYBOARD_GET_STATE://Keys down right now, does not block
+			/* The lines are only sampled if no configuration command is
+			 * running, otherwise the cached state is current enough
+			 */
+			if (mutex_trylock(&local_dev->config_lock)) {
+				get_key_state(local_dev, &state);
+				mutex_unlock(&local_dev->config_lock);
+			} else {
+				peek_key_state(local_dev, &state);
+			}
+			ret = copy_to_user((struct keyboard_state __user *)arg, &state, sizeof(struct keyboard_state)) ? -EFAULT : 0;
+			break;
+
+		case IO_KEYBOARD_SET_FILTER://Per file event filter program
+			if (copy_from_user(&filter_conf, (struct keyboard_filter __user *)arg, sizeof(struct keyboard_filter))) {
+				ret = -EFAULT;
+			} else {
+				ret = set_filter(reader, &filter_conf);
+			}
+			break;
+
+		case IO_KEYBOARD_GET_QUEUE://Queue of this file and its losses
+			get_queue(reader, &queue);
+			ret = copy_to_user((struct keyboard_queue __user *)arg, &queue, sizeof(struct keyboard_queue)) ? -EFAULT : 0;
+			break;
+
+		case IO_KEYBOARD_SET_QUEUE://Queue depth and overflow policy of this file
+			if (copy_from_user(&queue, (struct keyboard_queue __user *)arg, sizeof(struct keyboard_queue))) {
+				ret = -EFAULT;
+			} else {
+				ret = set_queue(reader, &queue);
+			}
+			break;
+
+		default:
+			ret = -ENOIOCTLCMD;
+	}
+	return ret;
+}
+
 long keyboard_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
-	struct keyboard_dev *local_dev = filp->private_data; /* device information */
+	struct keyboard_reader *reader = filp->private_data;
+	struct keyboard_dev *local_dev = reader->dev; /* device information */
 	struct pin_conf custom_pins;
+	struct keyboard_config config;
+	struct keyboard_plan plan;
+	struct keyboard_gestures gestures;
+#ifdef CONFIG_SIMPLE_KEYBOARD_INJECT
+	struct keyboard_inject inject_conf;
+#endif
+	unsigned long flags;
 	int ret;
-	printk(KERN_DEBUG DEVICE_NAME ":INSIDE KERNEL CONFIGURING....\n");
-	printk(KERN_DEBUG DEVICE_NAME ": THE KEY IS %c \n",local_dev->key + '0');
+	keyboard_trace("INSIDE KERNEL CONFIGURING....\n");
+
+	ret = file_ioctl(reader, cmd, arg);
+	if (ret != -ENOIOCTLCMD) return ret;
+
+	/* Commands of different processes must not interleave */
+	if (mutex_lock_interruptible(&local_dev->config_lock)) return -ERESTARTSYS;
+	ret = pm_get();		//Pins and irqs are only touched while powered
+	if (ret < 0) {
+		mutex_unlock(&local_dev->config_lock);
+		return ret;
+	}
 
-	switch (cmd) {				//TODO Would be great if could be added command for retrieving pin config
+	switch (cmd) {
 
 		case IO_KEYBOARD_RESET://Reset data
-			printk(KERN_DEBUG DEVICE_NAME ": RESET DEVICE COMMAND RECEIVED \n");
+			keyboard_trace("RESET DEVICE COMMAND RECEIVED \n");
 			if (atomic_read(&local_dev->readers_count) == 0 && (local_dev->configured)) {
 				local_dev->is_pollable = 0;
-				local_dev->key = UNDEFINED_KEY;
+				local_dev->timer_polled = 0;
 				shutdown_system();
+				spin_lock_irqsave(&local_dev->lock, flags);
+				key_state_init(&local_dev->keys, local_dev->keys.debounce_ns);	//All keys up again
+				spin_unlock_irqrestore(&local_dev->lock, flags);
 				local_dev->configured = 0;
 				ret = 0;
 			} else ret = -EINVAL;
@@ -174,12 +868,12 @@ long keyboard_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long
 
 		case IO_KEYBOARD_CONFIG_PINMUX://Configure pin numbers
 		/* In this case, arg is a pointer to a pin_config struct */
-			printk(KERN_DEBUG DEVICE_NAME ": CONFIGURING SYSTEM PINMUXING  \n");
+			keyboard_trace("CONFIGURING SYSTEM PINMUXING  \n");
 			if (local_dev->configured) {
 				ret = -EINVAL;  //If already configured return
 			} else {
-				printk(KERN_DEBUG DEVICE_NAME ": INITIALIZING SYSTEM.... \n");
-				if (!access_ok(VERIFY_READ, (const void *)arg, sizeof(custom_pins))){
+				keyboard_trace("INITIALIZING SYSTEM.... \n");
+				if (!keyboard_access_ok(VERIFY_READ, (const void *)arg, sizeof(custom_pins))){
 					ret = -EINVAL;
 				} else {
 						ret = copy_from_user(&custom_pins,(struct custom_pins*) arg, sizeof(struct pin_conf));
@@ -193,58 +887,132 @@ long keyboard_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long
 			break;
 
 		case IO_KEYBOARD_CONFIG_MULTI_LINE://Configure mode for multiple irqs
-			printk(KERN_DEBUG DEVICE_NAME ": CONFIGURING SYSTEM FOR MULTI IRQS MODE  \n");
+			keyboard_trace("CONFIGURING SYSTEM FOR MULTI IRQS MODE  \n");
 			if (local_dev->configured) {
 				ret = -EINVAL;  //If already configured return
 			} else {
-				printk(KERN_DEBUG DEVICE_NAME ": INITIALIZING SYSTEM.... \n");
-				local_dev->is_pollable = 0x0;
-				ret = init_system(filp->private_data);
-				if (!ret){	//Initialized without errors
-					local_dev->configured = 0x1;
-				}
+				keyboard_trace("INITIALIZING SYSTEM.... \n");
+				ret = configure_mode(local_dev, KEYBOARD_MODE_MULTI_LINE);
 			}
 			break;
 
 			case IO_KEYBOARD_CONFIG_SINGLE_LINE://Configure mode for single irq and polling
-				printk(KERN_DEBUG DEVICE_NAME ": CONFIGURING SYSTEM FOR SINGLE IRQS MODE  \n");
+				keyboard_trace("CONFIGURING SYSTEM FOR SINGLE IRQS MODE  \n");
 				if (local_dev->configured) {
 					ret = -EINVAL;  //If already configured return
 				} else {
-					printk(KERN_DEBUG DEVICE_NAME ": INITIALIZING SYSTEM.... \n");
-					local_dev->is_pollable = 0x1;
-					ret = init_system(filp->private_data);
-					if (!ret){	//Initialized without errors
-						local_dev->configured = 0x1;
-					}
+					keyboard_trace("INITIALIZING SYSTEM.... \n");
+					ret = configure_mode(local_dev, KEYBOARD_MODE_SINGLE_LINE);
 				}
 				break;
 
-		default:	/* Invalid command */
-			if (local_dev->configured) { //Shutting down everything if needed
-				shutdown_system();
+		case IO_KEYBOARD_GET_CONFIG://Snapshot of the whole configuration
+			get_config(local_dev, &config);
+			ret = copy_to_user((struct keyboard_config __user *)arg, &config, sizeof(struct keyboard_config)) ? -EFAULT : 0;
+			break;
+
+		case IO_KEYBOARD_SET_CONFIG://Apply a whole configuration at once
+			keyboard_trace("SET CONFIG COMMAND RECEIVED \n");
+			if (copy_from_user(&config, (struct keyboard_config __user *)arg, sizeof(struct keyboard_config))) {
+				ret = -EFAULT;
+			} else {
+				ret = set_config(local_dev, &config);
+			}
+			break;
+
+		case IO_KEYBOARD_GET_PLAN://How the keys are acquired and why
+			get_plan(local_dev, &plan);
+			ret = copy_to_user((struct keyboard_plan __user *)arg, &plan, sizeof(struct keyboard_plan)) ? -EFAULT : 0;
+			break;
+
+		case IO_KEYBOARD_GET_GESTURES://Gesture thresholds of every key
+			get_gestures(local_dev, &gestures);
+			ret = copy_to_user((struct keyboard_gestures __user *)arg, &gestures, sizeof(struct keyboard_gestures)) ? -EFAULT : 0;
+			break;
+
+		case IO_KEYBOARD_SET_GESTURES://Gesture thresholds for the whole device
+			if (copy_from_user(&gestures, (struct keyboard_gestures __user *)arg, sizeof(struct keyboard_gestures))) {
+				ret = -EFAULT;
+			} else {
+				set_gestures(local_dev, &gestures);
+				ret = 0;
+			}
+			break;
+
+#ifdef CONFIG_SIMPLE_KEYBOARD_INJECT
+		case IO_KEYBOARD_INJECT://Inject synthetic key events
+			keyboard_trace("INJECT COMMAND RECEIVED \n");
+			if (!capable(CAP_SYS_ADMIN)) {
+				ret = -EPERM;
+			} else if (copy_from_user(&inject_conf, (struct keyboard_inject*) arg, sizeof(struct keyboard_inject))) {
+				ret = -EFAULT;
+			} else {
+				ret = inject_start(&inject_conf);
 			}
-			ret = -ENOTTY;
+			break;
+#endif
+
+		default:	/* Invalid command, probes for newer commands end up here */
+			ret = -ENOTTY;	//The running setup is left alone
 	}
 
+	pm_put();
+	mutex_unlock(&local_dev->config_lock);
 	return ret;
 }
 
 int keyboard_release(struct inode *inode, struct file *filp){
-	printk(KERN_DEBUG DEVICE_NAME ": CLOSING THIS DEVICE !!!!!!!!!!!!!!\n");
+	struct keyboard_reader *reader = filp->private_data;
+	unsigned long flags;
+
+	keyboard_trace("CLOSING THIS DEVICE !!!!!!!!!!!!!!\n");
+	set_clock(reader->dev, &reader->node, KEYBOARD_CLOCK_MONOTONIC);	//Stops its records
+	spin_lock_irqsave(&reader->dev->lock, flags);
+	event_hub_remove(&reader->dev->hub, &reader->node);
+	spin_unlock_irqrestore(&reader->dev->lock, flags);
+	irq_work_sync(&reader->wake_work);	//A wake up may still be on its way
+	if (reader->eventfd) eventfd_ctx_put(reader->eventfd);
+	filter_destroy(reader->filter.prog);
+	vfree(reader->node.queue.ring);
+	kfree(reader);
+	pm_put();
 	return 0;
 }
 
 void keyboard_exit(void){
 
-	/* Release all irqs and gpios requested on initialization */
-	shutdown_system();
+	/* No new recorders nor replays */
+	record_exit();
+
+	/* Stop synthetic events before the device goes away */
+	inject_stop();
+	gesture_stop();
+	clock_exit();
+
+	/* No more multicast, subscribers just stop getting messages */
+	netlink_exit();
+
+	/* The irqs must not be moved while they are released */
+	affinity_teardown(keyboard_device);
+
+	/* Back to full power and no more PM callbacks */
+	pm_teardown(keyboard_device);
+
+	/* Release all irqs and gpios requested by the running configuration */
+	if (dev->configured) shutdown_system();
+
+	/* Attributes first, they use the memory freed below */
+	device_remove_file(keyboard_device, &dev_attr_recovered);
+	device_remove_file(keyboard_device, &dev_attr_state);
 
 	/* Delete char device from kernel space */
 	printk(KERN_INFO DEVICE_NAME ": Deleting char device...\n");
 	cdev_del(&dev->cdev);
 	printk(KERN_INFO DEVICE_NAME ": Char device deleted\n");
 
+	/* Nothing can report nor merge edges anymore */
+	edges_exit();
+
 	/* Free memory used */
 	printk(KERN_INFO DEVICE_NAME ": Freeing memory...\n");
 	kfree(dev);
@@ -0,0 +1,520 @@
+#include "keyboard-port.h"
+#include "keyboard-driver.h"
+#include "keyboard-events.h"
+
+static int queue_full(struct event_queue *q, const struct keyboard_event *event);
+static int debounced(struct key_state *ks, int idx, uint64_t now);
+static void emit(struct key_state *ks, uint8_t key, uint8_t type, uint64_t now, struct keyboard_event *out);
+static int gesture_step(struct gesture_state *gs, const struct keyboard_event *event, struct keyboard_event *out);
+static void gesture_timeout(struct gesture_state *gs, int idx, uint8_t state, struct keyboard_event *out);
+static void gesture_emit(uint8_t key, uint8_t type, uint64_t when, uint8_t state, struct keyboard_event *out);
+
+/* Phases of a key in the gesture recognizer */
+enum gesture_phase {
+	GESTURE_IDLE,
+	GESTURE_DOWN,		//Pressed, LONG_PRESS at the deadline
+	GESTURE_HELD,		//LONG_PRESS given, HOLD_RELEASE on release
+	GESTURE_TAPPED,		//Released early, TAP at the deadline unless pressed again
+	GESTURE_SECOND,		//DOUBLE_TAP given, its release is swallowed
+};
+
+
+/*
+ *		EVENT QUEUE
+ */
+int event_queue_init(struct event_queue *q, struct keyboard_ring *ring, uint32_t size){
+	if (size == 0 || (size & (size - 1))) return -EINVAL;	//Power of 2 only
+	q->ring = ring;
+	q->mask = size - 1;
+	q->policy = KEYBOARD_QUEUE_DROP_NEWEST;
+	q->lost = 0;
+	q->coalesced = 0;
+	q->overruns = 0;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = q->mask;
+	ring->dropped = 0;
+	return 0;
+}
+
+/* Producer side, the event is visible before the new head. After a loss the
+ * next event needs room for a marker too, so the marker always comes first.
+ */
+int event_queue_push(struct event_queue *q, const struct keyboard_event *event){
+	struct keyboard_ring *ring = q->ring;
+	uint32_t head = ring->head;
+	uint32_t need = q->lost ? 2 : 1;
+	int ret;
+
+	if (unlikely(q->mask + 1 - (head - port_load_acquire(&ring->tail)) < need)) {
+		ret = queue_full(q, event);
+		if (ret) return ret > 0 ? 0 : ret;
+	}
+
+	if (unlikely(q->lost)) {
+		struct keyboard_event *marker = &ring->events[head & q->mask];
+
+		memset(marker, 0, sizeof(struct keyboard_event));
+		marker->timestamp = event->timestamp;
+		marker->sequence = q->lost;
+		marker->type = KEYBOARD_EVENT_OVERRUN;
+		marker->state = event->state;
+		q->lost = 0;
+		q->overruns++;
+		head++;
+	}
+	ring->events[head & q->mask] = *event;
+	port_store_release(&ring->head, head + 1);
+	return 0;
+}
+
+/* Applies the overflow policy. Returns 0 once there is room for the event
+ * (and a marker if needed), 1 if it was folded into the newest one or -ENOSPC
+ * if it is lost.
+ */
+static int queue_full(struct event_queue *q, const struct keyboard_event *event){
+	struct keyboard_ring *ring = q->ring;
+	struct keyboard_event *newest, oldest;
+	uint32_t head = ring->head, tail, need;
+
+	switch (q->policy) {
+		case KEYBOARD_QUEUE_DROP_OLDEST:
+			for (;;) {
+				tail = port_load_acquire(&ring->tail);
+				need = q->lost ? 2 : 1;		//The marker needs room once something is lost
+				if (q->mask + 1 - (head - tail) >= need) return 0;
+				oldest = ring->events[tail & q->mask];	//Only the producer writes slots
+				if (port_cmpxchg(&ring->tail, tail, tail + 1) != tail) continue;	//Consumer took it
+				if (oldest.type == KEYBOARD_EVENT_OVERRUN) {
+					q->lost += oldest.sequence;	//Its losses move to the next marker
+				} else {
+					q->lost++;
+					ring->dropped++;
+				}
+			}
+
+		case KEYBOARD_QUEUE_COALESCE:
+			/* Only flags of a published event are touched, a reader racing
+			 * with it sees either count */
+			newest = &ring->events[(head - 1) & q->mask];
+			if (!q->lost && newest->key == event->key && newest->type == event->type && newest->type != KEYBOARD_EVENT_OVERRUN) {
+				if (newest->flags != 0xff) newest->flags++;
+				q->coalesced++;
+				return 1;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	q->lost++;
+	ring->dropped++;
+	return -ENOSPC;
+}
+
+/* Consumer side, the slot is released after the event has been copied. If
+ * the producer may drop from the tail the copy only counts when the swap
+ * proves the slot was not reused meanwhile.
+ */
+int event_queue_pop(struct event_queue *q, struct keyboard_event *event){
+	struct keyboard_ring *ring = q->ring;
+	uint32_t tail = ring->tail;
+
+	if (unlikely(q->policy == KEYBOARD_QUEUE_DROP_OLDEST)) {
+		do {
+			tail = port_load_acquire(&ring->tail);
+			if (port_load_acquire(&ring->head) == tail) return -EAGAIN;
+			*event = ring->events[tail & q->mask];
+		} while (port_cmpxchg(&ring->tail, tail, tail + 1) != tail);
+		return 0;
+	}
+
+	if (unlikely(port_load_acquire(&ring->head) == tail)) return -EAGAIN;
+	*event = ring->events[tail & q->mask];
+	port_store_release(&ring->tail, tail + 1);
+	return 0;
+}
+
+/* Consumer side in two steps, for readers that may fail to deliver the event.
+ * The oldest event is copied and its position stored in pos, it stays queued
+ * until event_queue_advance() releases it. A slot reused by a dropping
+ * producer during the copy is read again.
+ */
+int event_queue_peek(struct event_queue *q, struct keyboard_event *event, uint32_t *pos){
+	struct keyboard_ring *ring = q->ring;
+	uint32_t tail;
+
+	do {
+		tail = port_load_acquire(&ring->tail);
+		if (port_load_acquire(&ring->head) == tail) return -EAGAIN;
+		*event = ring->events[tail & q->mask];
+	} while (unlikely(q->policy == KEYBOARD_QUEUE_DROP_OLDEST) && port_load_acquire(&ring->tail) != tail);
+	*pos = tail;
+	return 0;
+}
+
+/* Releases the event peeked at pos, unless the producer already dropped it */
+void event_queue_advance(struct event_queue *q, uint32_t pos){
+	if (unlikely(q->policy == KEYBOARD_QUEUE_DROP_OLDEST)) {
+		port_cmpxchg(&q->ring->tail, pos, pos + 1);
+		return;
+	}
+	port_store_release(&q->ring->tail, pos + 1);
+}
+
+
+/*
+ *		KEY STATE
+ */
+void key_state_init(struct key_state *ks, uint64_t debounce_ns){
+	memset(ks, 0, sizeof(struct key_state));
+	ks->debounce_ns = debounce_ns;
+}
+
+/* A rising edge was seen on the line of key. If the key was already down its
+ * release went unnoticed, so it is generated before the new press.
+ * Returns the number of events written to out (2 at most).
+ */
+int key_state_edge(struct key_state *ks, uint8_t key, uint64_t now, struct keyboard_event *out){
+	int num = 0;
+
+	if (key == UNDEFINED_KEY || key > NUM_KEYS) return 0;
+	if (debounced(ks, key - 1, now)) return 0;
+
+	if (ks->state & KEY_BIT(key)) emit(ks, key, KEYBOARD_EVENT_RELEASE, now, &out[num++]);
+	emit(ks, key, KEYBOARD_EVENT_PRESS, now, &out[num++]);
+	return num;
+}
+
+/* A sample of the lines in valid was taken, an event is generated for every
+ * key whose line changed since the last accepted state.
+ * Returns the number of events written to out (NUM_KEYS at most).
+ */
+int key_state_update(struct key_state *ks, uint8_t sampled, uint8_t valid, uint64_t now, struct keyboard_event *out){
+	uint8_t changed = (ks->state ^ sampled) & valid & ALL_KEYS_MASK;
+	int idx, num = 0;
+
+	for (idx = 0; changed; idx++, changed >>= 1) {
+		if (!(changed & 1) || debounced(ks, idx, now)) continue;
+		emit(ks, idx + 1, (sampled & (1 << idx)) ? KEYBOARD_EVENT_PRESS : KEYBOARD_EVENT_RELEASE, now, &out[num++]);
+	}
+	return num;
+}
+
+/* A staged entry of the key lines. A line read low only releases a key that
+ * is down. It was read after the press was handled, so it is not a bounce and
+ * skips the debounce window, but still opens one for the next edge.
+ * Returns the number of events written to out (2 at most).
+ */
+int key_state_entry(struct key_state *ks, const struct edge_entry *entry, struct keyboard_event *out){
+	int idx = entry->key - 1;
+
+	if (entry->low) {
+		if (entry->key == UNDEFINED_KEY || entry->key > NUM_KEYS) return 0;
+		if (!(ks->state & KEY_BIT(entry->key))) return 0;
+		ks->edge_seen |= 1 << idx;
+		ks->last_edge[idx] = entry->timestamp;
+		emit(ks, entry->key, KEYBOARD_EVENT_RELEASE, entry->timestamp, out);
+		return 1;
+	}
+	return key_state_edge(ks, entry->key, entry->timestamp, out);
+}
+
+/* Checks the edge against the debounce window and records it if accepted */
+static int debounced(struct key_state *ks, int idx, uint64_t now){
+	if ((ks->edge_seen & (1 << idx)) && now - ks->last_edge[idx] < ks->debounce_ns) return 1;
+	ks->edge_seen |= 1 << idx;
+	ks->last_edge[idx] = now;
+	return 0;
+}
+
+static void emit(struct key_state *ks, uint8_t key, uint8_t type, uint64_t now, struct keyboard_event *out){
+	if (type == KEYBOARD_EVENT_PRESS) ks->state |= KEY_BIT(key);
+	else ks->state &= ~KEY_BIT(key);
+	ks->last_change = now;
+
+	out->timestamp = now;
+	out->sequence = ks->sequence++;
+	out->key = key;
+	out->type = type;
+	out->state = ks->state;
+	out->flags = 0;
+}
+
+
+/*
+ *		GESTURES
+ */
+void gesture_state_init(struct gesture_state *gs){
+	memset(gs, 0, sizeof(struct gesture_state));
+}
+
+/* A gesture in progress is only dropped if the thresholds of its key change */
+void gesture_state_set(struct gesture_state *gs, uint8_t key, uint64_t long_ns, uint64_t double_ns){
+	int idx = key - 1;
+
+	if (key == UNDEFINED_KEY || key > NUM_KEYS) return;
+	if (gs->long_ns[idx] == long_ns && gs->double_ns[idx] == double_ns) return;
+
+	gs->long_ns[idx] = long_ns;
+	gs->double_ns[idx] = double_ns;
+	gs->phase[idx] = GESTURE_IDLE;
+	gs->deadline[idx] = 0;
+	if (long_ns || double_ns) gs->enabled |= KEY_BIT(key);
+	else gs->enabled &= ~KEY_BIT(key);
+}
+
+/* Runs the events just generated by ks through the recognizer and inserts the
+ * gestures they complete in events, which must have room for
+ * GESTURE_MAX_EVENTS(num). Deadlines reached before an event of the same key
+ * are handled first, so a late timer never reorders a key. The whole batch
+ * is renumbered to keep sequences consecutive.
+ * Returns the new number of events.
+ */
+int gesture_state_feed(struct gesture_state *gs, struct key_state *ks, struct keyboard_event *events, int num){
+	struct keyboard_event in[NUM_KEYS];
+	uint32_t base;
+	int i, idx, total = 0;
+
+	if (num <= 0 || num > NUM_KEYS) return num;
+	memcpy(in, events, num * sizeof(struct keyboard_event));
+	base = in[0].sequence;
+
+	for (i = 0; i < num; i++) {
+		idx = in[i].key - 1;
+		if (!(gs->enabled & KEY_BIT(in[i].key))) {
+			events[total++] = in[i];
+			continue;
+		}
+		if (gs->deadline[idx] && gs->deadline[idx] <= in[i].timestamp)
+			gesture_timeout(gs, idx, in[i].state ^ KEY_BIT(in[i].key), &events[total++]);	//State before the event
+		events[total++] = in[i];
+		total += gesture_step(gs, &in[i], &events[total]);
+	}
+
+	for (i = 0; i < total; i++) events[i].sequence = base + i;
+	ks->sequence = base + total;
+	return total;
+}
+
+/* Gestures whose deadline is now or earlier, one per key at most.
+ * Returns the number of events written to out (NUM_KEYS at most).
+ */
+int gesture_state_expire(struct gesture_state *gs, struct key_state *ks, uint64_t now, struct keyboard_event *out){
+	int idx, num = 0;
+
+	for (idx = 0; idx < NUM_KEYS; idx++) {
+		if (!gs->deadline[idx] || gs->deadline[idx] > now) continue;
+		gesture_timeout(gs, idx, ks->state, &out[num]);
+		out[num++].sequence = ks->sequence++;
+	}
+	return num;
+}
+
+/* Earliest deadline of all keys, 0 if nothing is waiting */
+uint64_t gesture_state_deadline(const struct gesture_state *gs){
+	uint64_t next = 0;
+	int idx;
+
+	for (idx = 0; idx < NUM_KEYS; idx++) {
+		if (gs->deadline[idx] && (!next || gs->deadline[idx] < next)) next = gs->deadline[idx];
+	}
+	return next;
+}
+
+/* Moves a key through its phases with a press or release.
+ * Returns the number of gestures written to out (1 at most).
+ */
+static int gesture_step(struct gesture_state *gs, const struct keyboard_event *event, struct keyboard_event *out){
+	int idx = event->key - 1;
+
+	if (event->type == KEYBOARD_EVENT_PRESS) {
+		if (gs->phase[idx] == GESTURE_TAPPED) {
+			gs->phase[idx] = GESTURE_SECOND;
+			gs->deadline[idx] = 0;
+			gesture_emit(event->key, KEYBOARD_EVENT_DOUBLE_TAP, event->timestamp, event->state, out);
+			return 1;
+		}
+		gs->phase[idx] = GESTURE_DOWN;
+		gs->since[idx] = event->timestamp;
+		gs->deadline[idx] = gs->long_ns[idx] ? event->timestamp + gs->long_ns[idx] : 0;
+		return 0;
+	}
+
+	switch (gs->phase[idx]) {
+		case GESTURE_DOWN:
+			if (gs->double_ns[idx]) {
+				gs->phase[idx] = GESTURE_TAPPED;
+				gs->since[idx] = event->timestamp;
+				gs->deadline[idx] = event->timestamp + gs->double_ns[idx];
+				return 0;
+			}
+			gs->phase[idx] = GESTURE_IDLE;
+			gs->deadline[idx] = 0;
+			gesture_emit(event->key, KEYBOARD_EVENT_TAP, event->timestamp, event->state, out);
+			return 1;
+
+		case GESTURE_HELD:
+			gs->phase[idx] = GESTURE_IDLE;
+			gesture_emit(event->key, KEYBOARD_EVENT_HOLD_RELEASE, event->timestamp, event->state, out);
+			return 1;
+
+		case GESTURE_SECOND:
+			gs->phase[idx] = GESTURE_IDLE;
+			return 0;
+
+		default:
+			return 0;
+	}
+}
+
+/* The deadline of a key was reached, only DOWN and TAPPED have one */
+static void gesture_timeout(struct gesture_state *gs, int idx, uint8_t state, struct keyboard_event *out){
+	gs->deadline[idx] = 0;
+	if (gs->phase[idx] == GESTURE_DOWN) {
+		gs->phase[idx] = GESTURE_HELD;
+		gesture_emit(idx + 1, KEYBOARD_EVENT_LONG_PRESS, gs->since[idx] + gs->long_ns[idx], state, out);
+	} else {
+		gs->phase[idx] = GESTURE_IDLE;
+		gesture_emit(idx + 1, KEYBOARD_EVENT_TAP, gs->since[idx], state, out);
+	}
+}
+
+/* Sequence is set by the caller */
+static void gesture_emit(uint8_t key, uint8_t type, uint64_t when, uint8_t state, struct keyboard_event *out){
+	out->timestamp = when;
+	out->sequence = 0;
+	out->key = key;
+	out->type = type;
+	out->state = state;
+	out->flags = 0;
+}
+
+
+/*
+ *		EDGE STAGING
+ */
+void edge_stage_init(struct edge_stage *st){
+	st->head = 0;
+	st->tail = 0;
+	st->busy = 0;
+}
+
+/* Producer side, -ENOSPC if the consumer is behind. Within a stage edges are
+ * staged in time order, the producer runs with its own irqs off.
+ */
+int edge_stage_push(struct edge_stage *st, uint8_t key, uint8_t low, uint64_t timestamp){
+	uint32_t head = st->head;
+	struct edge_entry *entry;
+
+	if (unlikely(head - port_load_acquire(&st->tail) == EDGE_STAGE_SIZE)) return -ENOSPC;
+	entry = &st->entries[head & (EDGE_STAGE_SIZE - 1)];
+	entry->timestamp = timestamp;
+	entry->key = key;
+	entry->low = low;
+	port_store_release(&st->head, head + 1);
+	return 0;
+}
+
+/* Edges older than the returned time can be merged, now must be read before
+ * the call. 0 while a producer is staging, its edge could be older than the
+ * newest one already staged elsewhere.
+ */
+uint64_t edge_stage_horizon(struct edge_stage *const *stages, int num, uint64_t now){
+	int i;
+
+	port_mb();	//Pairs with the barrier after the producer sets busy
+	for (i = 0; i < num; i++) {
+		if (port_load_acquire(&stages[i]->busy)) return 0;
+	}
+	return now;
+}
+
+/* Consumer side, takes the oldest staged edge of all stages as long as it is
+ * older than horizon. Returns 1 if entry was filled, 0 if nothing is ready.
+ */
+int edge_stage_next(struct edge_stage *const *stages, int num, uint64_t horizon, struct edge_entry *entry){
+	struct edge_stage *st, *oldest = NULL;
+	const struct edge_entry *head;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		st = stages[i];
+		if (port_load_acquire(&st->head) == st->tail) continue;
+		head = &st->entries[st->tail & (EDGE_STAGE_SIZE - 1)];
+		if (head->timestamp >= horizon) continue;
+		if (!oldest || head->timestamp < entry->timestamp) {
+			*entry = *head;
+			oldest = st;
+		}
+	}
+	if (!oldest) return 0;
+	port_store_release(&oldest->tail, oldest->tail + 1);
+	return 1;
+}
+
+
+/*
+ *		READERS HUB
+ */
+void event_hub_init(struct event_hub *hub){
+	hub->readers = NULL;
+	memset(hub->clock_offset, 0, sizeof(hub->clock_offset));
+}
+
+void event_hub_add(struct event_hub *hub, struct event_reader *reader){
+	reader->filter = NULL;
+	reader->notify = NULL;
+	reader->gestures = 0;
+	reader->clock = KEYBOARD_CLOCK_MONOTONIC;
+	reader->clock_sync = 0;
+	reader->next = hub->readers;
+	hub->readers = reader;
+}
+
+void event_hub_remove(struct event_hub *hub, struct event_reader *reader){
+	struct event_reader **it;
+
+	for (it = &hub->readers; *it; it = &(*it)->next) {
+		if (*it == reader) {
+			*it = reader->next;
+			return;
+		}
+	}
+}
+
+/* Every reader gets its own copy of the events, a full queue only loses
+ * events for its reader. Notifications are per call, not per event, and a
+ * reader whose filter dropped everything is not notified at all. Gesture and
+ * clock sync events only go to the readers that asked for them. Filters see
+ * the time in the clock of their reader.
+ */
+void event_hub_dispatch(struct event_hub *hub, const struct keyboard_event *events, int num){
+	struct event_reader *reader;
+	struct keyboard_event event;
+	uint8_t queued;
+	int i;
+
+	/* KEY_BIT() of a record without a key would be a negative shift */
+#define QUEUED_BIT(key) ((key) != UNDEFINED_KEY ? KEY_BIT(key) : EVENT_NOTIFY_RECORD)
+	for (reader = hub->readers; reader; reader = reader->next) {
+		queued = 0;
+		for (i = 0; i < num; i++) {
+			if (unlikely(EVENT_IS_GESTURE(events[i].type)) && !reader->gestures) continue;
+			if (unlikely(events[i].type == KEYBOARD_EVENT_CLOCK_SYNC) && !reader->clock_sync) continue;
+			if (unlikely(reader->filter || reader->clock)) {
+				event = events[i];	//Private copy, the filter may rewrite it
+				event.timestamp += hub->clock_offset[reader->clock];
+				if (reader->filter && event.key != UNDEFINED_KEY && !reader->filter(reader, &event)) continue;
+				if (event_queue_push(&reader->queue, &event) == 0)
+					queued |= QUEUED_BIT(event.key);
+			} else if (event_queue_push(&reader->queue, &events[i]) == 0) {
+				queued |= QUEUED_BIT(events[i].key);
+			}
+		}
+		if (queued && reader->notify)
+			reader->notify(reader, queued);
+	}
+#undef QUEUED_BIT
+}
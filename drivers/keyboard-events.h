@@ -0,0 +1,154 @@
+#ifndef keyboard_events_h
+#define keyboard_events_h
+
+#include "keyboard-port.h"
+#include "keyboard-public.h"
+
+/* Event core of the driver: per reader event queues, key state tracking with
+ * debounce and the fan out of events to every reader. It does not touch any
+ * hardware nor takes any lock, callers serialize the access to these structs.
+ * It must not use kernel APIs either, it is also built as a user space library.
+ */
+
+#define NUM_KEYS 6
+#define KEY_BIT(key) (1 << ((key) - 1))		//Bit of a key (RIGHT..LEFT) in a state mask
+#define ALL_KEYS_MASK ((1 << NUM_KEYS) - 1)
+
+/* Queue of events of a reader. The ring may be mapped by user space so the
+ * mask used for indexing is a private copy, nothing read back from the ring
+ * can make the driver write out of it. With KEYBOARD_QUEUE_DROP_OLDEST the
+ * producer also moves tail, both sides then advance it with a compare and
+ * swap, so such a ring must not be consumed from user space.
+ */
+struct event_queue {
+	struct keyboard_ring *ring;
+	uint32_t mask;
+	uint32_t policy;		//KEYBOARD_QUEUE_*, changed with producer and consumer stopped
+	uint32_t lost;			//Losses not reported by a marker yet
+	uint32_t coalesced;
+	uint32_t overruns;		//Markers queued
+};
+
+/* Bytes needed for a ring of size events */
+#define EVENT_RING_BYTES(size) (sizeof(struct keyboard_ring) + (size) * sizeof(struct keyboard_event))
+
+/* State of the keys as seen by the driver */
+struct key_state {
+	uint8_t state;			//Mask of keys down
+	uint8_t edge_seen;		//Keys with a valid last_edge
+	uint64_t last_change;		//Time of the last state change
+	uint64_t last_edge[NUM_KEYS];	//Time of the last accepted edge of every key
+	uint64_t debounce_ns;		//Edges closer than this to the previous one are ignored
+	uint32_t sequence;
+};
+
+/* Gesture recognition fed with the events of the key state, see the
+ * KEYBOARD_EVENT_* gestures in "keyboard-public.h". Thresholds are per key,
+ * in ns, 0 turns the gesture off. A phase that waits for time to pass has a
+ * deadline, the caller must call gesture_state_expire() once it is reached.
+ */
+struct gesture_state {
+	uint8_t enabled;		//Keys with any threshold set
+	uint8_t phase[NUM_KEYS];
+	uint64_t long_ns[NUM_KEYS];	//Long press threshold
+	uint64_t double_ns[NUM_KEYS];	//Double tap window
+	uint64_t since[NUM_KEYS];	//Press or release the phase started with
+	uint64_t deadline[NUM_KEYS];	//When the phase times out, 0 never
+};
+
+/* Room gesture_state_feed() needs for num events of the key state */
+#define GESTURE_MAX_EVENTS(num) ((num) * 3)
+#define EVENT_IS_GESTURE(type) ((type) >= KEYBOARD_EVENT_TAP && (type) <= KEYBOARD_EVENT_HOLD_RELEASE)
+
+/* Every open file owns a reader linked into the hub of the device. Its
+ * events are queued with their time moved to the KEYBOARD_CLOCK_* in clock
+ * through the offsets of the hub. Both hooks run from the same context as
+ * event_hub_dispatch() and are cleared by event_hub_add():
+ *   filter -> sees every key event before it is queued, it may rewrite it
+ *             and returns 0 to drop it. Records without a key (clock sync)
+ *             are queued without it.
+ *   notify -> called once per dispatch that queued something, keys is the
+ *             mask of the keys queued plus EVENT_NOTIFY_RECORD if a record
+ *             without a key was
+ */
+#define EVENT_NOTIFY_RECORD 0x80	//Above the bits of the keys
+
+struct event_reader {
+	struct event_reader *next;
+	struct event_queue queue;
+	int (*filter)(struct event_reader *reader, struct keyboard_event *event);
+	void (*notify)(struct event_reader *reader, uint8_t keys);
+	uint8_t gestures;		//Gesture events are queued too, cleared by event_hub_add()
+	uint8_t clock;			//KEYBOARD_CLOCK_*, cleared by event_hub_add()
+	uint8_t clock_sync;		//KEYBOARD_EVENT_CLOCK_SYNC is queued too, same
+};
+
+/* Events are stamped with KEYBOARD_CLOCK_MONOTONIC, clock_offset[] goes from
+ * it to every other clock and is kept current by the caller
+ */
+struct event_hub {
+	struct event_reader *readers;
+	int64_t clock_offset[KEYBOARD_CLOCK_NUM];
+};
+
+/* Raw edges staged by one producer (a CPU, with local irqs off) for a single
+ * consumer that merges every stage in timestamp order. A producer sets busy
+ * before it reads the time of an edge and clears it once the edge is staged.
+ * The consumer reads the time before looking at busy, so when no stage is
+ * busy every edge yet to come is newer and all older ones can be merged (see
+ * edge_stage_horizon()).
+ *
+ * Besides rising edges a producer may stage a line it read low right after
+ * an edge, the release would be lost otherwise (see key_state_entry()).
+ */
+#define EDGE_STAGE_SIZE 64	//Power of 2
+
+struct edge_entry {
+	uint64_t timestamp;
+	uint8_t key;
+	uint8_t low;		//The line was read low, not a rising edge
+};
+
+struct edge_stage {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t busy;
+	struct edge_entry entries[EDGE_STAGE_SIZE];
+};
+
+int event_queue_init(struct event_queue *q, struct keyboard_ring *ring, uint32_t size);
+int event_queue_push(struct event_queue *q, const struct keyboard_event *event);
+int event_queue_pop(struct event_queue *q, struct keyboard_event *event);
+int event_queue_peek(struct event_queue *q, struct keyboard_event *event, uint32_t *pos);
+void event_queue_advance(struct event_queue *q, uint32_t pos);
+
+static inline uint32_t event_queue_len(const struct event_queue *q){
+	return port_load_acquire(&q->ring->head) - port_load_acquire(&q->ring->tail);
+}
+
+static inline int event_queue_empty(const struct event_queue *q){
+	return event_queue_len(q) == 0;
+}
+
+void key_state_init(struct key_state *ks, uint64_t debounce_ns);
+int key_state_edge(struct key_state *ks, uint8_t key, uint64_t now, struct keyboard_event *out);
+int key_state_update(struct key_state *ks, uint8_t sampled, uint8_t valid, uint64_t now, struct keyboard_event *out);
+int key_state_entry(struct key_state *ks, const struct edge_entry *entry, struct keyboard_event *out);
+
+void gesture_state_init(struct gesture_state *gs);
+void gesture_state_set(struct gesture_state *gs, uint8_t key, uint64_t long_ns, uint64_t double_ns);
+int gesture_state_feed(struct gesture_state *gs, struct key_state *ks, struct keyboard_event *events, int num);
+int gesture_state_expire(struct gesture_state *gs, struct key_state *ks, uint64_t now, struct keyboard_event *out);
+uint64_t gesture_state_deadline(const struct gesture_state *gs);
+
+void edge_stage_init(struct edge_stage *st);
+int edge_stage_push(struct edge_stage *st, uint8_t key, uint8_t low, uint64_t timestamp);
+uint64_t edge_stage_horizon(struct edge_stage *const *stages, int num, uint64_t now);
+int edge_stage_next(struct edge_stage *const *stages, int num, uint64_t horizon, struct edge_entry *entry);
+
+void event_hub_init(struct event_hub *hub);
+void event_hub_add(struct event_hub *hub, struct event_reader *reader);
+void event_hub_remove(struct event_hub *hub, struct event_reader *reader);
+void event_hub_dispatch(struct event_hub *hub, const struct keyboard_event *events, int num);
+
+#endif
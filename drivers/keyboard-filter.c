@@ -0,0 +1,165 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-filter.h"
+
+#define FILTER_REWRITE_FLAG 0x80000000
+
+static uint32_t ns_to_us_sat(uint64_t ns);
+#ifdef KEYBOARD_HAVE_FILTER
+static int filter_check(struct sock_filter *insns, unsigned int len);
+#endif
+
+
+/*
+ *		EVENT PATH
+ */
+void filter_init(struct reader_filter *filter){
+	memset(filter, 0, sizeof(struct reader_filter));
+}
+
+/* Runs with the device lock held, returns 0 if the event must be dropped.
+ * The timing words are updated with every event, dropped ones included, so
+ * they describe what happened on the keyboard and not what the file got.
+ */
+int filter_run(struct reader_filter *filter, struct keyboard_event *event){
+	struct keyboard_filter_data data;
+	int idx = event->key - 1;
+	uint32_t ret = KEYBOARD_FILTER_ACCEPT;
+
+	if (idx < 0 || idx >= NUM_KEYS) return 1;	//Not a key event, nothing to filter
+	data.key = event->key;
+	data.type = event->type;
+	data.state = event->state;
+	data.sequence = event->sequence;
+	data.held_us = 0;
+	if (event->type == KEYBOARD_EVENT_PRESS) {
+		filter->pressed_at[idx] = event->timestamp;
+		filter->history = (filter->history << 4) | event->key;
+	} else if (filter->pressed_at[idx]) {
+		data.held_us = ns_to_us_sat(event->timestamp - filter->pressed_at[idx]);
+	}
+	data.idle_us = filter->last_event ? ns_to_us_sat(event->timestamp - filter->last_event) : U32_MAX;
+	data.history = filter->history;
+	filter->last_event = event->timestamp;
+
+#ifdef KEYBOARD_HAVE_FILTER
+	if (filter->prog) ret = keyboard_bpf_run(filter->prog, &data);
+#endif
+	if (ret == KEYBOARD_FILTER_DROP) return 0;
+
+	/* A rewrite to something that is not a key event leaves the event as it was */
+	if ((ret & FILTER_REWRITE_FLAG) && ret != KEYBOARD_FILTER_ACCEPT) {
+		uint8_t key = ret & 0xff, type = (ret >> 8) & 0xff;
+
+		if (key != UNDEFINED_KEY && key <= NUM_KEYS &&
+			(type == KEYBOARD_EVENT_PRESS || type == KEYBOARD_EVENT_RELEASE)) {
+			event->key = key;
+			event->type = type;
+		}
+	}
+	return 1;
+}
+
+static uint32_t ns_to_us_sat(uint64_t ns){
+	uint64_t us = div_u64(ns, NSEC_PER_USEC);
+
+	return us > U32_MAX ? U32_MAX : us;
+}
+
+
+#ifdef KEYBOARD_HAVE_FILTER
+/*
+ *		PROGRAM SETUP
+ */
+
+/* Only loads from struct keyboard_filter_data, no packet access */
+int filter_create(const struct keyboard_filter *conf, struct bpf_prog **prog){
+	struct sock_fprog fprog;
+
+	*prog = NULL;
+	if (!conf->len) return 0;
+	if (conf->len > BPF_MAXINSNS) return -EINVAL;
+
+	fprog.len = conf->len;
+	fprog.filter = (struct sock_filter __user *)(uintptr_t)conf->filter;
+	return bpf_prog_create_from_user(prog, &fprog, filter_check, false);
+}
+
+void filter_destroy(struct bpf_prog *prog){
+	if (prog) bpf_prog_destroy(prog);
+}
+
+/* Called after the generic classic BPF checks. Absolute loads become loads
+ * from the context (the same rewrite seccomp does), the rest of the packet
+ * instructions are refused.
+ */
+static int filter_check(struct sock_filter *insns, unsigned int len){
+	struct sock_filter *insn;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		insn = &insns[i];
+		switch (insn->code) {
+			case BPF_LD | BPF_W | BPF_ABS:
+				if (insn->k >= sizeof(struct keyboard_filter_data) || (insn->k & 3)) return -EINVAL;
+				insn->code = BPF_LDX | BPF_W | BPF_ABS;
+				break;
+			case BPF_LD | BPF_W | BPF_LEN:
+				insn->code = BPF_LD | BPF_IMM;
+				insn->k = sizeof(struct keyboard_filter_data);
+				break;
+			case BPF_LDX | BPF_W | BPF_LEN:
+				insn->code = BPF_LDX | BPF_IMM;
+				insn->k = sizeof(struct keyboard_filter_data);
+				break;
+			case BPF_RET | BPF_K:
+			case BPF_RET | BPF_A:
+			case BPF_ALU | BPF_ADD | BPF_K:
+			case BPF_ALU | BPF_ADD | BPF_X:
+			case BPF_ALU | BPF_SUB | BPF_K:
+			case BPF_ALU | BPF_SUB | BPF_X:
+			case BPF_ALU | BPF_MUL | BPF_K:
+			case BPF_ALU | BPF_MUL | BPF_X:
+			case BPF_ALU | BPF_DIV | BPF_K:
+			case BPF_ALU | BPF_DIV | BPF_X:
+			case BPF_ALU | BPF_AND | BPF_K:
+			case BPF_ALU | BPF_AND | BPF_X:
+			case BPF_ALU | BPF_OR | BPF_K:
+			case BPF_ALU | BPF_OR | BPF_X:
+			case BPF_ALU | BPF_XOR | BPF_K:
+			case BPF_ALU | BPF_XOR | BPF_X:
+			case BPF_ALU | BPF_LSH | BPF_K:
+			case BPF_ALU | BPF_LSH | BPF_X:
+			case BPF_ALU | BPF_RSH | BPF_K:
+			case BPF_ALU | BPF_RSH | BPF_X:
+			case BPF_ALU | BPF_NEG:
+			case BPF_LD | BPF_IMM:
+			case BPF_LDX | BPF_IMM:
+			case BPF_MISC | BPF_TAX:
+			case BPF_MISC | BPF_TXA:
+			case BPF_LD | BPF_MEM:
+			case BPF_LDX | BPF_MEM:
+			case BPF_ST:
+			case BPF_STX:
+			case BPF_JMP | BPF_JA:
+			case BPF_JMP | BPF_JEQ | BPF_K:
+			case BPF_JMP | BPF_JEQ | BPF_X:
+			case BPF_JMP | BPF_JGE | BPF_K:
+			case BPF_JMP | BPF_JGE | BPF_X:
+			case BPF_JMP | BPF_JGT | BPF_K:
+			case BPF_JMP | BPF_JGT | BPF_X:
+			case BPF_JMP | BPF_JSET | BPF_K:
+			case BPF_JMP | BPF_JSET | BPF_X:
+				break;
+			default:
+				return -EINVAL;
+		}
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef keyboard_filter_h
+#define keyboard_filter_h
+
+#include <linux/errno.h>
+
+#include "keyboard-interrupt.h"
+
+/* Per file event filters (IO_KEYBOARD_SET_FILTER). The user program is a
+ * classic BPF program over struct keyboard_filter_data, the kernel converts
+ * it so it runs natively from the event path, irq context included.
+ */
+struct bpf_prog;
+
+struct reader_filter {
+	struct bpf_prog *prog;			//NULL if no filter is attached
+	uint64_t pressed_at[NUM_KEYS];		//Time of the last press of every key
+	uint64_t last_event;			//Time of the last event seen
+	uint32_t history;			//Last presses, 4 bits per key
+};
+
+void filter_init(struct reader_filter *filter);
+int filter_run(struct reader_filter *filter, struct keyboard_event *event);
+
+#ifdef KEYBOARD_HAVE_FILTER
+int filter_create(const struct keyboard_filter *conf, struct bpf_prog **prog);
+void filter_destroy(struct bpf_prog *prog);
+#else
+static inline int filter_create(const struct keyboard_filter *conf, struct bpf_prog **prog) {
+	*prog = NULL;
+	return conf->len ? -EOPNOTSUPP : 0;
+}
+static inline void filter_destroy(struct bpf_prog *prog) {}
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-gesture.h"
+#include "keyboard-pm.h"
+#include "keyboard-clock.h"
+
+static struct keyboard_dev *dev;
+static struct hrtimer gesture_timer;	//Armed at the earliest deadline of the gesture state
+
+static enum hrtimer_restart gesture_timer_handler(struct hrtimer *timer);
+static void gesture_rearm(struct keyboard_dev *data);
+
+
+/**
+ *		TIMER HANDLER
+ */
+
+/* Same path as the irq handlers, the gestures go to the readers right away.
+ * Edges staged before the deadline go first, a press may cancel it. Merging
+ * can rearm this timer so it is always rearmed rather than restarted.
+ */
+static enum hrtimer_restart gesture_timer_handler(struct hrtimer *timer){
+	struct keyboard_event events[NUM_KEYS];
+	unsigned long flags;
+	int num, staged;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	staged = merge_edges(dev);
+	num = gesture_state_expire(&dev->gestures, &dev->keys, ktime_to_ns(ktime_get()), events);
+	clock_dispatch(dev, events, num);
+	gesture_rearm(dev);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	if (num || staged) pm_key_activity();
+	return HRTIMER_NORESTART;
+}
+
+/* Device lock held. Timestamps are CLOCK_MONOTONIC ns, so are the deadlines.
+ * The timer stays on the CPU arming it, mostly the one the key irqs run on.
+ */
+static void gesture_rearm(struct keyboard_dev *data){
+	uint64_t next = gesture_state_deadline(&data->gestures);
+
+	if (next) hrtimer_start(&gesture_timer, ns_to_ktime(next), HRTIMER_MODE_ABS_PINNED);
+	else hrtimer_try_to_cancel(&gesture_timer);
+}
+
+
+/*
+ *		GESTURE GLOBAL FUNCTIONS
+ */
+void gesture_init(struct keyboard_dev *device){
+	dev = device; //Store pointer to device struct
+	gesture_state_init(&device->gestures);
+	keyboard_hrtimer_setup(&gesture_timer, gesture_timer_handler, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED);
+}
+
+void gesture_stop(void){
+	if (!dev) return;
+	hrtimer_cancel(&gesture_timer);
+}
+
+/* Device lock held, events must have room for GESTURE_MAX_EVENTS(num).
+ * Returns the number of events to dispatch.
+ */
+int gesture_feed(struct keyboard_dev *data, struct keyboard_event *events, int num){
+	if (!num) return 0;
+	num = gesture_state_feed(&data->gestures, &data->keys, events, num);
+	gesture_rearm(data);
+	return num;
+}
+
+void get_gestures(struct keyboard_dev *data, struct keyboard_gestures *conf){
+	unsigned long flags;
+	int idx;
+
+	spin_lock_irqsave(&data->lock, flags);
+	for (idx = 0; idx < NUM_KEYS; idx++) {
+		conf->long_press_us[idx] = div_u64(data->gestures.long_ns[idx], NSEC_PER_USEC);
+		conf->double_tap_us[idx] = div_u64(data->gestures.double_ns[idx], NSEC_PER_USEC);
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+}
+
+void set_gestures(struct keyboard_dev *data, const struct keyboard_gestures *conf){
+	unsigned long flags;
+	int idx;
+
+	spin_lock_irqsave(&data->lock, flags);
+	for (idx = 0; idx < NUM_KEYS; idx++) {
+		gesture_state_set(&data->gestures, idx + 1,
+			(uint64_t)conf->long_press_us[idx] * NSEC_PER_USEC,
+			(uint64_t)conf->double_tap_us[idx] * NSEC_PER_USEC);
+	}
+	gesture_rearm(data);
+	spin_unlock_irqrestore(&data->lock, flags);
+}
@@ -0,0 +1,17 @@
+#ifndef keyboard_gesture_h
+#define keyboard_gesture_h
+
+#include "keyboard-interrupt.h"
+
+/* In driver gesture recognition (see KEYBOARD_SET_GESTURES). The key events
+ * of the device go through the gesture state of the event core and a timer
+ * completes the gestures that only need time to pass (long press, tap after
+ * the double tap window), so no reader has to run timers of its own.
+ */
+void gesture_init(struct keyboard_dev *device);
+void gesture_stop(void);
+int gesture_feed(struct keyboard_dev *data, struct keyboard_event *events, int num);
+void get_gestures(struct keyboard_dev *data, struct keyboard_gestures *conf);
+void set_gestures(struct keyboard_dev *data, const struct keyboard_gestures *conf);
+
+#endif
@@ -0,0 +1,90 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/gpio.h>
+#include <linux/moduleparam.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-backend.h"
+
+/* gpio-sim/gpio-mockup backend: pins are line offsets within one simulated
+ * chip whose first gpio number is given by the gpio_base parameter, e.g.
+ *
+ *   insmod simple_keyboard.ko gpio_base=$(cat /sys/bus/gpio/devices/gpiochipN/base)
+ *
+ * (or /sys/class/gpio/gpiochipN/base on kernels with the sysfs interface).
+ * Key presses are simulated by changing the pull of the line, which raises the
+ * same rising edge irq a real key would.
+ */
+
+#define GPIOSIM_MAX_LINES 1024	//Sanity limit for line offsets
+
+static int gpio_base = -1;
+module_param(gpio_base, int, 0444);
+MODULE_PARM_DESC(gpio_base, "First gpio number of the simulated chip holding the keyboard lines");
+
+static int translate_line(uint16_t line, uint16_t *gpio_ptr);
+
+
+/*
+ *		BACKEND FUNCTIONS
+ */
+int backend_setup_pinmux(const struct pin_conf *conf, struct keyboard_pins *k_pins, uint8_t pollable){
+	int err = 0;
+
+	if (gpio_base < 0) {
+		pr_err(DEVICE_NAME ": gpio_base parameter not set for gpiosim backend\n");
+		return -ENODEV;
+	}
+
+	/* No pinmux on simulated chips, just resolve the gpio numbers */
+	err |= translate_line(conf->vcc_pin, &k_pins->vcc_pin);
+	err |= translate_line(conf->right_key_pin, &k_pins->right_key_pin);
+	err |= translate_line(conf->start_key_pin, &k_pins->start_key_pin);
+	err |= translate_line(conf->up_key_pin, &k_pins->up_key_pin);
+	err |= translate_line(conf->down_key_pin, &k_pins->down_key_pin);
+	err |= translate_line(conf->escape_key_pin, &k_pins->escape_key_pin);
+	err |= translate_line(conf->left_key_pin, &k_pins->left_key_pin);
+	if (pollable) err |= translate_line(conf->irq_pin, &k_pins->poll_interrupt_pin);
+
+	if (err) {
+		pr_err(DEVICE_NAME ": INVALID LINE OFFSET IN CONFIGURATION \n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+void backend_ack_pin(unsigned int gpio){
+	/* Inputs of a simulated chip follow their pull, nothing to acknowledge */
+}
+
+int backend_translate_pin(uint16_t pin, unsigned int *gpio){
+	uint16_t val;
+
+	if (gpio_base < 0 || translate_line(pin, &val) < 0) return -EINVAL;
+	*gpio = val;
+	return 0;
+}
+
+/* A simulated chip is one bank without irq limits */
+int backend_pin_bank(unsigned int gpio){
+	return 0;
+}
+
+int backend_bank_irqs(int bank){
+	return NUM_KEYS + 1;
+}
+
+
+/*
+ *		LOCAL FUNCTIONS
+ */
+static int translate_line(uint16_t line, uint16_t *gpio_ptr){
+	if (line >= GPIOSIM_MAX_LINES || !gpio_is_valid(gpio_base + line)) {
+		*gpio_ptr = 0;
+		return -EINVAL;
+	}
+	*gpio_ptr = gpio_base + line;
+	return 0;
+}
@@ -0,0 +1,87 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-inject.h"
+
+static struct keyboard_dev *dev;
+static struct hrtimer inject_timer;
+static ktime_t inject_period;
+static uint32_t inject_key;		//Key to inject, UNDEFINED_KEY cycles through all of them
+static uint32_t inject_burst;
+static uint32_t inject_left;		//Events still to be injected
+static uint8_t next_key = RIGHT;	//Next key when cycling
+
+static enum hrtimer_restart inject_timer_handler(struct hrtimer *timer);
+
+
+/**
+ *		TIMER HANDLER
+ */
+
+static enum hrtimer_restart inject_timer_handler(struct hrtimer *timer){
+	uint32_t i, burst;
+
+	burst = min(inject_burst, inject_left);
+	for (i = 0; i < burst; i++) {
+		if (inject_key != UNDEFINED_KEY) {
+			report_edge(dev, inject_key);
+		} else {
+			report_edge(dev, next_key);
+			next_key = (next_key == LEFT) ? RIGHT : next_key + 1;
+		}
+	}
+
+	inject_left -= burst;
+	if (!inject_left) {
+		dev->injecting = 0;
+		return HRTIMER_NORESTART;
+	}
+
+	hrtimer_forward_now(timer, inject_period);
+	return HRTIMER_RESTART;
+}
+
+
+/*
+ *		INJECTION GLOBAL FUNCTIONS
+ */
+void inject_init(struct keyboard_dev *device){
+	dev = device; //Store pointer to device struct
+	keyboard_hrtimer_setup(&inject_timer, inject_timer_handler, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+}
+
+int inject_start(struct keyboard_inject *conf){
+	uint64_t period;
+
+	/* Any running injection is replaced by the new one */
+	inject_stop();
+	if (conf->count == 0) return 0;		//Just stop
+
+	if (conf->key > LEFT || conf->burst == 0 || conf->rate == 0) return -EINVAL;
+
+	period = div_u64((uint64_t)conf->burst * NSEC_PER_SEC, conf->rate);
+	if (period < INJECT_MIN_PERIOD_NS) return -EINVAL;
+
+	printk(KERN_DEBUG DEVICE_NAME ": INJECTING %u EVENTS, BURST %u, RATE %u/s \n",
+		conf->count, conf->burst, conf->rate);
+
+	inject_key = conf->key;
+	inject_burst = conf->burst;
+	inject_left = conf->count;
+	inject_period = ns_to_ktime(period);
+	dev->injecting = 1;
+	hrtimer_start(&inject_timer, inject_period, HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+void inject_stop(void){
+	if (!dev) return;
+	hrtimer_cancel(&inject_timer);
+	dev->injecting = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef keyboard_inject_h
+#define keyboard_inject_h
+
+#include "keyboard-interrupt.h"
+
+/* Shortest timer period allowed for the injector, higher rates must be reached
+ * by increasing the burst size instead
+ */
+#define INJECT_MIN_PERIOD_NS 10000
+
+#ifdef CONFIG_SIMPLE_KEYBOARD_INJECT
+void inject_init(struct keyboard_dev *device);
+int inject_start(struct keyboard_inject *conf);
+void inject_stop(void);
+#else
+static inline void inject_init(struct keyboard_dev *device) {}
+static inline void inject_stop(void) {}
+#endif
+
+#endif
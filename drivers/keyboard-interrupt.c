@@ -1,19 +1,44 @@
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/errno.h>
 #include <linux/gpio.h>
 #include <linux/irq.h>
 #include <linux/interrupt.h>
 #include <linux/uaccess.h>
 #include <linux/ioport.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/percpu.h>
+#include <linux/irq_work.h>
+#include <linux/slab.h>
 #include <asm/io.h>
 
 #include "keyboard-driver.h"
 #include "keyboard-interrupt.h"
+#include "keyboard-backend.h"
+#include "keyboard-pm.h"
+#include "keyboard-plan.h"
+#include "keyboard-gesture.h"
+#include "keyboard-affinity.h"
+#include "keyboard-clock.h"
 
-#define AM33XX_CONTROL_BASE 0x44e10000
+static unsigned int reconcile_ms = 100;
+module_param(reconcile_ms, uint, 0644);
+MODULE_PARM_DESC(reconcile_ms, "Period of the line sampling that recovers edges the irqs missed (ms), 0 stops it until the next configuration or power up");
 
 static struct keyboard_dev *dev;
 static uint8_t pollable_bak = 0;	//Used to avoid bad intented behaviour from user
+static uint8_t timer_bak = 0;		//Same for timer polling
+/* Running mode, constant when the other modes are not built in */
+#define POLLABLE (KEYBOARD_HAS_SINGLE_LINE && pollable_bak)
+#define TIMER_POLLED (KEYBOARD_HAS_TIMER_POLL && timer_bak)
+static struct delayed_work poll_work;	//Samples the keys in timer polling mode
+static struct edge_stage __percpu *edge_stages;	//Edges reported by every CPU, see report_edge()
+static struct edge_stage **edge_merge;		//The stage of every possible CPU, for the merge
+static int edge_num;
+static struct irq_work edge_work;		//Merges the stages once the irq is done
+static atomic_t edge_flush_pending;		//edge_work queued and not started yet
 
 /* Structure used for custom configuration of gpio pins
  * It is initialized as default values but will be changed if the user wants to
@@ -30,40 +55,6 @@ static struct pin_conf pin_config = {
 	.left_key_pin = GPIO_KEY_LEFT,
 };
 
-/* These are the arrays containing offsets and value for the GPIO pines on the
- * BeagleBone.
- *
- * FOR P8_X:
- * 	Note that the first element and the second one are for DGND so they
- * 	cannot be mapped neither have value.
- *
- * FOR P9_X:
- * 	Note that the first 10 elements are for voltage output and ground. In addition
- *	this port has more pins since P9_41 and P9_42 have two modes each one (A and B)
- *	so this extra offsets and values have been appended at the end of the usual
- * 	pins. This follows the notation for pins published within "keyboard-public.h"
- */
-static const uint32_t pins8_offset[46] = {0,0,0x818,0x81C,0x808,0x80C,0x890,0x894,
-				0x89C,0x898,0x834,0x830,0x824,0x828,0x83C,0x838,0x82C,0x88C,0x820,0x884,
-				0x880,0x814,0x810,0x804,0x800,0x87C,0x8E0,0x8E8,0x8E4,0x8EC,0x8D8,0x8DC,
-				0x8D4,0x8CC,0x8D0,0x8C8,0x8C0,0x8C4,0x8B8,0x8BC,0x8B0,0x8B4,0x8A8,0x8AC,
-				0x8A0,0x8A4
-};
-static const uint32_t pins8_value[46] = {0,0,38,39,34,35,66,67,69,68,45,44,23,26,
-				47,46,27,65,22,63,62,37,36,33,32,61,86,88,87,89,10,11,9,81,8,80,78,79,76,
-				77,74,75,72,73,70,71
-};
-static const uint32_t pins9_offset[48] = {0,0,0,0,0,0,0,0,0,0,0x870,0x878,0x874,
-				0x848,0x840,0x84C,0x95C,0x958,0x97C,0x978,0x954,0x950,0x844,0x984,0x9AC,
-				0x980,0x9A4,0x99C,0x994,0x998,0x990,0,0,0,0,0,0,0,0,0,0x9B4,0x964,0,0,0,
-				0,0x9A8,0x9A0
-};
-static const uint32_t pins9_value[48] = {0,0,0,0,0,0,0,0,0,0,30,60,31,50,48,51,5,
-				4,13,12,3,2,49,15,117,14,115,113,111,112,110,0,0,0,0,0,0,0,0,0,20,7,0,0,
-				0,0,116,114
-};
-
-static int setup_pinmux(struct keyboard_pins *pins);
 static int request_pins(struct keyboard_pins *pins);
 static int request_irq_poll_pin(struct keyboard_pins *pins);
 static int request_irq_poll_interrupt(struct keyboard_pins *pins);
@@ -71,155 +62,497 @@ static int request_interrupts(struct keyboard_pins *pins);
 static void release_interrupts(struct keyboard_pins *pins);
 static int request_pins(struct keyboard_pins *pins);
 static void release_pins(struct keyboard_pins *pins);
-static void translate_gpio_num(uint16_t gpio_num, uint32_t *val_ptr, uint32_t *off_ptr);
+static int request_key_irq(unsigned int irq_num, irq_handler_t handler);
+static int read_pin(unsigned int gpio);
+static int active_irqs(struct keyboard_pins *pins, unsigned int *irqs);
+static void poll_work_handler(struct work_struct *work);
+static void schedule_poll(void);
+static int set_irq_affinity(struct keyboard_pins *pins);
+static void edge_work_handler(struct irq_work *work);
+static void queue_edge_flush(void);
+static void stage_edge(struct keyboard_dev *data, uint8_t key, uint8_t low);
+static void resample_key(struct keyboard_dev *data, uint8_t key, unsigned int gpio);
+static void update_state(struct keyboard_dev *data, uint8_t sampled, int recovered, uint32_t gen);
+static uint32_t merge_generation(struct keyboard_dev *data);
+static void count_recovered(struct keyboard_dev *data, const struct keyboard_event *events, int num);
+
+static irqreturn_t polling_interrupt_handler(int irq, void* dev_id);
+static irqreturn_t start_key_interrupt_handler(int irq, void* dev_id);
+static irqreturn_t escape_key_interrupt_handler(int irq, void* dev_id);
+static irqreturn_t up_key_interrupt_handler(int irq, void* dev_id);
+static irqreturn_t down_key_interrupt_handler(int irq, void* dev_id);
+static irqreturn_t right_key_interrupt_handler(int irq, void* dev_id);
+static irqreturn_t left_key_interrupt_handler(int irq, void* dev_id);
+
+
+
+/**
+ *		EVENT PATH
+ */
+
+/* Every source of key events (irq handlers and, when built in, the synthetic
+ * injector) ends up here so readers always see the same behaviour. Readers
+ * are woken from the hub, only those that got events.
+ */
+
+/* Rising edge seen on the line of key. In MULTI_LINE mode every key has its
+ * own irq and they may run on several CPUs at once, so the edge is only staged
+ * on the local CPU, without any shared lock, and merged into the key state in
+ * timestamp order by merge_edges() from readers or the deferred flush. A full
+ * stage is merged on the spot.
+ */
+void report_edge(struct keyboard_dev *data, uint8_t key){
+	stage_edge(data, key, 0);
+}
+
+/* Irqs only come on rising edges, a key released before its handler returns
+ * would stay down until the next edge or sample. The line is read once more
+ * after the ack and a low line staged behind the edge.
+ */
+static void resample_key(struct keyboard_dev *data, uint8_t key, unsigned int gpio){
+	if (!read_pin(gpio)) stage_edge(data, key, 1);
+}
+
+static void stage_edge(struct keyboard_dev *data, uint8_t key, uint8_t low){
+	struct edge_stage *st;
+	unsigned long flags;
+	int err;
+
+	for (;;) {
+		local_irq_save(flags);	//Single producer per stage
+		st = this_cpu_ptr(edge_stages);
+		WRITE_ONCE(st->busy, 1);
+		smp_mb();		//Pairs with edge_stage_horizon(), busy before the time
+		err = edge_stage_push(st, key, low, ktime_to_ns(ktime_get()));
+		smp_store_release(&st->busy, 0);
+		local_irq_restore(flags);
+		if (!err) break;
+		flush_edges(data);
+	}
+	/* Only the first edge of a batch queues the flush, later ones ride on it */
+	if (!atomic_xchg(&edge_flush_pending, 1)) queue_edge_flush();
+}
+
+/* Moves the staged edges into the key state, oldest first, with the device
+ * lock held. Any source that changes the key state merges first so edges are
+ * never applied after a newer state. Returns the number of events dispatched.
+ */
+int merge_edges(struct keyboard_dev *data){
+	struct keyboard_event events[GESTURE_MAX_EVENTS(2)];
+	struct edge_entry entry;
+	uint64_t horizon;
+	int num, merged = 0, total = 0;
+
+	/* Only the key irqs and the injector stage edges */
+	if (!KEYBOARD_HAS_MULTI_LINE && !IS_ENABLED(CONFIG_SIMPLE_KEYBOARD_INJECT)) return 0;
+	horizon = edge_stage_horizon(edge_merge, edge_num, ktime_to_ns(ktime_get()));
+	while (edge_stage_next(edge_merge, edge_num, horizon, &entry)) {
+		num = key_state_entry(&data->keys, &entry, events);
+		if (entry.low) count_recovered(data, events, num);
+		if (data->gestures.enabled) num = gesture_feed(data, events, num);
+		clock_dispatch(data, events, num);
+		total += num;
+		merged = 1;
+	}
+	if (merged) WRITE_ONCE(data->merge_gen, data->merge_gen + 1);
+	return total;
+}
+
+/* Same as merge_edges() taking the lock, for readers that want every edge
+ * reported so far before they look at their queue
+ */
+void flush_edges(struct keyboard_dev *data){
+	unsigned long flags;
+	int num;
+
+	spin_lock_irqsave(&data->lock, flags);
+	num = merge_edges(data);
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	if (num) pm_key_activity();
+}
+
+/* The deferred flush runs on the work CPU of the keyboard when there is one,
+ * so the device lock stays there, else where the batch started
+ */
+static void queue_edge_flush(void){
+	int cpu = affinity_work_cpu();
+
+	if (cpu != WORK_CPU_UNBOUND) irq_work_queue_on(&edge_work, cpu);
+	else irq_work_queue(&edge_work);
+}
+
+/* Pending is cleared before the merge reads the time, so an edge it leaves
+ * staged (staged meanwhile or stamped after the horizon) queues a new flush
+ */
+static void edge_work_handler(struct irq_work *work){
+	atomic_set(&edge_flush_pending, 0);
+	smp_mb__after_atomic();
+	flush_edges(dev);
+}
+
+/* All key lines sampled at once */
+void report_state(struct keyboard_dev *data, uint8_t sampled){
+	update_state(data, sampled, 0, 0);
+}
+
+/* Generation of the merged edges, read before a recovery sample is taken */
+static uint32_t merge_generation(struct keyboard_dev *data){
+	uint32_t gen = READ_ONCE(data->merge_gen);
+
+	smp_rmb();	//Before the lines are read
+	return gen;
+}
+
+/* Applies a sample, recovered says it checks what the irqs reported rather
+ * than being how keys are read, its changes are counted as missed edges. Such
+ * a sample is dropped if any edge was merged since gen (merge_generation()
+ * before sampling), by this call or any other path: it could be older than
+ * the edge and undo a press, the next one is taken soon enough.
+ */
+static void update_state(struct keyboard_dev *data, uint8_t sampled, int recovered, uint32_t gen){
+	struct keyboard_event events[GESTURE_MAX_EVENTS(NUM_KEYS)];
+	unsigned long flags;
+	int num = 0, staged;
+
+	spin_lock_irqsave(&data->lock, flags);
+	staged = merge_edges(data);
+	if (!recovered || data->merge_gen == gen) {
+		num = key_state_update(&data->keys, sampled, ALL_KEYS_MASK, ktime_to_ns(ktime_get()), events);
+		if (recovered) count_recovered(data, events, num);
+		if (data->gestures.enabled) num = gesture_feed(data, events, num);
+		clock_dispatch(data, events, num);
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	if (num || staged) pm_key_activity();
+}
+
+/* Called with the device lock held, before gestures are added to events */
+static void count_recovered(struct keyboard_dev *data, const struct keyboard_event *events, int num){
+	int i;
 
-irqreturn_t polling_interrupt_handler(int irq, void* dev_id);
-irqreturn_t start_key_interrupt_handler(int irq, void* dev_id);
-irqreturn_t escape_key_interrupt_handler(int irq, void* dev_id);
-irqreturn_t up_key_interrupt_handler(int irq, void* dev_id);
-irqreturn_t down_key_interrupt_handler(int irq, void* dev_id);
-irqreturn_t right_key_interrupt_handler(int irq, void* dev_id);
-irqreturn_t left_key_interrupt_handler(int irq, void* dev_id);
+	for (i = 0; i < num; i++) {
+		if (events[i].type == KEYBOARD_EVENT_PRESS) data->recovered_presses++;
+		else if (events[i].type == KEYBOARD_EVENT_RELEASE) data->recovered_releases++;
+	}
+}
 
+/* Levels of all key lines in one pass, as a mask of KEY_BIT()s */
+uint8_t sample_keys(struct keyboard_dev *data){
+	uint8_t sampled = 0;
+
+	if (read_pin(data->pins.right_key_pin)) sampled |= KEY_BIT(RIGHT);
+	if (read_pin(data->pins.start_key_pin)) sampled |= KEY_BIT(START);
+	if (read_pin(data->pins.up_key_pin)) sampled |= KEY_BIT(UP);
+	if (read_pin(data->pins.down_key_pin)) sampled |= KEY_BIT(DOWN);
+	if (read_pin(data->pins.left_key_pin)) sampled |= KEY_BIT(LEFT);
+	if (read_pin(data->pins.escape_key_pin)) sampled |= KEY_BIT(ESCAPE);
+	return sampled;
+}
+
+/* Current state of the keys without waiting for an edge. A configured device
+ * has its lines sampled first and any difference goes through report_state(),
+ * so the answer and the event stream never disagree (in MULTI_LINE mode this
+ * is also where releases are noticed). Otherwise the cached state is returned.
+ * Process context only, the lines may sleep.
+ */
+void get_key_state(struct keyboard_dev *data, struct keyboard_state *out){
+	if (data->configured && !data->gated) report_state(data, sample_keys(data));
+	peek_key_state(data, out);
+}
+
+/* Cached state with every edge reported so far, only takes the device lock */
+void peek_key_state(struct keyboard_dev *data, struct keyboard_state *out){
+	unsigned long flags;
+
+	flush_edges(data);
+	spin_lock_irqsave(&data->lock, flags);
+	out->timestamp = data->keys.last_change;
+	out->keys = data->keys.state;
+	out->sequence = data->keys.sequence;
+	spin_unlock_irqrestore(&data->lock, flags);
+}
 
 
 /**
  *		IRQ HANDLERS
  */
 
-irqreturn_t polling_interrupt_handler(int irq, void* dev_id){
+static irqreturn_t polling_interrupt_handler(int irq, void* dev_id){
 	struct keyboard_dev *data = (struct keyboard_dev*)dev_id;
-	uint8_t pressed = UNDEFINED_KEY;
-	printk(KERN_ALERT DEVICE_NAME ": POLLING... \n");
-
-	/* Poll pins to get pressed key */
-	if (gpio_get_value(data->pins.right_key_pin)) pressed = RIGHT;
-	else if (gpio_get_value(data->pins.start_key_pin)) pressed = START;
-	else if (gpio_get_value(data->pins.up_key_pin)) pressed = UP;
-	else if (gpio_get_value(data->pins.down_key_pin)) pressed = DOWN;
-	else if (gpio_get_value(data->pins.left_key_pin)) pressed = LEFT;
-	else if (gpio_get_value(data->pins.escape_key_pin)) pressed = ESCAPE;
-	data->key = pressed;
+	uint8_t sampled, resampled;
+	uint32_t gen;
+
+	/* Poll pins to get the state of every key */
+	sampled = sample_keys(data);
 
 	/* ACK irq */
-	gpio_set_value(data->pins.poll_interrupt_pin, 0);
+	backend_ack_pin(data->pins.poll_interrupt_pin);
 
-	/* Wake up readers */
-	wake_up_interruptible(&data->readers_queue);
+	/* Queue state changes and wake up readers */
+	report_state(data, sampled);
+
+	/* Lines that moved between the sample and the ack raised no irq */
+	gen = merge_generation(data);
+	resampled = sample_keys(data);
+	if (resampled != sampled) update_state(data, resampled, 1, gen);
+	keyboard_trace("POLLING... \n");	//Logged last, it would delay the timestamps
 
 	return IRQ_HANDLED;
 }
 
-irqreturn_t right_key_interrupt_handler(int irq, void* dev_id){
+static irqreturn_t right_key_interrupt_handler(int irq, void* dev_id){
 	struct keyboard_dev *data = (struct keyboard_dev*)dev_id;
-	printk(KERN_ALERT DEVICE_NAME ": RIGHT_KEY PRESSED \n");
-	data->key=RIGHT;
-	gpio_set_value(data->pins.right_key_pin, 0);
-	wake_up_interruptible(&data->readers_queue);
+	report_edge(data, RIGHT);	//First, the edge is timed there
+	backend_ack_pin(data->pins.right_key_pin);
+	resample_key(data, RIGHT, data->pins.right_key_pin);
+	keyboard_trace("RIGHT_KEY PRESSED \n");
 
 	return IRQ_HANDLED;
 }
 
-irqreturn_t start_key_interrupt_handler(int irq, void* dev_id){
+static irqreturn_t start_key_interrupt_handler(int irq, void* dev_id){
 	struct keyboard_dev *data = (struct keyboard_dev*)dev_id;
-	printk(KERN_ALERT DEVICE_NAME ": START_KEY PRESSED \n");
-	data->key=START;
-	gpio_set_value(data->pins.start_key_pin, 0);
-   	wake_up_interruptible(&data->readers_queue);
+	report_edge(data, START);	//First, the edge is timed there
+	backend_ack_pin(data->pins.start_key_pin);
+	resample_key(data, START, data->pins.start_key_pin);
+	keyboard_trace("START_KEY PRESSED \n");
 	return IRQ_HANDLED;
 }
 
-irqreturn_t up_key_interrupt_handler(int irq, void* dev_id){
+static irqreturn_t up_key_interrupt_handler(int irq, void* dev_id){
 	struct keyboard_dev *data = (struct keyboard_dev*)dev_id;
-	printk(KERN_ALERT DEVICE_NAME ": UP_KEY PRESSED \n");
-	data->key=UP;
-	gpio_set_value(data->pins.up_key_pin, 0);
-   	wake_up_interruptible(&data->readers_queue);
+	report_edge(data, UP);	//First, the edge is timed there
+	backend_ack_pin(data->pins.up_key_pin);
+	resample_key(data, UP, data->pins.up_key_pin);
+	keyboard_trace("UP_KEY PRESSED \n");
 	return IRQ_HANDLED;
 }
 
-irqreturn_t down_key_interrupt_handler(int irq, void* dev_id){
+static irqreturn_t down_key_interrupt_handler(int irq, void* dev_id){
 	struct keyboard_dev *data = (struct keyboard_dev*)dev_id;
-	printk(KERN_ALERT DEVICE_NAME ": DOWN_KEY PRESSED \n");
-	data->key=DOWN;
-	gpio_set_value(data->pins.down_key_pin, 0);
-   	wake_up_interruptible(&data->readers_queue);
+	report_edge(data, DOWN);	//First, the edge is timed there
+	backend_ack_pin(data->pins.down_key_pin);
+	resample_key(data, DOWN, data->pins.down_key_pin);
+	keyboard_trace("DOWN_KEY PRESSED \n");
 	return IRQ_HANDLED;
 }
 
-irqreturn_t escape_key_interrupt_handler(int irq, void* dev_id){
+static irqreturn_t escape_key_interrupt_handler(int irq, void* dev_id){
 	struct keyboard_dev *data = (struct keyboard_dev*)dev_id;
-	printk(KERN_ALERT DEVICE_NAME ": ESCAPE_KEY PRESSED \n");
-	data->key=ESCAPE;
-	gpio_set_value(data->pins.escape_key_pin, 0);
-   	wake_up_interruptible(&data->readers_queue);
+	report_edge(data, ESCAPE);	//First, the edge is timed there
+	backend_ack_pin(data->pins.escape_key_pin);
+	resample_key(data, ESCAPE, data->pins.escape_key_pin);
+	keyboard_trace("ESCAPE_KEY PRESSED \n");
 	return IRQ_HANDLED;
 }
 
-irqreturn_t left_key_interrupt_handler(int irq, void* dev_id){
+static irqreturn_t left_key_interrupt_handler(int irq, void* dev_id){
 	struct keyboard_dev *data = (struct keyboard_dev*)dev_id;
-	printk(KERN_ALERT DEVICE_NAME ": LEFT_KEY PRESSED \n");
-	data->key=LEFT;
-	gpio_set_value(data->pins.left_key_pin, 0);
-   	wake_up_interruptible(&data->readers_queue);
+	report_edge(data, LEFT);	//First, the edge is timed there
+	backend_ack_pin(data->pins.left_key_pin);
+	resample_key(data, LEFT, data->pins.left_key_pin);
+	keyboard_trace("LEFT_KEY PRESSED \n");
 	return IRQ_HANDLED;
 }
 
 
+/**
+ *		TIMER POLLING
+ */
+
+/* Used when no irq is available, process context so sleeping lines are fine.
+ * In irq modes it runs every reconcile_ms to correct edges the irqs missed
+ * (a press while the irq was disabled, a release in MULTI_LINE mode).
+ */
+static void poll_work_handler(struct work_struct *work){
+	uint32_t gen = merge_generation(dev);
+
+	update_state(dev, sample_keys(dev), !TIMER_POLLED, gen);
+	schedule_poll();
+}
+
+static void schedule_poll(void){
+	unsigned long delay;
+
+	if (TIMER_POLLED) delay = usecs_to_jiffies(plan_poll_interval_us());
+	else if (READ_ONCE(reconcile_ms)) delay = msecs_to_jiffies(READ_ONCE(reconcile_ms));
+	else return;
+	queue_delayed_work_on(affinity_work_cpu(), system_wq, &poll_work, delay ? delay : 1);
+}
+
+
+/*
+ *		EDGE STAGING
+ */
+
+/* Stages live as long as the module, report_edge() works in every mode */
+int edges_init(struct keyboard_dev *device){
+	int cpu;
+
+	dev = device;
+	edge_stages = alloc_percpu(struct edge_stage);
+	if (!edge_stages) return -ENOMEM;
+	edge_merge = kcalloc(num_possible_cpus(), sizeof(*edge_merge), GFP_KERNEL);
+	if (!edge_merge) {
+		free_percpu(edge_stages);
+		return -ENOMEM;
+	}
+
+	edge_num = 0;
+	for_each_possible_cpu(cpu) {
+		edge_stage_init(per_cpu_ptr(edge_stages, cpu));
+		edge_merge[edge_num++] = per_cpu_ptr(edge_stages, cpu);
+	}
+	init_irq_work(&edge_work, edge_work_handler);
+	atomic_set(&edge_flush_pending, 0);
+	INIT_DELAYED_WORK(&poll_work, poll_work_handler);	//Set up once, see init_system()
+	return 0;
+}
+
+/* Nothing reports edges anymore */
+void edges_exit(void){
+	irq_work_sync(&edge_work);
+	kfree(edge_merge);
+	free_percpu(edge_stages);
+}
+
+
 /*
  *		CONFIG GLOBAL FUNCTIONS
  */
 int init_system(struct keyboard_dev *device){
 	int err;
-	printk(KERN_ALERT DEVICE_NAME ": INTERRUPT.C \n");
-	printk(KERN_ALERT DEVICE_NAME ": STORING DEV POINTER  \n");
+	keyboard_trace("INTERRUPT.C \n");
+	keyboard_trace("STORING DEV POINTER  \n");
 	dev = device; //Store pointer to device struct
 
 	/* Store if is in pollable mode */
-	pollable_bak = device->is_pollable;
-	printk(KERN_ALERT DEVICE_NAME ": IS_POLLABLE? -> %d\n",pollable_bak);
+	timer_bak = device->timer_polled;
+	pollable_bak = device->is_pollable && !timer_bak;
+	keyboard_trace("IS_POLLABLE? -> %d TIMER? -> %d\n",pollable_bak,timer_bak);
 
-	printk(KERN_ALERT DEVICE_NAME ": SETTING UP PINMUX.. \n");
- 	err = setup_pinmux(&device->pins);
+	keyboard_trace("SETTING UP PINMUX.. \n");
+	err = backend_setup_pinmux(&pin_config, &device->pins, POLLABLE);
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to apply pinmux settings.\n");
+	  pr_err(DEVICE_NAME ": failed to apply pinmux settings.\n");
 	  goto err_return;
 	}
 
-	printk(KERN_ALERT DEVICE_NAME ": REQUESTING PINS... \n");
+	keyboard_trace("REQUESTING PINS... \n");
 	err = request_pins(&device->pins);
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIOS.\n");
+	  pr_err(DEVICE_NAME ": failed to request GPIOS.\n");
 	  goto err_return;
 	}
 
 	/* IF IT IS CONFIGURED AS POLLABLE BY INTERRUPT, THEN AN EXTRA PIN IS
 	 * NEEDED TO DO SO
 	 */
-	if (pollable_bak) {
+	if (TIMER_POLLED) {
+		/* No irq at all, a timer samples every line */
+		schedule_poll();
+	} else if (POLLABLE) {
 		/* Request pin for irq */
 		err = request_irq_poll_pin(&device->pins);
 		if (err < 0) {
-			printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO for interrupt.\n");
-			goto err_return;
+			pr_err(DEVICE_NAME ": failed to request GPIO for interrupt.\n");
+			goto err_free_pins;
 		}
 		/* Request IRQ */
 		err = request_irq_poll_interrupt(&device->pins);
-	} else {
+		if (err < 0) goto err_free_poll_pin;
+	} else if (KEYBOARD_HAS_MULTI_LINE) {
 		/* Device configured as multiple interrupt lines so request all interrupts */
 		err = request_interrupts(&device->pins);
+	} else {
+		/* The planner never picks a mode that is not built in */
+		release_pins(&device->pins);
+		err = -EOPNOTSUPP;
 	}
 
+	/* Irqs that cannot be moved still work where they are */
+	if (!err && set_irq_affinity(&device->pins) < 0)
+		pr_err(DEVICE_NAME ": unable to move the irqs to the keyboard cpus.\n");
+
+	/* The same work reconciles the key state with the lines in irq modes */
+	if (!err && !TIMER_POLLED) schedule_poll();
+	return err;
+
+	err_free_poll_pin:
+		gpio_free(device->pins.poll_interrupt_pin);
+	err_free_pins:
+		release_pins(&device->pins);
 	err_return:
 		return err;
 }
 
 int shutdown_system(void){
+	cancel_delayed_work_sync(&poll_work);
 	release_interrupts(&dev->pins);
+	if (POLLABLE) gpio_free(dev->pins.poll_interrupt_pin);
 	release_pins(&dev->pins);
 	return 0;
 }
 
+/* Cuts (on = 0) or restores the keyboard supply and its irqs, for runtime PM.
+ * Keys cannot be down without power so they are all released before gating.
+ * An unconfigured device only records the state, init_system() powers up.
+ */
+void power_system(struct keyboard_dev *device, int on){
+	unsigned int irqs[NUM_KEYS];
+	int i, num;
+
+	if (device->gated == !on) return;	//Already there
+	if (!device->configured) {
+		device->gated = !on;
+		return;
+	}
+
+	num = active_irqs(&device->pins, irqs);
+	if (on) {
+		gpio_set_value_cansleep(device->pins.vcc_pin, 1);
+		for (i = 0; i < num; i++) enable_irq(irqs[i]);
+		schedule_poll();	//Also finds the keys pressed while gated
+		device->gated = 0;
+	} else {
+		device->gated = 1;
+		for (i = 0; i < num; i++) disable_irq(irqs[i]);
+		cancel_delayed_work_sync(&poll_work);
+		report_state(device, 0);
+		gpio_set_value_cansleep(device->pins.vcc_pin, 0);
+	}
+}
+
+/* Arms (enable = 1) or disarms the irqs of the device as system wakeup sources,
+ * timer polling has none so it cannot wake the system
+ */
+int wake_system(struct keyboard_dev *device, int enable){
+	unsigned int irqs[NUM_KEYS];
+	int i, num, err;
+
+	if (!device->configured) return 0;
+	num = active_irqs(&device->pins, irqs);
+	for (i = 0; i < num; i++) {
+		err = enable ? enable_irq_wake(irqs[i]) : disable_irq_wake(irqs[i]);
+		if (err < 0 && enable) goto err_disarm;
+	}
+	return 0;
+
+	err_disarm:
+		while (i--) disable_irq_wake(irqs[i]);
+		return err;
+}
+
+/* Moves the irqs of a configured device to the keyboard cpus, called with
+ * config_lock held. Their handler threads and the edge merge follow them.
+ */
+int affine_system(struct keyboard_dev *device){
+	if (!device->configured) return 0;
+	return set_irq_affinity(&device->pins);
+}
+
 int populate_config(struct pin_conf *user_conf){
 	pin_config.irq_pin = user_conf->irq_pin;
 	pin_config.vcc_pin = user_conf->vcc_pin;
@@ -232,120 +565,67 @@ int populate_config(struct pin_conf *user_conf){
 	return 0;
 }
 
+void export_config(struct pin_conf *user_conf){
+	*user_conf = pin_config;
+}
+
 
 /*
  *		CONFIG LOCAL FUNCTIONS
  */
-static int setup_pinmux(struct keyboard_pins *k_pins){
-	int i;
-	void* addr;
-	uint32_t pins[] = { 					// Memory mapped gpios in AM335x
-																// calculated as (AM33XX_CONTROL_BASE + offset) ref man Table 9-10,
-																// upon pin names names: from table/mode0 in BB ref manual
-		0,
-		OUTPUT_PULLUP,                					//	mode 7 (gpio), PULLUP, OUTPUT
-		0,
-		INPUT_PULLDOWN,     						//      mode 7 (gpio), PULLDOWN, INPUT
-		0,
-		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
-		0,
-		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
-		0,
-		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
-		0,
-		INPUT_PULLDOWN,  						//      mode 7 (gpio), PULLDOWN, INPUT
-		0,
-		INPUT_PULLDOWN,							//      mode 7 (gpio), PULLDOWN, INPUT
-	};
-	printk(KERN_ALERT DEVICE_NAME ": DONE WITH PIN ARRAY \n");
-	printk(KERN_ALERT DEVICE_NAME ": POPULATE ARRAY WITH PIN NUMBERS \n");
-
-	/* This populates both mmap&configuration array (pins) and the real on board
-	 * values for the gpios used with this driver.
-	 */
-	translate_gpio_num(pin_config.vcc_pin, (uint32_t *)&k_pins->vcc_pin, &pins[0]); // VCC Pin -> Will serve as power for keyboard
-	translate_gpio_num(pin_config.right_key_pin, (uint32_t *)&k_pins->right_key_pin, &pins[2]); // RIGHT_KEY Pin ->    will be interrupt
-	translate_gpio_num(pin_config.start_key_pin, (uint32_t *)&k_pins->start_key_pin, &pins[4]); // START_KEY Pin ->    will be interrupt
-	translate_gpio_num(pin_config.up_key_pin, (uint32_t *)&k_pins->up_key_pin, &pins[6]); // UP_KEY Pin ->    will be interrupt
-	translate_gpio_num(pin_config.down_key_pin, (uint32_t *)&k_pins->down_key_pin, &pins[8]); // DOWN_KEY Pin ->    will be interrupt
-	translate_gpio_num(pin_config.escape_key_pin, (uint32_t *)&k_pins->escape_key_pin, &pins[10]); // ESCAPE_KEY Pin ->    will be interrupt
-	translate_gpio_num(pin_config.left_key_pin, (uint32_t *)&k_pins->left_key_pin, &pins[12]); // LEFT_KEY Pin ->    will be interrupt
-
-	printk(KERN_ALERT DEVICE_NAME ": DONE WITH POPULATING PIN NUMBERS \n");
-	printk(KERN_ALERT DEVICE_NAME ": STARTING POPULATING PIN FIELDS WITHIN PIN STRUCT \n");
-
-	for (i=0; i<GPIO_USED_NUM*2; i+=2) {	// map the mapped i/o addresses to kernel high memory
-		addr = ioremap(pins[i], 4);
-		printk(KERN_ALERT DEVICE_NAME ": GPIO NUMBER %d\n",pins[i]);
-		if (NULL == addr)
-			return -EBUSY;
-
-		iowrite32(pins[i+1], addr); // write settings for each pin
-		iounmap(addr);
-	}
-
-	/* IF DEVICE IS CONFIGURED AS POLLABLE, THEN IT IS NEEDED TO CONFIGURE THE
-	* IRQ PIN
-	*/
-	if (pollable_bak){
-		uint32_t gpio;
-		translate_gpio_num(pin_config.irq_pin, (uint32_t *)&k_pins->poll_interrupt_pin, &gpio); // IRQ_POLL Pin ->    will be interrupt
-		addr = ioremap(gpio, 4);
-		printk(KERN_ALERT DEVICE_NAME ": GPIO NUMBER %d\n",gpio);
-		if (NULL == addr)
-			return -EBUSY;
-
-		iowrite32(INPUT_PULLDOWN, addr); // write settings for pin
-		iounmap(addr);
-	}
 
-	return 0;
+/* Lines behind a sleeping controller (gpio-sim, i2c expanders...) cannot be
+ * read from hard irq context, their irqs are threaded instead
+ */
+static int request_key_irq(unsigned int irq_num, irq_handler_t handler){
+	if (dev->pins.cansleep)
+		return request_threaded_irq(irq_num, NULL, handler,
+			IRQF_TRIGGER_RISING | IRQF_ONESHOT, DEVICE_NAME, (void*)dev);
+	return request_any_context_irq(irq_num, handler,
+		IRQF_TRIGGER_RISING | IRQF_DISABLED, DEVICE_NAME, (void*)dev);
 }
 
+static int read_pin(unsigned int gpio){
+	if (dev->pins.cansleep) return gpio_get_value_cansleep(gpio);
+	return gpio_get_value(gpio);
+}
 static int request_irq_poll_pin(struct keyboard_pins *pins){
 	int err;
 	err = gpio_request_one(pins->poll_interrupt_pin, GPIOF_IN, DEVICE_NAME " gpio_poll_irq");
 	if (err < 0) {
-		printk(KERN_ALERT DEVICE_NAME " : failed to request IRQ_POLL pin %d.\n",
+		pr_err(DEVICE_NAME ": failed to request IRQ_POLL pin %d.\n",
 		 pins->poll_interrupt_pin);
 		return err;
 	}
-	printk(KERN_ALERT DEVICE_NAME " : REQUESTED IRQ_POLL pin %d.\n",
+	keyboard_trace("REQUESTED IRQ_POLL pin %d.\n",
 	 pins->poll_interrupt_pin);
+	pins->cansleep |= gpio_cansleep(pins->poll_interrupt_pin);
 	return 0;
 }
 
 static int request_irq_poll_interrupt(struct keyboard_pins *pins){
 	int err,irq_num;
 	/* POLLING INTERRUPT */
-	printk(KERN_ALERT DEVICE_NAME ": REQUEST IRQ FOR POLLING \n");
+	keyboard_trace("REQUEST IRQ FOR POLLING \n");
 	irq_num = gpio_to_irq(pins->poll_interrupt_pin);	//Request interrupt number
-	printk(KERN_ALERT DEVICE_NAME ": IRQ NUMBER POLL IRQ PIN -> %d  \n", irq_num);
+	keyboard_trace("IRQ NUMBER POLL IRQ PIN -> %d  \n", irq_num);
 	if (irq_num < 0) {
-		printk(KERN_ALERT DEVICE_NAME " : failed to request interrupt for GPIO_POLL_IRQ pin %d.\n",
+		pr_err(DEVICE_NAME ": failed to request interrupt for GPIO_POLL_IRQ pin %d.\n",
 		 pins->poll_interrupt_pin);
 		err = irq_num;
 		goto err_return;
 	}
 	pins->poll_interrupt_irq = irq_num;							//Match interrupt to handler
-	printk(KERN_ALERT DEVICE_NAME ": OBTAINED IRQ FOR POLLING \n");
-	printk(KERN_ALERT DEVICE_NAME ": REQUEST CONTEXT IRQ FOR POLLING \n");
-	err = request_any_context_irq(
-			irq_num,
-			polling_interrupt_handler,
-			IRQF_TRIGGER_RISING | IRQF_DISABLED,
-			DEVICE_NAME,
-			(void*)dev
-		);
+	keyboard_trace("OBTAINED IRQ FOR POLLING \n");
+	keyboard_trace("REQUEST CONTEXT IRQ FOR POLLING \n");
+	err = request_key_irq(irq_num, polling_interrupt_handler);
 	if (err < 0) {
-			printk(KERN_ALERT DEVICE_NAME " : failed to enable IRQ %d for pin %d.\n",
+			pr_err(DEVICE_NAME ": failed to enable IRQ %d for pin %d.\n",
 				 irq_num, pins->poll_interrupt_pin);
-			goto err_return_free_irq;
+			goto err_return;
 	}
-	printk(KERN_ALERT DEVICE_NAME ": CONFIGURED IRQ FOR POLLING \n");
+	keyboard_trace("CONFIGURED IRQ FOR POLLING \n");
 	return 0;
-	err_return_free_irq:
-		disable_irq(pins->poll_interrupt_irq);
 	err_return:
 		return err;
 }
@@ -354,26 +634,20 @@ static int request_interrupts(struct keyboard_pins *pins){
 	int err,irq_num;
 
 	/* RIGHT KEY INTERRUPT */
-	printk(KERN_ALERT DEVICE_NAME ": REQUEST IRQ \n");
+	keyboard_trace("REQUEST IRQ \n");
 	irq_num = gpio_to_irq(pins->right_key_pin);	//Request interrupt number
-	printk(KERN_ALERT DEVICE_NAME ": IRQ NUMBER RIGHT PIN -> %d  \n", irq_num);
+	keyboard_trace("IRQ NUMBER RIGHT PIN -> %d  \n", irq_num);
 	if (irq_num < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request interrupt for GPIO_RIGHT_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request interrupt for GPIO_RIGHT_KEY pin %d.\n",
 		 pins->right_key_pin);
 	  err = irq_num;
 	  goto err_return_irq;
 	}
 	pins->right_key_irq = irq_num;							//Match interrupt to handler
-	printk(KERN_ALERT DEVICE_NAME ": REQUEST CONTEXT IRQ \n");
-	err = request_any_context_irq(
-      irq_num,
-      right_key_interrupt_handler,
-      IRQF_TRIGGER_RISING | IRQF_DISABLED,
-      DEVICE_NAME,
-      (void*)dev
-   	);
+	keyboard_trace("REQUEST CONTEXT IRQ \n");
+	err = request_key_irq(irq_num, right_key_interrupt_handler);
 	if (err < 0) {
-      printk(KERN_ALERT DEVICE_NAME " : failed to enable IRQ %d for pin %d.\n",
+      pr_err(DEVICE_NAME ": failed to enable IRQ %d for pin %d.\n",
          irq_num, pins->right_key_pin);
       goto err_return_irq;
 	}
@@ -381,21 +655,15 @@ static int request_interrupts(struct keyboard_pins *pins){
 	/* START KEY INTERRUPT */
 	irq_num = gpio_to_irq(pins->start_key_pin);	//Request interrupt number
 	if (irq_num < 0) {
-		printk(KERN_ALERT DEVICE_NAME " : failed to request interrupt for GPIO_START_KEY pin %d.\n",
+		pr_err(DEVICE_NAME ": failed to request interrupt for GPIO_START_KEY pin %d.\n",
 		 pins->start_key_pin);
 		err = irq_num;
 		goto err_return_irq_free_right;
 	}
 	pins->start_key_irq = irq_num;				//Match interrupt to handler
-	err = request_any_context_irq(
-			irq_num,
-			start_key_interrupt_handler,
-			IRQF_TRIGGER_RISING | IRQF_DISABLED,
-			DEVICE_NAME,
-			(void*)dev
-		);
+	err = request_key_irq(irq_num, start_key_interrupt_handler);
 	if (err < 0) {
-			printk(KERN_ALERT DEVICE_NAME " : failed to enable IRQ %d for pin %d.\n",
+			pr_err(DEVICE_NAME ": failed to enable IRQ %d for pin %d.\n",
 				 irq_num, pins->start_key_pin);
 			goto err_return_irq_free_right;
 	}
@@ -403,21 +671,15 @@ static int request_interrupts(struct keyboard_pins *pins){
 	/* UP KEY INTERRUPT */
 	irq_num = gpio_to_irq(pins->up_key_pin);	//Request interrupt number
 	if (irq_num < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request interrupt for GPIO_UP_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request interrupt for GPIO_UP_KEY pin %d.\n",
 		 pins->up_key_pin);
 	  err = irq_num;
 	  goto err_return_irq_free_start;
 	}
 	pins->up_key_irq = irq_num;				//Match interrupt to handler
-	err = request_any_context_irq(
-      irq_num,
-      up_key_interrupt_handler,
-      IRQF_TRIGGER_RISING | IRQF_DISABLED,
-      DEVICE_NAME,
-      (void*)dev
-   	);
+	err = request_key_irq(irq_num, up_key_interrupt_handler);
 	if (err < 0) {
-      printk(KERN_ALERT DEVICE_NAME " : failed to enable IRQ %d for pin %d.\n",
+      pr_err(DEVICE_NAME ": failed to enable IRQ %d for pin %d.\n",
          irq_num, pins->up_key_pin);
       goto err_return_irq_free_start;
 	}
@@ -425,21 +687,15 @@ static int request_interrupts(struct keyboard_pins *pins){
 	/* DOWN KEY INTERRUPT */
 	irq_num = gpio_to_irq(pins->down_key_pin);	//Request interrupt number
 	if (irq_num < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request interrupt for GPIO_DOWN_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request interrupt for GPIO_DOWN_KEY pin %d.\n",
 		 pins->down_key_pin);
 	  err = irq_num;
 	  goto err_return_irq_free_up;
 	}
 	pins->down_key_irq = irq_num;								//Match interrupt to handler
-	err = request_any_context_irq(
-      irq_num,
-      down_key_interrupt_handler,
-      IRQF_TRIGGER_RISING | IRQF_DISABLED,
-      DEVICE_NAME,
-      (void*)dev
-   	);
+	err = request_key_irq(irq_num, down_key_interrupt_handler);
 	if (err < 0) {
-      printk(KERN_ALERT DEVICE_NAME " : failed to enable IRQ %d for pin %d.\n",
+      pr_err(DEVICE_NAME ": failed to enable IRQ %d for pin %d.\n",
          irq_num, pins->down_key_pin);
       goto err_return_irq_free_up;
 	}
@@ -447,21 +703,15 @@ static int request_interrupts(struct keyboard_pins *pins){
 	/* ESCAPE KEY INTERRUPT */
 	irq_num = gpio_to_irq(pins->escape_key_pin);	//Request interrupt number
 	if (irq_num < 0) {
-		printk(KERN_ALERT DEVICE_NAME " : failed to request interrupt for GPIO_ESCAPE_KEY pin %d.\n",
+		pr_err(DEVICE_NAME ": failed to request interrupt for GPIO_ESCAPE_KEY pin %d.\n",
 		 pins->escape_key_pin);
 		err = irq_num;
 		goto err_return_irq_free_down;
 	}
 	pins->escape_key_irq = irq_num;						//Match interrupt to handler
-	err = request_any_context_irq(
-			irq_num,
-			escape_key_interrupt_handler,
-			IRQF_TRIGGER_RISING | IRQF_DISABLED,
-			DEVICE_NAME,
-			(void*)dev
-		);
+	err = request_key_irq(irq_num, escape_key_interrupt_handler);
 	if (err < 0) {
-			printk(KERN_ALERT DEVICE_NAME " : failed to enable IRQ %d for pin %d.\n",
+			pr_err(DEVICE_NAME ": failed to enable IRQ %d for pin %d.\n",
 				 irq_num, pins->escape_key_pin);
 			goto err_return_irq_free_down;
 	}
@@ -469,21 +719,15 @@ static int request_interrupts(struct keyboard_pins *pins){
 	/* LEFT KEY INTERRUPT */
 	irq_num = gpio_to_irq(pins->left_key_pin);	//Request interrupt number
 	if (irq_num < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request interrupt for GPIO_LEFT_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request interrupt for GPIO_LEFT_KEY pin %d.\n",
 		 pins->left_key_pin);
 	  err = irq_num;
 	  goto err_return_irq_free_escape;
 	}
 	pins->left_key_irq = irq_num;									//Match interrupt to handler
-	err = request_any_context_irq(
-      irq_num,
-      left_key_interrupt_handler,
-      IRQF_TRIGGER_RISING | IRQF_DISABLED,
-      DEVICE_NAME,
-      (void*)dev
-   	);
+	err = request_key_irq(irq_num, left_key_interrupt_handler);
 	if (err < 0) {
-      printk(KERN_ALERT DEVICE_NAME " : failed to enable IRQ %d for pin %d.\n",
+      pr_err(DEVICE_NAME ": failed to enable IRQ %d for pin %d.\n",
          irq_num, pins->left_key_pin);
       goto err_return_irq_free_escape;
 	}
@@ -518,15 +762,55 @@ static void release_pins(struct keyboard_pins *pins){
 	gpio_free(pins->up_key_pin);
 	gpio_free(pins->start_key_pin);
 	gpio_free(pins->right_key_pin);
-	if (pollable_bak) gpio_free(pins->poll_interrupt_pin);
+}
+
+/* Hints every active irq with the keyboard cpus, or drops the hints. Tries
+ * them all and returns the last error.
+ */
+static int set_irq_affinity(struct keyboard_pins *pins){
+	const struct cpumask *mask = affinity_irq_mask();
+	unsigned int irqs[NUM_KEYS];
+	int i, num, err, ret = 0;
+
+	num = active_irqs(pins, irqs);
+	for (i = 0; i < num; i++) {
+		err = keyboard_irq_set_affinity_hint(irqs[i], mask);
+		if (err < 0) ret = err;
+	}
+	return ret;
+}
+
+/* Irqs requested in the current mode, irqs must hold NUM_KEYS entries */
+static int active_irqs(struct keyboard_pins *pins, unsigned int *irqs){
+	if (TIMER_POLLED) return 0;
+	if (POLLABLE) {
+		irqs[0] = pins->poll_interrupt_irq;
+		return 1;
+	}
+	if (!KEYBOARD_HAS_MULTI_LINE) return 0;
+	irqs[0] = pins->right_key_irq;
+	irqs[1] = pins->start_key_irq;
+	irqs[2] = pins->up_key_irq;
+	irqs[3] = pins->down_key_irq;
+	irqs[4] = pins->escape_key_irq;
+	irqs[5] = pins->left_key_irq;
+	return NUM_KEYS;
 }
 
 static void release_interrupts(struct keyboard_pins *pins){
+	unsigned int irqs[NUM_KEYS];
+	int i, num;
+
+	if (TIMER_POLLED) return;	//Nothing was requested
+	/* free_irq() wants the hints gone */
+	num = active_irqs(pins, irqs);
+	for (i = 0; i < num; i++) keyboard_irq_set_affinity_hint(irqs[i], NULL);
+
 	/* If the device is configured as pollable, then there is only one interrupt */
-	if (pollable_bak) {
+	if (POLLABLE) {
 		disable_irq(pins->poll_interrupt_irq);
 		free_irq(pins->poll_interrupt_irq, (void*)dev);
-	} else {
+	} else if (KEYBOARD_HAS_MULTI_LINE) {
 		/* START KEY DISABLE IRQ */
 		disable_irq(pins->start_key_irq);
 		free_irq(pins->start_key_irq, (void*)dev);
@@ -557,21 +841,21 @@ static void release_interrupts(struct keyboard_pins *pins){
 static int request_pins(struct keyboard_pins *pins){
 	int err;
 
-	printk(KERN_ALERT DEVICE_NAME ": REQUEST VCC PIN \n");
+	keyboard_trace("REQUEST VCC PIN \n");
 	/* Request VCC pin */
 	err = gpio_request_one(pins->vcc_pin, GPIOF_OUT_INIT_HIGH,
 	  DEVICE_NAME " gpio_vcc");
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO_VCC pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request GPIO_VCC pin %d.\n",
 		 pins->vcc_pin);
 	  goto err_return;
 	}
 
 	/* Request RIGHT pin */
-	printk(KERN_ALERT DEVICE_NAME ": REQUEST RIGHT PIN \n");
+	keyboard_trace("REQUEST RIGHT PIN \n");
 	err = gpio_request_one(pins->right_key_pin, GPIOF_IN, DEVICE_NAME " gpio_key_right");
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO_RIGHT_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request GPIO_RIGHT_KEY pin %d.\n",
 		 pins->right_key_pin);
 	  goto err_return_free_vcc;
 	}
@@ -579,7 +863,7 @@ static int request_pins(struct keyboard_pins *pins){
 	/* Request START pin */
 	err = gpio_request_one(pins->start_key_pin, GPIOF_IN, DEVICE_NAME " gpio_key_start");
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO_START_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request GPIO_START_KEY pin %d.\n",
 		 pins->start_key_pin);
 	  goto err_return_free_right;
 	}
@@ -587,7 +871,7 @@ static int request_pins(struct keyboard_pins *pins){
 	/* Request UP pin */
 	err = gpio_request_one(pins->up_key_pin, GPIOF_IN, DEVICE_NAME " gpio_key_up");
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO_UP_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request GPIO_UP_KEY pin %d.\n",
 		 pins->up_key_pin);
 	  goto err_return_free_start;
 	}
@@ -595,7 +879,7 @@ static int request_pins(struct keyboard_pins *pins){
 	/* Request DOWN pin */
 	err = gpio_request_one(pins->down_key_pin, GPIOF_IN, DEVICE_NAME " gpio_key_down");
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO_DOWN_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request GPIO_DOWN_KEY pin %d.\n",
 		 pins->down_key_pin);
 	  goto err_return_free_up;
 	}
@@ -603,7 +887,7 @@ static int request_pins(struct keyboard_pins *pins){
 	/* Request ESCAPE pin */
 	err = gpio_request_one(pins->escape_key_pin, GPIOF_IN, DEVICE_NAME " gpio_key_escape");
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO_ESCAPE_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request GPIO_ESCAPE_KEY pin %d.\n",
 		 pins->escape_key_pin);
 	  goto err_return_free_down;
 	}
@@ -611,11 +895,15 @@ static int request_pins(struct keyboard_pins *pins){
 	/* Request LEFT pin */
 	err = gpio_request_one(pins->left_key_pin, GPIOF_IN, DEVICE_NAME " gpio_key_left");
 	if (err < 0) {
-	  printk(KERN_ALERT DEVICE_NAME " : failed to request GPIO_LEFT_KEY pin %d.\n",
+	  pr_err(DEVICE_NAME ": failed to request GPIO_LEFT_KEY pin %d.\n",
 		 pins->left_key_pin);
 	  goto err_return_free_escape;
 	}
 
+	pins->cansleep = gpio_cansleep(pins->right_key_pin) || gpio_cansleep(pins->start_key_pin) ||
+		gpio_cansleep(pins->up_key_pin) || gpio_cansleep(pins->down_key_pin) ||
+		gpio_cansleep(pins->escape_key_pin) || gpio_cansleep(pins->left_key_pin);
+
 	return 0;		//Success
 
 	err_return_free_escape:
@@ -633,27 +921,3 @@ static int request_pins(struct keyboard_pins *pins){
 	err_return:
 		return err;
 }
-
-static void translate_gpio_num(uint16_t gpio_num, uint32_t *val_ptr, uint32_t *mmap_ptr){
-	int num = (gpio_num % 100) - 1;
-	// pin is in P9
-	if (gpio_num >= 900) {
-		// Check gpio_num range
-		if((num) >= 0 && (num) <= 47) {
-			*mmap_ptr = AM33XX_CONTROL_BASE + pins9_offset[num];
-			*val_ptr = pins9_value[num];
-			return;
-		}
-	}
-	// pin is in P8
-	else if(gpio_num >= 800) {
-		if((num) >= 0 && (num) <= 45) {
-			*mmap_ptr = AM33XX_CONTROL_BASE + pins8_offset[num];
-			*val_ptr = pins8_value[num];
-			return;
-		}
-	}
-	*mmap_ptr = 0;
-	*val_ptr = 0;
-	return;
-	}
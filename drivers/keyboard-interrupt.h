@@ -4,22 +4,27 @@
 #include "keyboard-public.h"
 #include <linux/wait.h>
 #include <linux/cdev.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include "keyboard-compat.h"
+#include "keyboard-events.h"
 
-/* Bit 5: 1 - Input, 0 - Output
- * Bit 4: 1 - Pull up, 0 - Pull down
- * Bit 3: 1 - Pull disabled, 0 - Pull enabled
- * Bit 2 \
- * Bit 1 |- Mode
- * Bit 0 /
-*/
-#define OUTPUT_PULLUP 0x7 | (2 << 3)
-#define INPUT_PULLUP 0x7 | (2 << 3) | (1 << 5)
-#define OUTPUT_PULLDOWN 0x7
-#define INPUT_PULLDOWN 0x7 | (1 << 5)
-
+#ifdef CONFIG_SIMPLE_KEYBOARD_GPIOSIM
+/* Default line offsets within the simulated gpio chip (see "keyboard-gpiosim.c")
+ * which must expose at least 8 lines
+ */
+#define GPIO_VCC 0
+#define GPIO_KEY_RIGHT 1
+#define GPIO_KEY_START 2
+#define GPIO_KEY_UP 3
+#define GPIO_KEY_DOWN 4
+#define GPIO_KEY_ESCAPE 5
+#define GPIO_KEY_LEFT 6
+#define GPIO_POLL_IRQ 7
+#else
 /* These are the PIN NUMBERS
  * If header changes, then these numbers must change to as well as the
- * offset/value arrays used in "keyboard-interrupt.c"
+ * offset/value arrays used in "keyboard-am335x.c"
  *
  * They are initialized following the standard defined in "keyboard-public.h"
  */
@@ -31,45 +36,90 @@
 #define GPIO_KEY_ESCAPE 925
 #define GPIO_KEY_LEFT 927
 #define GPIO_POLL_IRQ 931
+#endif
 #define GPIO_USED_NUM 7	//Number of used gpio pins
 
+/* Acquisition modes built into the module, see the Makefile. Checks of the
+ * running mode are written with these so a mode left out is folded away by
+ * the compiler together with its handlers.
+ */
+#define KEYBOARD_HAS_MULTI_LINE IS_ENABLED(CONFIG_SIMPLE_KEYBOARD_MULTI_LINE)
+#define KEYBOARD_HAS_SINGLE_LINE IS_ENABLED(CONFIG_SIMPLE_KEYBOARD_SINGLE_LINE)
+#define KEYBOARD_HAS_TIMER_POLL IS_ENABLED(CONFIG_SIMPLE_KEYBOARD_TIMER_POLL)
+
+/* Chatter of the event path (irq handlers, open, ioctl) and of the pin and
+ * irq setup, only printed when built with DEBUG=y. Arguments are still type
+ * checked otherwise. Failures use pr_err().
+ */
+#ifdef CONFIG_SIMPLE_KEYBOARD_DEBUG
+#define keyboard_trace(fmt, ...) printk(KERN_DEBUG DEVICE_NAME ": " fmt, ##__VA_ARGS__)
+#else
+#define keyboard_trace(fmt, ...) no_printk(KERN_DEBUG DEVICE_NAME ": " fmt, ##__VA_ARGS__)
+#endif
+
 /* Mask to get the config parameters within the keyboard_dev struct */
 #define MASK_POLLABLE	0x01
 #define MASK_CONFIGURED 0x02
 
 /* Pin structure, it is shared since user could config the pins used for this
  * device and it is done by passing this structure to ioctl functions
+ *
+ * Pins hold kernel gpio numbers as resolved by the backend, which can go well
+ * beyond 255 on hosts with dynamically numbered chips.
  */
 struct keyboard_pins {
-  	uint8_t poll_interrupt_pin;
+  	uint16_t poll_interrupt_pin;
   	uint16_t poll_interrupt_irq;
-  	uint8_t vcc_pin;
+  	uint16_t vcc_pin;
   	uint16_t right_key_irq;
-  	uint8_t right_key_pin;
+  	uint16_t right_key_pin;
   	uint16_t start_key_irq;
-  	uint8_t start_key_pin;
+  	uint16_t start_key_pin;
   	uint16_t up_key_irq;
-  	uint8_t up_key_pin;
+  	uint16_t up_key_pin;
   	uint16_t down_key_irq;
-  	uint8_t down_key_pin;
+  	uint16_t down_key_pin;
   	uint16_t escape_key_irq;
-  	uint8_t escape_key_pin;
+  	uint16_t escape_key_pin;
   	uint16_t left_key_irq;
-  	uint8_t left_key_pin;
+  	uint16_t left_key_pin;
+  	uint8_t cansleep;		//Lines sit on a sleeping controller, use threaded irqs
   };
 
 struct keyboard_dev {
-  uint8_t key;
-  wait_queue_head_t readers_queue;
+  spinlock_t lock;		//Protects keys and hub, taken from irq context but not by key irqs
+  struct mutex config_lock;	//Serializes configuration commands
+  struct key_state keys;
+  struct gesture_state gestures;	//Gesture recognition on top of keys
+  struct event_hub hub;		//Queues of the open files
   struct cdev cdev;
-  atomic_t readers_count;
+  atomic_t readers_count;	//Readers blocked waiting for events
   uint8_t is_pollable :1;		//Indicates if get data comes from polling or interrupt (b0)
   uint8_t configured	:1;		//Indicates if already configured (b1)
+  uint8_t injecting	:1;		//Indicates if synthetic events are being injected (b2)
+  uint8_t gated	:1;		//Keyboard unpowered and irqs disabled by runtime PM (b3)
+  uint8_t timer_polled :1;	//Keys sampled by a timer, no irqs at all (b4)
+  uint32_t recovered_presses;	//Missed edges found by resampling the lines, under lock
+  uint32_t recovered_releases;
+  uint32_t merge_gen;		//Bumped under lock whenever staged edges are merged
   struct keyboard_pins pins;
 };
 
 int init_system(struct keyboard_dev *);
 int shutdown_system(void);
 int populate_config(struct pin_conf *user_conf);
+void export_config(struct pin_conf *user_conf);
+int edges_init(struct keyboard_dev *device);
+void edges_exit(void);
+void report_edge(struct keyboard_dev *data, uint8_t key);
+int merge_edges(struct keyboard_dev *data);
+void flush_edges(struct keyboard_dev *data);
+void report_state(struct keyboard_dev *data, uint8_t sampled);
+uint8_t sample_keys(struct keyboard_dev *data);
+void get_key_state(struct keyboard_dev *data, struct keyboard_state *out);
+void peek_key_state(struct keyboard_dev *data, struct keyboard_state *out);
+void power_system(struct keyboard_dev *device, int on);
+int wake_system(struct keyboard_dev *device, int enable);
+int affine_system(struct keyboard_dev *device);
 
 #endif
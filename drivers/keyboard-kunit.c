@@ -0,0 +1,746 @@
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+/* KUnit suite for the event core (queue, debounce, state diff, gestures and
+ * fan out) plus timed micro-benchmarks of its hot paths. The core is built
+ * into this test module directly so no hardware nor gpio support is needed.
+ *
+ * Run it under UML from a kernel tree with this directory copied or linked as
+ * drivers/misc/simple-keyboard, "source" its Kconfig from drivers/misc/Kconfig
+ * and "obj-y += simple-keyboard/" in drivers/misc/Makefile:
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/misc/simple-keyboard
+ *
+ * Out of tree it builds as simple_keyboard_kunit.ko with "make KUNIT=y".
+ */
+#include "keyboard-events.c"
+
+#define MS 1000000ULL
+#define BENCH_ITERATIONS 1000000
+#define BENCH_READERS 4
+
+static struct keyboard_ring *alloc_ring(struct kunit *test, uint32_t size){
+	struct keyboard_ring *ring = kunit_kzalloc(test, EVENT_RING_BYTES(size), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ring);
+	return ring;
+}
+
+static void fill_event(struct keyboard_event *ev, uint32_t seq){
+	memset(ev, 0, sizeof(struct keyboard_event));
+	ev->sequence = seq;
+	ev->key = RIGHT;
+	ev->type = KEYBOARD_EVENT_PRESS;
+}
+
+
+/*
+ *		EVENT QUEUE
+ */
+static void queue_rejects_bad_size(struct kunit *test){
+	struct keyboard_ring *ring = alloc_ring(test, 8);
+	struct event_queue q;
+
+	KUNIT_EXPECT_EQ(test, event_queue_init(&q, ring, 0), -EINVAL);
+	KUNIT_EXPECT_EQ(test, event_queue_init(&q, ring, 6), -EINVAL);
+	KUNIT_EXPECT_EQ(test, event_queue_init(&q, ring, 8), 0);
+	KUNIT_EXPECT_EQ(test, ring->mask, 7U);
+	KUNIT_EXPECT_TRUE(test, event_queue_empty(&q));
+}
+
+static void queue_keeps_order_across_wrap(struct kunit *test){
+	struct keyboard_event ev;
+	struct event_queue q;
+	uint32_t i, next = 0;
+
+	event_queue_init(&q, alloc_ring(test, 4), 4);
+	for (i = 0; i < 10; i++) {
+		fill_event(&ev, i);
+		KUNIT_ASSERT_EQ(test, event_queue_push(&q, &ev), 0);
+		if (i % 2) {	//Drain two every other push so head and tail wrap
+			KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+			KUNIT_EXPECT_EQ(test, ev.sequence, next++);
+			KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+			KUNIT_EXPECT_EQ(test, ev.sequence, next++);
+		}
+	}
+	KUNIT_EXPECT_EQ(test, event_queue_pop(&q, &ev), -EAGAIN);
+}
+
+static void queue_drops_newest_when_full(struct kunit *test){
+	struct keyboard_event ev;
+	struct event_queue q;
+	uint32_t i;
+
+	event_queue_init(&q, alloc_ring(test, 4), 4);
+	for (i = 0; i < 6; i++) {
+		fill_event(&ev, i);
+		KUNIT_EXPECT_EQ(test, event_queue_push(&q, &ev), i < 4 ? 0 : -ENOSPC);
+	}
+	KUNIT_EXPECT_EQ(test, event_queue_len(&q), 4U);
+	KUNIT_EXPECT_EQ(test, q.ring->dropped, 2U);
+	event_queue_pop(&q, &ev);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 0U);
+}
+
+static void queue_marks_overruns_in_band(struct kunit *test){
+	struct keyboard_event ev;
+	struct event_queue q;
+	uint32_t i;
+
+	event_queue_init(&q, alloc_ring(test, 4), 4);
+	for (i = 0; i < 6; i++) {
+		fill_event(&ev, i);
+		event_queue_push(&q, &ev);
+	}
+	event_queue_pop(&q, &ev);
+	fill_event(&ev, 6);
+	KUNIT_EXPECT_EQ(test, event_queue_push(&q, &ev), -ENOSPC);	//No room for marker and event
+	event_queue_pop(&q, &ev);
+	fill_event(&ev, 7);
+	KUNIT_EXPECT_EQ(test, event_queue_push(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, q.overruns, 1U);
+
+	event_queue_pop(&q, &ev);
+	event_queue_pop(&q, &ev);
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, (int)ev.type, KEYBOARD_EVENT_OVERRUN);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 3U);
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 7U);
+}
+
+static void queue_drops_oldest_when_asked(struct kunit *test){
+	struct keyboard_event ev;
+	struct event_queue q;
+	uint32_t i;
+
+	event_queue_init(&q, alloc_ring(test, 4), 4);
+	q.policy = KEYBOARD_QUEUE_DROP_OLDEST;
+	for (i = 0; i < 10; i++) {
+		fill_event(&ev, i);
+		KUNIT_EXPECT_EQ(test, event_queue_push(&q, &ev), 0);
+	}
+	KUNIT_EXPECT_EQ(test, event_queue_len(&q), 4U);
+	KUNIT_EXPECT_EQ(test, q.ring->dropped, 8U);
+
+	/* An evicted marker passes its count on to the next one */
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, (int)ev.type, KEYBOARD_EVENT_OVERRUN);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 4U);
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 8U);
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 4U);
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 9U);
+}
+
+static void queue_peek_keeps_event_until_advance(struct kunit *test){
+	struct keyboard_event ev;
+	struct event_queue q;
+	uint32_t i, pos, len;
+
+	event_queue_init(&q, alloc_ring(test, 4), 4);
+	for (i = 0; i < 2; i++) {
+		fill_event(&ev, i);
+		event_queue_push(&q, &ev);
+	}
+	KUNIT_ASSERT_EQ(test, event_queue_peek(&q, &ev, &pos), 0);
+	KUNIT_ASSERT_EQ(test, event_queue_peek(&q, &ev, &pos), 0);	//Not delivered, still there
+	KUNIT_EXPECT_EQ(test, ev.sequence, 0U);
+	event_queue_advance(&q, pos);
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&q, &ev), 0);
+	KUNIT_EXPECT_EQ(test, ev.sequence, 1U);
+	KUNIT_EXPECT_EQ(test, event_queue_peek(&q, &ev, &pos), -EAGAIN);
+
+	/* Releasing an event the producer dropped meanwhile leaves the tail alone */
+	q.policy = KEYBOARD_QUEUE_DROP_OLDEST;
+	for (i = 2; i < 6; i++) {
+		fill_event(&ev, i);
+		event_queue_push(&q, &ev);
+	}
+	KUNIT_ASSERT_EQ(test, event_queue_peek(&q, &ev, &pos), 0);
+	fill_event(&ev, 6);
+	event_queue_push(&q, &ev);
+	len = event_queue_len(&q);
+	event_queue_advance(&q, pos);
+	KUNIT_EXPECT_EQ(test, event_queue_len(&q), len);
+}
+
+static void queue_coalesces_repeats(struct kunit *test){
+	struct keyboard_event ev;
+	struct event_queue q;
+	uint32_t i;
+
+	event_queue_init(&q, alloc_ring(test, 4), 4);
+	q.policy = KEYBOARD_QUEUE_COALESCE;
+	for (i = 0; i < 7; i++) {
+		fill_event(&ev, i);
+		KUNIT_EXPECT_EQ(test, event_queue_push(&q, &ev), 0);
+	}
+	fill_event(&ev, 7);
+	ev.type = KEYBOARD_EVENT_RELEASE;
+	KUNIT_EXPECT_EQ(test, event_queue_push(&q, &ev), -ENOSPC);	//Not a repeat of the press
+	fill_event(&ev, 8);
+	ev.key = UP;
+	KUNIT_EXPECT_EQ(test, event_queue_push(&q, &ev), -ENOSPC);	//Other keys are lost
+	KUNIT_EXPECT_EQ(test, q.coalesced, 3U);
+	KUNIT_EXPECT_EQ(test, q.ring->dropped, 2U);
+	KUNIT_EXPECT_EQ(test, (int)q.ring->events[3].flags, 3);
+	KUNIT_EXPECT_EQ(test, (int)q.ring->events[3].type, KEYBOARD_EVENT_PRESS);
+}
+
+
+/*
+ *		KEY STATE
+ */
+static void edge_generates_press(struct kunit *test){
+	struct keyboard_event out[2];
+	struct key_state ks;
+
+	key_state_init(&ks, 0);
+	KUNIT_ASSERT_EQ(test, key_state_edge(&ks, UP, 10, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].key, UP);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_PRESS);
+	KUNIT_EXPECT_EQ(test, (int)out[0].state, KEY_BIT(UP));
+	KUNIT_EXPECT_EQ(test, out[0].timestamp, 10ULL);
+	KUNIT_EXPECT_EQ(test, key_state_edge(&ks, UNDEFINED_KEY, 20, out), 0);
+	KUNIT_EXPECT_EQ(test, key_state_edge(&ks, LEFT + 1, 20, out), 0);
+}
+
+static void edge_on_down_key_recovers_release(struct kunit *test){
+	struct keyboard_event out[2];
+	struct key_state ks;
+
+	key_state_init(&ks, 0);
+	key_state_edge(&ks, START, 10, out);
+	KUNIT_ASSERT_EQ(test, key_state_edge(&ks, START, 20, out), 2);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_RELEASE);
+	KUNIT_EXPECT_EQ(test, (int)out[0].state, 0);
+	KUNIT_EXPECT_EQ(test, (int)out[1].type, KEYBOARD_EVENT_PRESS);
+	KUNIT_EXPECT_EQ(test, out[1].sequence, out[0].sequence + 1);
+}
+
+static void debounce_filters_close_edges(struct kunit *test){
+	struct keyboard_event out[2];
+	struct key_state ks;
+
+	key_state_init(&ks, 5 * MS);
+	KUNIT_EXPECT_EQ(test, key_state_edge(&ks, DOWN, 100 * MS, out), 1);
+	KUNIT_EXPECT_EQ(test, key_state_edge(&ks, DOWN, 102 * MS, out), 0);
+	KUNIT_EXPECT_EQ(test, key_state_edge(&ks, ESCAPE, 102 * MS, out), 1);	//Per key window
+	KUNIT_EXPECT_EQ(test, key_state_edge(&ks, DOWN, 105 * MS, out), 2);
+}
+
+static void update_diffs_sampled_state(struct kunit *test){
+	struct keyboard_event out[NUM_KEYS];
+	struct key_state ks;
+
+	key_state_init(&ks, 0);
+	KUNIT_ASSERT_EQ(test, key_state_update(&ks, KEY_BIT(RIGHT) | KEY_BIT(LEFT), ALL_KEYS_MASK, 10, out), 2);
+	KUNIT_EXPECT_EQ(test, (int)out[0].key, RIGHT);
+	KUNIT_EXPECT_EQ(test, (int)out[1].key, LEFT);
+	KUNIT_EXPECT_EQ(test, (int)out[1].state, KEY_BIT(RIGHT) | KEY_BIT(LEFT));
+
+	/* Same sample, nothing new */
+	KUNIT_EXPECT_EQ(test, key_state_update(&ks, KEY_BIT(RIGHT) | KEY_BIT(LEFT), ALL_KEYS_MASK, 20, out), 0);
+
+	KUNIT_ASSERT_EQ(test, key_state_update(&ks, KEY_BIT(LEFT), ALL_KEYS_MASK, 30, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].key, RIGHT);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_RELEASE);
+	KUNIT_EXPECT_EQ(test, ks.last_change, 30ULL);
+}
+
+static void update_ignores_lines_not_sampled(struct kunit *test){
+	struct keyboard_event out[NUM_KEYS];
+	struct key_state ks;
+
+	key_state_init(&ks, 0);
+	KUNIT_EXPECT_EQ(test, key_state_update(&ks, ALL_KEYS_MASK | 0xC0, KEY_BIT(UP), 10, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].key, UP);
+	KUNIT_EXPECT_EQ(test, (int)ks.state, KEY_BIT(UP));
+}
+
+static void update_debounces_per_key(struct kunit *test){
+	struct keyboard_event out[NUM_KEYS];
+	struct key_state ks;
+
+	key_state_init(&ks, 5 * MS);
+	key_state_update(&ks, KEY_BIT(UP), ALL_KEYS_MASK, 100 * MS, out);
+	/* Bounce of UP is ignored and its state kept, DOWN still goes through */
+	KUNIT_ASSERT_EQ(test, key_state_update(&ks, KEY_BIT(DOWN), ALL_KEYS_MASK, 101 * MS, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].key, DOWN);
+	KUNIT_EXPECT_EQ(test, (int)ks.state, KEY_BIT(UP) | KEY_BIT(DOWN));
+}
+
+
+/*
+ *		EDGE STAGING
+ */
+static void stage_merges_in_timestamp_order(struct kunit *test){
+	struct edge_stage *stages[2];
+	struct edge_entry entry;
+	uint64_t horizon;
+
+	stages[0] = kunit_kzalloc(test, sizeof(struct edge_stage), GFP_KERNEL);
+	stages[1] = kunit_kzalloc(test, sizeof(struct edge_stage), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stages[0]);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stages[1]);
+	edge_stage_init(stages[0]);
+	edge_stage_init(stages[1]);
+
+	/* Two CPUs staging at the same time */
+	edge_stage_push(stages[0], UP, 0, 10 * MS);
+	edge_stage_push(stages[1], DOWN, 0, 11 * MS);
+	edge_stage_push(stages[0], LEFT, 0, 13 * MS);
+	edge_stage_push(stages[1], RIGHT, 0, 12 * MS);
+
+	horizon = edge_stage_horizon(stages, 2, 13 * MS);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 2, horizon, &entry), 1);
+	KUNIT_EXPECT_EQ(test, (int)entry.key, UP);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 2, horizon, &entry), 1);
+	KUNIT_EXPECT_EQ(test, (int)entry.key, DOWN);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 2, horizon, &entry), 1);
+	KUNIT_EXPECT_EQ(test, (int)entry.key, RIGHT);
+	/* Not older than the time the merge started, it waits for the next one */
+	KUNIT_EXPECT_EQ(test, edge_stage_next(stages, 2, horizon, &entry), 0);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 2, edge_stage_horizon(stages, 2, 14 * MS), &entry), 1);
+	KUNIT_EXPECT_EQ(test, (int)entry.key, LEFT);
+	KUNIT_EXPECT_EQ(test, entry.timestamp, 13 * MS);
+}
+
+/* A release that happened before the handler returned is staged as a low line */
+static void stage_recovers_release_read_low(struct kunit *test){
+	struct keyboard_event out[2];
+	struct edge_stage *stages[1];
+	struct edge_entry entry;
+	struct key_state ks;
+	uint64_t horizon;
+
+	stages[0] = kunit_kzalloc(test, sizeof(struct edge_stage), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stages[0]);
+	edge_stage_init(stages[0]);
+	key_state_init(&ks, 5 * MS);
+
+	edge_stage_push(stages[0], UP, 0, 10 * MS);
+	edge_stage_push(stages[0], UP, 1, 10 * MS + 2000);	//Short press, read low inside the debounce
+	edge_stage_push(stages[0], UP, 0, 10 * MS + 3000);	//Bounce of the release
+	edge_stage_push(stages[0], UP, 0, 30 * MS);
+	edge_stage_push(stages[0], UP, 1, 36 * MS);
+	edge_stage_push(stages[0], DOWN, 1, 37 * MS);	//Already up, nothing to recover
+
+	horizon = edge_stage_horizon(stages, 1, 40 * MS);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 1, horizon, &entry), 1);
+	KUNIT_ASSERT_EQ(test, key_state_entry(&ks, &entry, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_PRESS);
+
+	/* A low read is no bounce, the release is not debounced away */
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 1, horizon, &entry), 1);
+	KUNIT_ASSERT_EQ(test, key_state_entry(&ks, &entry, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_RELEASE);
+	KUNIT_EXPECT_EQ(test, out[0].timestamp, 10 * MS + 2000);
+	KUNIT_EXPECT_EQ(test, (int)ks.state, 0);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 1, horizon, &entry), 1);
+	KUNIT_EXPECT_EQ(test, key_state_entry(&ks, &entry, out), 0);
+
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 1, horizon, &entry), 1);
+	KUNIT_ASSERT_EQ(test, key_state_entry(&ks, &entry, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_PRESS);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 1, horizon, &entry), 1);
+	KUNIT_ASSERT_EQ(test, key_state_entry(&ks, &entry, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_RELEASE);
+	KUNIT_EXPECT_EQ(test, out[0].timestamp, 36 * MS);
+	KUNIT_EXPECT_EQ(test, (int)out[0].state, 0);
+	KUNIT_ASSERT_EQ(test, edge_stage_next(stages, 1, horizon, &entry), 1);
+	KUNIT_EXPECT_EQ(test, key_state_entry(&ks, &entry, out), 0);
+}
+
+static void stage_waits_for_busy_producer(struct kunit *test){
+	struct edge_stage *stages[2];
+	struct edge_entry entry;
+	int i;
+
+	stages[0] = kunit_kzalloc(test, sizeof(struct edge_stage), GFP_KERNEL);
+	stages[1] = kunit_kzalloc(test, sizeof(struct edge_stage), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stages[0]);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stages[1]);
+	edge_stage_init(stages[0]);
+	edge_stage_init(stages[1]);
+
+	for (i = 0; i < EDGE_STAGE_SIZE; i++)
+		KUNIT_ASSERT_EQ(test, edge_stage_push(stages[0], UP, 0, i + 1), 0);
+	KUNIT_EXPECT_EQ(test, edge_stage_push(stages[0], UP, 0, MS), -ENOSPC);
+
+	/* The edge being staged on the other CPU may be older than all of them */
+	stages[1]->busy = 1;
+	KUNIT_EXPECT_EQ(test, edge_stage_next(stages, 2, edge_stage_horizon(stages, 2, MS), &entry), 0);
+	stages[1]->busy = 0;
+	KUNIT_EXPECT_EQ(test, edge_stage_next(stages, 2, edge_stage_horizon(stages, 2, MS), &entry), 1);
+	KUNIT_EXPECT_EQ(test, edge_stage_push(stages[0], UP, 0, MS), 0);
+}
+
+
+/*
+ *		READERS HUB
+ */
+static void hub_copies_events_to_every_reader(struct kunit *test){
+	struct keyboard_event ev[3];
+	struct event_reader a, b;
+	struct event_hub hub;
+
+	event_hub_init(&hub);
+	event_queue_init(&a.queue, alloc_ring(test, 4), 4);
+	event_queue_init(&b.queue, alloc_ring(test, 2), 2);
+	event_hub_add(&hub, &a);
+	event_hub_add(&hub, &b);
+
+	fill_event(&ev[0], 0);
+	fill_event(&ev[1], 1);
+	fill_event(&ev[2], 2);
+	event_hub_dispatch(&hub, ev, 3);
+	KUNIT_EXPECT_EQ(test, event_queue_len(&a.queue), 3U);
+	KUNIT_EXPECT_EQ(test, event_queue_len(&b.queue), 2U);
+	KUNIT_EXPECT_EQ(test, b.queue.ring->dropped, 1U);	//Slow reader does not affect the others
+
+	event_hub_remove(&hub, &b);
+	event_hub_dispatch(&hub, ev, 1);
+	KUNIT_EXPECT_EQ(test, event_queue_len(&a.queue), 4U);
+	KUNIT_EXPECT_EQ(test, b.queue.ring->dropped, 1U);
+	event_hub_remove(&hub, &a);
+	KUNIT_EXPECT_PTR_EQ(test, hub.readers, (struct event_reader *)NULL);
+}
+
+static int notified;
+static uint8_t notified_keys;
+static void count_notify(struct event_reader *reader, uint8_t keys){
+	notified++;
+	notified_keys = keys;
+}
+
+static void hub_notifies_once_per_dispatch(struct kunit *test){
+	struct keyboard_event ev[3];
+	struct event_reader a;
+	struct event_hub hub;
+
+	event_hub_init(&hub);
+	event_queue_init(&a.queue, alloc_ring(test, 4), 4);
+	event_hub_add(&hub, &a);
+	a.notify = count_notify;
+	notified = 0;
+
+	fill_event(&ev[0], 0);
+	fill_event(&ev[1], 1);
+	fill_event(&ev[2], 2);
+	ev[2].key = UP;
+	event_hub_dispatch(&hub, ev, 3);
+	KUNIT_EXPECT_EQ(test, notified, 1);		//One per burst, not per event
+	KUNIT_EXPECT_EQ(test, (int)notified_keys, KEY_BIT(RIGHT) | KEY_BIT(UP));
+	event_hub_dispatch(&hub, &ev[2], 1);
+	KUNIT_EXPECT_EQ(test, notified, 2);
+	KUNIT_EXPECT_EQ(test, (int)notified_keys, KEY_BIT(UP));
+	event_hub_dispatch(&hub, ev, 1);
+	KUNIT_EXPECT_EQ(test, notified, 2);		//Queue full, nothing was queued
+	KUNIT_EXPECT_EQ(test, event_queue_len(&a.queue), 4U);
+}
+
+/* Drops presses of UP and turns RIGHT into LEFT */
+static int test_filter(struct event_reader *reader, struct keyboard_event *event){
+	if (event->key == UP) return 0;
+	if (event->key == RIGHT) event->key = LEFT;
+	return 1;
+}
+
+static void hub_filters_before_queueing(struct kunit *test){
+	struct keyboard_event ev[2], out;
+	struct event_reader a, b;
+	struct event_hub hub;
+
+	event_hub_init(&hub);
+	event_queue_init(&a.queue, alloc_ring(test, 4), 4);
+	event_queue_init(&b.queue, alloc_ring(test, 4), 4);
+	event_hub_add(&hub, &a);
+	event_hub_add(&hub, &b);
+	a.filter = test_filter;
+	a.notify = count_notify;
+	notified = 0;
+
+	fill_event(&ev[0], 0);
+	fill_event(&ev[1], 1);
+	ev[1].key = UP;
+	event_hub_dispatch(&hub, &ev[1], 1);
+	KUNIT_EXPECT_EQ(test, notified, 0);		//Everything dropped, no wake up
+	KUNIT_EXPECT_TRUE(test, event_queue_empty(&a.queue));
+
+	event_hub_dispatch(&hub, ev, 2);
+	KUNIT_EXPECT_EQ(test, notified, 1);
+	KUNIT_EXPECT_EQ(test, (int)notified_keys, KEY_BIT(LEFT));
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&a.queue, &out), 0);
+	KUNIT_EXPECT_EQ(test, (int)out.key, LEFT);
+	KUNIT_EXPECT_EQ(test, (int)ev[0].key, RIGHT);	//Other readers see the original
+	KUNIT_EXPECT_EQ(test, event_queue_len(&b.queue), 3U);
+}
+
+
+/*
+ *		GESTURES
+ */
+
+/* Samples one key as pressed or released at now and feeds the gestures */
+static int gesture_sample(struct gesture_state *gs, struct key_state *ks, uint8_t key, int down, uint64_t now, struct keyboard_event *out){
+	int num = key_state_update(ks, down ? KEY_BIT(key) : 0, KEY_BIT(key), now, out);
+	return gesture_state_feed(gs, ks, out, num);
+}
+
+static void gesture_tap_and_double_tap(struct kunit *test){
+	struct keyboard_event out[GESTURE_MAX_EVENTS(NUM_KEYS)];
+	struct gesture_state gs;
+	struct key_state ks;
+
+	key_state_init(&ks, 0);
+	gesture_state_init(&gs);
+	gesture_state_set(&gs, UP, 500 * MS, 200 * MS);
+
+	KUNIT_EXPECT_EQ(test, gesture_sample(&gs, &ks, UP, 1, 1000 * MS, out), 1);
+	KUNIT_EXPECT_EQ(test, gesture_sample(&gs, &ks, UP, 0, 1100 * MS, out), 1);	//TAP waits for the window
+	KUNIT_EXPECT_EQ(test, gesture_state_deadline(&gs), 1300 * MS);
+	KUNIT_EXPECT_EQ(test, gesture_state_expire(&gs, &ks, 1299 * MS, out), 0);
+	KUNIT_ASSERT_EQ(test, gesture_state_expire(&gs, &ks, 1300 * MS, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_TAP);
+	KUNIT_EXPECT_EQ(test, out[0].timestamp, 1100 * MS);			//Time of the release
+	KUNIT_EXPECT_EQ(test, out[0].sequence, 2U);
+
+	gesture_sample(&gs, &ks, UP, 1, 2000 * MS, out);
+	gesture_sample(&gs, &ks, UP, 0, 2050 * MS, out);
+	KUNIT_ASSERT_EQ(test, gesture_sample(&gs, &ks, UP, 1, 2150 * MS, out), 2);
+	KUNIT_EXPECT_EQ(test, (int)out[1].type, KEYBOARD_EVENT_DOUBLE_TAP);
+	KUNIT_EXPECT_EQ(test, out[1].timestamp, 2150 * MS);
+	KUNIT_EXPECT_EQ(test, gesture_sample(&gs, &ks, UP, 0, 2200 * MS, out), 1);	//Release swallowed
+	KUNIT_EXPECT_EQ(test, gesture_state_deadline(&gs), 0ULL);
+}
+
+static void gesture_long_press_and_hold_release(struct kunit *test){
+	struct keyboard_event out[GESTURE_MAX_EVENTS(NUM_KEYS)];
+	struct gesture_state gs;
+	struct key_state ks;
+
+	key_state_init(&ks, 0);
+	gesture_state_init(&gs);
+	gesture_state_set(&gs, START, 500 * MS, 0);
+
+	gesture_sample(&gs, &ks, START, 1, 1000 * MS, out);
+	KUNIT_ASSERT_EQ(test, gesture_state_expire(&gs, &ks, 1510 * MS, out), 1);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_LONG_PRESS);
+	KUNIT_EXPECT_EQ(test, out[0].timestamp, 1500 * MS);			//Not when the timer ran
+	KUNIT_EXPECT_EQ(test, (int)out[0].state, KEY_BIT(START));
+	KUNIT_ASSERT_EQ(test, gesture_sample(&gs, &ks, START, 0, 1800 * MS, out), 2);
+	KUNIT_EXPECT_EQ(test, (int)out[1].type, KEYBOARD_EVENT_HOLD_RELEASE);
+
+	/* Timer late: the release completes the long press first, in order */
+	gesture_sample(&gs, &ks, START, 1, 3000 * MS, out);
+	KUNIT_ASSERT_EQ(test, gesture_sample(&gs, &ks, START, 0, 3700 * MS, out), 3);
+	KUNIT_EXPECT_EQ(test, (int)out[0].type, KEYBOARD_EVENT_LONG_PRESS);
+	KUNIT_EXPECT_EQ(test, (int)out[1].type, KEYBOARD_EVENT_RELEASE);
+	KUNIT_EXPECT_EQ(test, (int)out[2].type, KEYBOARD_EVENT_HOLD_RELEASE);
+	KUNIT_EXPECT_EQ(test, out[2].sequence, out[0].sequence + 2);
+	KUNIT_EXPECT_EQ(test, ks.sequence, out[2].sequence + 1);
+
+	/* Short press without a double tap window is a TAP right away */
+	gesture_sample(&gs, &ks, START, 1, 4000 * MS, out);
+	KUNIT_ASSERT_EQ(test, gesture_sample(&gs, &ks, START, 0, 4100 * MS, out), 2);
+	KUNIT_EXPECT_EQ(test, (int)out[1].type, KEYBOARD_EVENT_TAP);
+}
+
+static void hub_sends_gestures_on_request(struct kunit *test){
+	struct keyboard_event ev[2];
+	struct event_reader a, b;
+	struct event_hub hub;
+
+	event_hub_init(&hub);
+	event_queue_init(&a.queue, alloc_ring(test, 4), 4);
+	event_queue_init(&b.queue, alloc_ring(test, 4), 4);
+	event_hub_add(&hub, &a);
+	event_hub_add(&hub, &b);
+	a.gestures = 1;
+
+	fill_event(&ev[0], 0);
+	fill_event(&ev[1], 1);
+	ev[1].type = KEYBOARD_EVENT_LONG_PRESS;
+	event_hub_dispatch(&hub, ev, 2);
+	KUNIT_EXPECT_EQ(test, event_queue_len(&a.queue), 2U);
+	KUNIT_EXPECT_EQ(test, event_queue_len(&b.queue), 1U);
+}
+
+static void hub_moves_time_to_reader_clock(struct kunit *test){
+	struct keyboard_event ev[2], out;
+	struct event_reader a, b;
+	struct event_hub hub;
+
+	event_hub_init(&hub);
+	event_queue_init(&a.queue, alloc_ring(test, 4), 4);
+	event_queue_init(&b.queue, alloc_ring(test, 4), 4);
+	event_hub_add(&hub, &a);
+	event_hub_add(&hub, &b);
+	a.clock = KEYBOARD_CLOCK_BOOTTIME;
+	b.clock_sync = 1;
+	hub.clock_offset[KEYBOARD_CLOCK_BOOTTIME] = 7 * MS;	//Time spent suspended
+
+	fill_event(&ev[0], 0);
+	ev[0].timestamp = 100 * MS;
+	fill_event(&ev[1], 0);
+	ev[1].type = KEYBOARD_EVENT_CLOCK_SYNC;
+	event_hub_dispatch(&hub, ev, 2);
+
+	KUNIT_ASSERT_EQ(test, event_queue_len(&a.queue), 1U);	//No sync records asked
+	event_queue_pop(&a.queue, &out);
+	KUNIT_EXPECT_EQ(test, out.timestamp, 107 * MS);
+	KUNIT_ASSERT_EQ(test, event_queue_len(&b.queue), 2U);
+	event_queue_pop(&b.queue, &out);
+	KUNIT_EXPECT_EQ(test, out.timestamp, 100 * MS);
+	KUNIT_EXPECT_EQ(test, ev[0].timestamp, 100 * MS);	//Callers keep their events
+}
+
+static int filtered;
+static int drop_filter(struct event_reader *reader, struct keyboard_event *event){
+	filtered++;
+	return 0;
+}
+
+/* Sync records have no key, filters never see them and they still wake up */
+static void hub_queues_sync_records_past_filter(struct kunit *test){
+	struct keyboard_event ev[2], out;
+	struct event_reader a;
+	struct event_hub hub;
+
+	event_hub_init(&hub);
+	event_queue_init(&a.queue, alloc_ring(test, 4), 4);
+	event_hub_add(&hub, &a);
+	a.filter = drop_filter;
+	a.notify = count_notify;
+	a.clock_sync = 1;
+	notified = 0;
+	filtered = 0;
+
+	fill_event(&ev[0], 0);
+	ev[0].key = UNDEFINED_KEY;
+	ev[0].type = KEYBOARD_EVENT_CLOCK_SYNC;
+	event_hub_dispatch(&hub, ev, 1);
+	KUNIT_EXPECT_EQ(test, filtered, 0);
+	KUNIT_EXPECT_EQ(test, notified, 1);
+	KUNIT_EXPECT_EQ(test, (int)notified_keys, EVENT_NOTIFY_RECORD);
+	KUNIT_ASSERT_EQ(test, event_queue_pop(&a.queue, &out), 0);
+	KUNIT_EXPECT_EQ(test, (int)out.type, KEYBOARD_EVENT_CLOCK_SYNC);
+
+	fill_event(&ev[1], 1);
+	event_hub_dispatch(&hub, ev, 2);
+	KUNIT_EXPECT_EQ(test, filtered, 1);		//Only the key event
+	KUNIT_EXPECT_EQ(test, notified, 2);
+	KUNIT_EXPECT_EQ(test, (int)notified_keys, EVENT_NOTIFY_RECORD);
+	KUNIT_EXPECT_EQ(test, event_queue_len(&a.queue), 1U);
+}
+
+
+/*
+ *		MICRO-BENCHMARKS
+ */
+static void report_bench(struct kunit *test, const char *name, uint64_t start, uint32_t iterations){
+	uint64_t elapsed = ktime_to_ns(ktime_get()) - start;
+	kunit_info(test, "%s: %llu ns/op over %u ops\n", name,
+		div_u64(elapsed, iterations), iterations);
+}
+
+static void bench_queue_push_pop(struct kunit *test){
+	struct keyboard_event ev;
+	struct event_queue q;
+	uint64_t start;
+	uint32_t i;
+
+	event_queue_init(&q, alloc_ring(test, 64), 64);
+	fill_event(&ev, 0);
+	start = ktime_to_ns(ktime_get());
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		event_queue_push(&q, &ev);
+		event_queue_pop(&q, &ev);
+	}
+	report_bench(test, "queue push+pop", start, BENCH_ITERATIONS);
+	KUNIT_EXPECT_TRUE(test, event_queue_empty(&q));
+}
+
+/* What an irq handler does once the line has been read */
+static void bench_edge_dispatch(struct kunit *test){
+	struct keyboard_event out[2];
+	struct event_reader readers[BENCH_READERS], *r;
+	struct event_hub hub;
+	struct key_state ks;
+	uint64_t start;
+	uint32_t i;
+	int j, num;
+
+	event_hub_init(&hub);
+	for (j = 0; j < BENCH_READERS; j++) {
+		event_queue_init(&readers[j].queue, alloc_ring(test, 64), 64);
+		event_hub_add(&hub, &readers[j]);
+	}
+	key_state_init(&ks, 0);
+
+	start = ktime_to_ns(ktime_get());
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		num = key_state_edge(&ks, (i % NUM_KEYS) + 1, i, out);
+		event_hub_dispatch(&hub, out, num);
+		for (r = hub.readers; r; r = r->next) r->queue.ring->tail = r->queue.ring->head;	//Consume
+	}
+	report_bench(test, "edge + dispatch to 4 readers", start, BENCH_ITERATIONS);
+}
+
+/* What the single line handler does with the polled lines */
+static void bench_state_update(struct kunit *test){
+	struct keyboard_event out[NUM_KEYS];
+	struct key_state ks;
+	uint64_t start;
+	uint32_t i;
+
+	key_state_init(&ks, 0);
+	start = ktime_to_ns(ktime_get());
+	for (i = 0; i < BENCH_ITERATIONS; i++)
+		key_state_update(&ks, i & ALL_KEYS_MASK, ALL_KEYS_MASK, i, out);
+	report_bench(test, "state update", start, BENCH_ITERATIONS);
+}
+
+static struct kunit_case keyboard_test_cases[] = {
+	KUNIT_CASE(queue_rejects_bad_size),
+	KUNIT_CASE(queue_keeps_order_across_wrap),
+	KUNIT_CASE(queue_drops_newest_when_full),
+	KUNIT_CASE(queue_marks_overruns_in_band),
+	KUNIT_CASE(queue_drops_oldest_when_asked),
+	KUNIT_CASE(queue_peek_keeps_event_until_advance),
+	KUNIT_CASE(queue_coalesces_repeats),
+	KUNIT_CASE(edge_generates_press),
+	KUNIT_CASE(edge_on_down_key_recovers_release),
+	KUNIT_CASE(debounce_filters_close_edges),
+	KUNIT_CASE(update_diffs_sampled_state),
+	KUNIT_CASE(update_ignores_lines_not_sampled),
+	KUNIT_CASE(update_debounces_per_key),
+	KUNIT_CASE(stage_merges_in_timestamp_order),
+	KUNIT_CASE(stage_waits_for_busy_producer),
+	KUNIT_CASE(stage_recovers_release_read_low),
+	KUNIT_CASE(hub_copies_events_to_every_reader),
+	KUNIT_CASE(hub_notifies_once_per_dispatch),
+	KUNIT_CASE(hub_filters_before_queueing),
+	KUNIT_CASE(gesture_tap_and_double_tap),
+	KUNIT_CASE(gesture_long_press_and_hold_release),
+	KUNIT_CASE(hub_sends_gestures_on_request),
+	KUNIT_CASE(hub_moves_time_to_reader_clock),
+	KUNIT_CASE(hub_queues_sync_records_past_filter),
+	KUNIT_CASE(bench_queue_push_pop),
+	KUNIT_CASE(bench_edge_dispatch),
+	KUNIT_CASE(bench_state_update),
+	{}
+};
+
+static struct kunit_suite keyboard_test_suite = {
+	.name = "simple-keyboard",
+	.test_cases = keyboard_test_cases,
+};
+kunit_test_suite(keyboard_test_suite);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("KUnit tests for the simple keyboard event core");
@@ -0,0 +1,139 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-netlink.h"
+#include "keyboard-affinity.h"
+
+/* Events waiting for the work item, a burst of every key plus its gestures
+ * fits several times
+ */
+#define NETLINK_QUEUE_SIZE 256
+
+static struct keyboard_dev *dev;
+static struct event_reader nl_reader;	//Linked into the hub while the family is registered
+static struct work_struct nl_work;
+
+static void nl_notify(struct event_reader *reader, uint8_t keys);
+static void nl_work_handler(struct work_struct *work);
+static int nl_send(const struct keyboard_event *events, int num);
+
+static const struct genl_multicast_group keyboard_mcgrps[] = {
+	{ .name = KEYBOARD_GENL_MCGRP },
+};
+
+static struct genl_family keyboard_family = {
+	.name = KEYBOARD_GENL_NAME,
+	.version = KEYBOARD_GENL_VERSION,
+	.maxattr = KEYBOARD_GENL_ATTR_MAX,
+	.netnsok = true,		//Subscribers in containers too
+	.module = THIS_MODULE,
+	.mcgrps = keyboard_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(keyboard_mcgrps),
+};
+
+
+/**
+ *		EVENT PATH
+ */
+
+/* Called by the hub with the device lock held, possibly in irq context */
+static void nl_notify(struct event_reader *reader, uint8_t keys){
+	queue_work_on(affinity_work_cpu(), system_wq, &nl_work);
+}
+
+/* A work item never runs twice at the same time, so it is the only consumer
+ * of the queue. Everything queued is sent before returning.
+ */
+static void nl_work_handler(struct work_struct *work){
+	struct keyboard_event events[KEYBOARD_GENL_BATCH];
+	int num;
+
+	do {
+		num = 0;
+		while (num < KEYBOARD_GENL_BATCH && event_queue_pop(&nl_reader.queue, &events[num]) == 0) num++;
+		if (num && nl_send(events, num) < 0) {
+			printk(KERN_DEBUG DEVICE_NAME ": NETLINK MESSAGE LOST \n");
+			break;
+		}
+	} while (num == KEYBOARD_GENL_BATCH);
+}
+
+/* One message to the group of every namespace, no subscriber is not an error */
+static int nl_send(const struct keyboard_event *events, int num){
+	size_t len = num * sizeof(struct keyboard_event);
+	struct sk_buff *skb;
+	void *hdr;
+	int err;
+
+	skb = genlmsg_new(nla_total_size(len) + nla_total_size(sizeof(u32)), GFP_KERNEL);
+	if (!skb) return -ENOMEM;
+
+	hdr = genlmsg_put(skb, 0, 0, &keyboard_family, 0, KEYBOARD_GENL_CMD_EVENTS);
+	if (!hdr) {
+		err = -EMSGSIZE;
+		goto free_skb;
+	}
+	err = nla_put(skb, KEYBOARD_GENL_ATTR_EVENTS, len, events);
+	if (err) goto free_skb;
+	err = nla_put_u32(skb, KEYBOARD_GENL_ATTR_DROPPED, READ_ONCE(nl_reader.queue.ring->dropped));
+	if (err) goto free_skb;
+	genlmsg_end(skb, hdr);
+
+	err = keyboard_genlmsg_multicast_allns(&keyboard_family, skb, 0, 0);
+	return err == -ESRCH ? 0 : err;
+
+free_skb:
+	nlmsg_free(skb);
+	return err;
+}
+
+
+/*
+ *		NETLINK GLOBAL FUNCTIONS
+ */
+int netlink_init(struct keyboard_dev *device){
+	struct keyboard_ring *ring;
+	unsigned long flags;
+	int err;
+
+	ring = kzalloc(EVENT_RING_BYTES(NETLINK_QUEUE_SIZE), GFP_KERNEL);
+	if (!ring) return -ENOMEM;
+	event_queue_init(&nl_reader.queue, ring, NETLINK_QUEUE_SIZE);
+	INIT_WORK(&nl_work, nl_work_handler);
+
+	err = genl_register_family(&keyboard_family);
+	if (err) {
+		kfree(ring);
+		return err;
+	}
+
+	dev = device; //Store pointer to device struct
+	spin_lock_irqsave(&dev->lock, flags);
+	event_hub_add(&dev->hub, &nl_reader);
+	nl_reader.notify = nl_notify;
+	nl_reader.gestures = 1;		//Subscribers pick what they need
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	printk(KERN_INFO DEVICE_NAME ": Netlink family " KEYBOARD_GENL_NAME " registered\n");
+	return 0;
+}
+
+void netlink_exit(void){
+	unsigned long flags;
+
+	if (!dev) return;
+	spin_lock_irqsave(&dev->lock, flags);
+	event_hub_remove(&dev->hub, &nl_reader);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	cancel_work_sync(&nl_work);
+	genl_unregister_family(&keyboard_family);
+	kfree(nl_reader.queue.ring);
+	dev = NULL;
+}
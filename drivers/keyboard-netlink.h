@@ -0,0 +1,19 @@
+#ifndef keyboard_netlink_h
+#define keyboard_netlink_h
+
+#include "keyboard-interrupt.h"
+
+/* Generic netlink multicast of the key events, see KEYBOARD_GENL_NAME in
+ * "keyboard-public.h". The channel is one more reader of the hub: irq
+ * context only queues the events and a work item sends them in batches, one
+ * message per burst whatever the number of subscribers.
+ */
+#ifdef CONFIG_SIMPLE_KEYBOARD_NETLINK
+int netlink_init(struct keyboard_dev *device);
+void netlink_exit(void);
+#else
+static inline int netlink_init(struct keyboard_dev *device) { return 0; }
+static inline void netlink_exit(void) {}
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/gpio.h>
+#include <linux/string.h>
+#include <linux/moduleparam.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-backend.h"
+#include "keyboard-plan.h"
+
+static int bank_irqs_used[KEYBOARD_PLAN_BANKS];
+module_param_array(bank_irqs_used, int, NULL, 0644);
+MODULE_PARM_DESC(bank_irqs_used, "Edge irqs of every gpio bank the admin reserves for other users of the board, advisory: actual owners are not checked");
+
+static unsigned int poll_interval_us = 10000;
+module_param(poll_interval_us, uint, 0644);
+MODULE_PARM_DESC(poll_interval_us, "Sampling period when no irq can be used (us)");
+
+#define PLAN_IRQ 0	//Index of the shared irq pin in the plan
+#define PLAN_VCC 1
+#define PLAN_KEYS 2	//First key, keys follow in pin_conf order
+
+static int resolve_pin(uint16_t pin, unsigned int *gpio, uint8_t *bank);
+static int check_multi_line(const unsigned int *gpios, const uint8_t *banks, const uint8_t *bank_free, uint8_t *used);
+static int check_single_line(const unsigned int *gpios, const uint8_t *banks, const uint8_t *bank_free, uint8_t *used, int irq_err);
+
+
+/*
+ *		PLANNER
+ */
+int plan_acquisition(const struct pin_conf *conf, uint32_t mode, struct keyboard_plan *plan){
+	uint16_t pins[KEYBOARD_PLAN_PINS] = { conf->irq_pin, conf->vcc_pin, conf->right_key_pin,
+		conf->start_key_pin, conf->up_key_pin, conf->down_key_pin, conf->escape_key_pin,
+		conf->left_key_pin };
+	unsigned int gpios[KEYBOARD_PLAN_PINS];
+	uint8_t multi_used[KEYBOARD_PLAN_BANKS] = { 0 }, single_used[KEYBOARD_PLAN_BANKS] = { 0 };
+	int i, j, left, irq_err, err = 0;
+
+	memset(plan, 0, sizeof(struct keyboard_plan));
+	memset(plan->bank, KEYBOARD_PLAN_NO_BANK, sizeof(plan->bank));
+	plan->mode = KEYBOARD_MODE_NONE;
+
+	for (i = 0; i < KEYBOARD_PLAN_BANKS; i++) {
+		left = backend_bank_irqs(i) - bank_irqs_used[i];
+		plan->bank_free[i] = left < 0 ? 0 : left;
+	}
+
+	/* vcc and keys are needed by every mode, the irq pin only by SINGLE_LINE */
+	irq_err = resolve_pin(pins[PLAN_IRQ], &gpios[PLAN_IRQ], &plan->bank[PLAN_IRQ]);
+	for (i = PLAN_VCC; i < KEYBOARD_PLAN_PINS; i++) {
+		if (resolve_pin(pins[i], &gpios[i], &plan->bank[i]) < 0) {
+			printk(KERN_ALERT DEVICE_NAME ": PLAN: pin %d is not a usable gpio\n", pins[i]);
+			err = -EINVAL;
+		}
+	}
+	for (i = PLAN_VCC; i < KEYBOARD_PLAN_PINS && !err; i++) {
+		for (j = i + 1; j < KEYBOARD_PLAN_PINS; j++) {
+			if (gpios[i] == gpios[j]) {
+				printk(KERN_ALERT DEVICE_NAME ": PLAN: pin %d used twice\n", pins[i]);
+				err = -EINVAL;
+			}
+		}
+	}
+	if (err) {
+		plan->multi_line = plan->single_line = err;
+		return err;
+	}
+
+	plan->multi_line = check_multi_line(gpios, plan->bank, plan->bank_free, multi_used);
+	plan->single_line = check_single_line(gpios, plan->bank, plan->bank_free, single_used, irq_err);
+
+	/* Cheapest first: an irq per key needs no sampling at all. Modes that are
+	 * not built in never fit.
+	 */
+	switch (mode) {
+		case KEYBOARD_MODE_AUTO:
+			if (!plan->multi_line) plan->mode = KEYBOARD_MODE_MULTI_LINE;
+			else if (!plan->single_line) plan->mode = KEYBOARD_MODE_SINGLE_LINE;
+			else if (KEYBOARD_HAS_TIMER_POLL) plan->mode = KEYBOARD_MODE_TIMER_POLL;
+			else err = KEYBOARD_HAS_SINGLE_LINE ? plan->single_line : plan->multi_line;
+			break;
+		case KEYBOARD_MODE_MULTI_LINE:
+			plan->mode = mode;
+			err = plan->multi_line;
+			break;
+		case KEYBOARD_MODE_SINGLE_LINE:
+			plan->mode = mode;
+			err = plan->single_line;
+			break;
+		case KEYBOARD_MODE_TIMER_POLL:
+			plan->mode = mode;
+			if (!KEYBOARD_HAS_TIMER_POLL) err = -EOPNOTSUPP;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (plan->mode == KEYBOARD_MODE_MULTI_LINE)
+		memcpy(plan->bank_used, multi_used, sizeof(plan->bank_used));
+	else if (plan->mode == KEYBOARD_MODE_SINGLE_LINE)
+		memcpy(plan->bank_used, single_used, sizeof(plan->bank_used));
+	else if (plan->mode == KEYBOARD_MODE_TIMER_POLL)
+		plan->poll_interval_us = poll_interval_us;
+	if (plan->mode != KEYBOARD_MODE_SINGLE_LINE) plan->bank[PLAN_IRQ] = KEYBOARD_PLAN_NO_BANK;
+
+	return err;
+}
+
+unsigned int plan_poll_interval_us(void){
+	return poll_interval_us;
+}
+
+
+/*
+ *		LOCAL FUNCTIONS
+ */
+static int resolve_pin(uint16_t pin, unsigned int *gpio, uint8_t *bank){
+	int b;
+
+	if (backend_translate_pin(pin, gpio) < 0) return -EINVAL;
+	b = backend_pin_bank(*gpio);
+	if (b < 0 || b >= KEYBOARD_PLAN_BANKS) return -EINVAL;
+	*bank = b;
+	return 0;
+}
+
+/* One irq per key, counted against the bank of every key */
+static int check_multi_line(const unsigned int *gpios, const uint8_t *banks, const uint8_t *bank_free, uint8_t *used){
+	int i;
+
+	if (!KEYBOARD_HAS_MULTI_LINE) return -EOPNOTSUPP;
+	for (i = PLAN_KEYS; i < KEYBOARD_PLAN_PINS; i++) {
+		if (gpio_to_irq(gpios[i]) < 0) return -ENXIO;
+		if (++used[banks[i]] > bank_free[banks[i]]) return -ENOSPC;
+	}
+	return 0;
+}
+
+/* The irq pin takes one irq of its bank and must not be any other pin */
+static int check_single_line(const unsigned int *gpios, const uint8_t *banks, const uint8_t *bank_free, uint8_t *used, int irq_err){
+	int i;
+
+	if (!KEYBOARD_HAS_SINGLE_LINE) return -EOPNOTSUPP;
+	if (irq_err) return irq_err;
+	for (i = PLAN_VCC; i < KEYBOARD_PLAN_PINS; i++)
+		if (gpios[i] == gpios[PLAN_IRQ]) return -EINVAL;
+	if (gpio_to_irq(gpios[PLAN_IRQ]) < 0) return -ENXIO;
+	if (!bank_free[banks[PLAN_IRQ]]) return -ENOSPC;
+	used[banks[PLAN_IRQ]] = 1;
+	return 0;
+}
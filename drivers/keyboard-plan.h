@@ -0,0 +1,27 @@
+#ifndef keyboard_plan_h
+#define keyboard_plan_h
+
+#include "keyboard-interrupt.h"
+
+/* Acquisition planner: checks a pin configuration against the backend before
+ * any gpio or irq is requested, maps every pin to its bank and counts the
+ * edge irqs each mode needs against what is left in every bank.
+ *
+ * The budget is advisory. What other users hold is only known through the
+ * bank_irqs_used module parameter, the planner does not look at which gpios
+ * and irqs are actually requested. A pin or irq taken by someone else still
+ * fails the setup itself, which then releases everything it had taken.
+ *
+ * mode is the KEYBOARD_MODE_* asked for, KEYBOARD_MODE_AUTO picks the
+ * cheapest one that fits. plan is always filled so it can be reported, the
+ * return value is 0 if the resulting plan.mode can be set up or -errno:
+ *   EINVAL -> a pin is not a gpio, or two functions share a pin
+ *   ENXIO  -> a pin has no irq
+ *   ENOSPC -> a bank has not enough irqs left
+ */
+int plan_acquisition(const struct pin_conf *conf, uint32_t mode, struct keyboard_plan *plan);
+
+/* Sampling period of KEYBOARD_MODE_TIMER_POLL */
+unsigned int plan_poll_interval_us(void);
+
+#endif
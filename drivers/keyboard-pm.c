@@ -0,0 +1,185 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/errno.h>
+#include <linux/device.h>
+#include <linux/pm.h>
+#include <linux/pm_runtime.h>
+#include <linux/pm_wakeup.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-pm.h"
+
+static unsigned int autosuspend_ms = 2000;
+module_param(autosuspend_ms, uint, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Delay before the keyboard is powered down once unused (ms), also in power/autosuspend_delay_ms");
+
+static unsigned int vcc_settle_us = 0;
+module_param(vcc_settle_us, uint, 0644);
+MODULE_PARM_DESC(vcc_settle_us, "Time the keyboard needs to be usable after powering it (us)");
+
+static bool wakeup = false;
+module_param(wakeup, bool, 0444);
+MODULE_PARM_DESC(wakeup, "Keys wake up the system by default, also in power/wakeup");
+
+static struct device *pm_device;
+static uint64_t resume_last_ns;		//Latency of the last resume
+static uint64_t resume_max_ns;
+static uint32_t resume_count;
+static uint8_t sleep_toggled;		//Power was switched for system sleep
+
+static int keyboard_runtime_suspend(struct device *device);
+static int keyboard_runtime_resume(struct device *device);
+static int keyboard_suspend(struct device *device);
+static int keyboard_resume(struct device *device);
+static ssize_t resume_latency_show(struct device *device, struct device_attribute *attr, char *buf);
+
+static DEVICE_ATTR(resume_latency, 0444, resume_latency_show, NULL);
+
+const struct dev_pm_ops keyboard_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(keyboard_suspend, keyboard_resume)
+	SET_RUNTIME_PM_OPS(keyboard_runtime_suspend, keyboard_runtime_resume, NULL)
+};
+
+
+/**
+ *		RUNTIME PM
+ */
+
+/* Nobody listens. A wakeup source keeps power and irqs so keys still count */
+static int keyboard_runtime_suspend(struct device *device){
+	struct keyboard_dev *data = dev_get_drvdata(device);
+
+	if (device_may_wakeup(device)) return 0;
+	power_system(data, 0);
+	keyboard_trace("KEYBOARD GATED \n");
+	return 0;
+}
+
+/* Measures from the request to the keyboard being usable, that is what the
+ * first key press after an idle period has to wait
+ */
+static int keyboard_runtime_resume(struct device *device){
+	struct keyboard_dev *data = dev_get_drvdata(device);
+	ktime_t start = ktime_get();
+	uint64_t latency;
+
+	if (!data->gated) return 0;
+	power_system(data, 1);
+	if (vcc_settle_us) usleep_range(vcc_settle_us, vcc_settle_us + vcc_settle_us / 4 + 1);
+
+	latency = ktime_to_ns(ktime_sub(ktime_get(), start));
+	resume_last_ns = latency;
+	if (latency > resume_max_ns) resume_max_ns = latency;
+	resume_count++;
+	return 0;
+}
+
+
+/**
+ *		SYSTEM SLEEP
+ */
+
+/* A wakeup source needs the keyboard powered during sleep, otherwise it is
+ * powered down even if files are still open. Resume undoes whatever was done.
+ */
+static int keyboard_suspend(struct device *device){
+	struct keyboard_dev *data = dev_get_drvdata(device);
+	int err;
+
+	if (device_may_wakeup(device)) {
+		sleep_toggled = data->gated;
+		if (sleep_toggled) power_system(data, 1);
+		err = wake_system(data, 1);
+		if (err < 0 && sleep_toggled) power_system(data, 0);
+		return err;
+	}
+
+	sleep_toggled = !data->gated;
+	if (sleep_toggled) power_system(data, 0);
+	return 0;
+}
+
+static int keyboard_resume(struct device *device){
+	struct keyboard_dev *data = dev_get_drvdata(device);
+
+	if (device_may_wakeup(device)) wake_system(data, 0);
+	if (sleep_toggled) power_system(data, data->gated);
+	sleep_toggled = 0;
+	return 0;
+}
+
+
+/**
+ *		USERS
+ */
+
+/* Every open file and configuration command holds a reference */
+int pm_get(void){
+	int err;
+
+	err = pm_runtime_get_sync(pm_device);
+	if (err < 0) {
+		pm_runtime_put_noidle(pm_device);
+		return err;
+	}
+	return 0;
+}
+
+void pm_put(void){
+	pm_runtime_mark_last_busy(pm_device);
+	pm_runtime_put_autosuspend(pm_device);
+}
+
+/* Called from the event path, may be in irq context */
+void pm_key_activity(void){
+	pm_runtime_mark_last_busy(pm_device);
+	if (device_may_wakeup(pm_device)) pm_wakeup_event(pm_device, 0);
+}
+
+/* "<last> <max> <count>", resume latencies in ns */
+static ssize_t resume_latency_show(struct device *device, struct device_attribute *attr, char *buf){
+	return sprintf(buf, "%llu %llu %u\n", (unsigned long long)resume_last_ns,
+		(unsigned long long)resume_max_ns, resume_count);
+}
+
+
+/**
+ *		SETUP
+ */
+
+/* The drvdata of device must be the keyboard_dev. It starts suspended, there
+ * is nothing to power before the first configuration.
+ */
+int pm_setup(struct device *device){
+	struct keyboard_dev *data = dev_get_drvdata(device);
+	int err;
+
+	pm_device = device;
+	data->gated = 1;
+
+	err = device_create_file(device, &dev_attr_resume_latency);
+	if (err < 0) return err;
+
+	device_set_wakeup_capable(device, true);
+	device_set_wakeup_enable(device, wakeup);
+
+	pm_runtime_set_autosuspend_delay(device, autosuspend_ms);
+	pm_runtime_use_autosuspend(device);
+	pm_runtime_set_suspended(device);
+	pm_runtime_enable(device);
+	return 0;
+}
+
+/* Leaves the device powered so it can be shut down normally */
+void pm_teardown(struct device *device){
+	pm_runtime_get_sync(device);
+	pm_runtime_disable(device);
+	pm_runtime_dont_use_autosuspend(device);
+	pm_runtime_put_noidle(device);
+	device_set_wakeup_capable(device, false);
+	device_remove_file(device, &dev_attr_resume_latency);
+}
@@ -0,0 +1,22 @@
+#ifndef keyboard_pm_h
+#define keyboard_pm_h
+
+#include <linux/device.h>
+#include <linux/pm.h>
+
+#include "keyboard-interrupt.h"
+
+/* Runtime PM of the keyboard: it is powered through vcc_pin and its irqs are
+ * armed only while some file is open (or a configuration command runs), or
+ * when it is enabled as a wakeup source in /sys/.../power/wakeup. The last
+ * user leaving starts the autosuspend delay.
+ */
+extern const struct dev_pm_ops keyboard_pm_ops;	//Set as pm of the device class
+
+int pm_setup(struct device *device);
+void pm_teardown(struct device *device);
+int pm_get(void);
+void pm_put(void);
+void pm_key_activity(void);
+
+#endif
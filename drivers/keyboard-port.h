@@ -0,0 +1,39 @@
+#ifndef keyboard_port_h
+#define keyboard_port_h
+
+/* The event core ("keyboard-events.c") is built both into the module and into
+ * a user space library (see tests/Makefile) so it can be profiled on any host.
+ * This is the only place where both worlds differ for it. The acquire/release
+ * helpers order the ring counters, which user space may share through mmap().
+ * port_cmpxchg() is a fully ordered compare and swap returning the old value,
+ * port_mb() a full barrier.
+ */
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <asm/barrier.h>
+
+#define port_load_acquire(p) smp_load_acquire(p)
+#define port_store_release(p, v) smp_store_release(p, v)
+#define port_cmpxchg(p, old, new) cmpxchg(p, old, new)
+#define port_mb() smp_mb()
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef likely
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#endif
+
+#define port_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define port_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define port_cmpxchg(p, old, new) __sync_val_compare_and_swap(p, old, new)
+#define port_mb() __sync_synchronize()
+#endif
+
+#endif
@@ -24,15 +24,314 @@ struct pin_conf {
   	uint16_t left_key_pin;
   };
 
+/* Injection structure, only used when the driver has been built with the
+ * synthetic event injection support (make INJECT=y). It is passed to the
+ * IO_KEYBOARD_INJECT command to generate fake key presses:
+ *
+ *   key   -> Key to inject (RIGHT..LEFT), 0 cycles through every key
+ *   count -> Total number of events to inject, 0 stops a running injection
+ *   burst -> Events injected back to back on every timer tick
+ *   rate  -> Events per second (the tick period is burst / rate)
+ */
+struct keyboard_inject {
+	uint32_t key;
+	uint32_t count;
+	uint32_t burst;
+	uint32_t rate;
+};
+
+/* Event record, returned by read() once the file has been switched to
+ * KEYBOARD_FORMAT_EVENTS and stored in the shared ring (see below). Reads can
+ * also be submitted through io_uring or preadv2(RWF_NOWAIT), a read that would
+ * wait fails with EAGAIN and io_uring retries it once poll() reports events.
+ *
+ *   timestamp -> Time of the edge in ns, CLOCK_MONOTONIC unless the file
+ *                selected another clock with IO_KEYBOARD_SET_CLOCK
+ *   sequence  -> Increases by one with every event generated by the driver
+ *   key       -> Key number (1 RIGHT, 2 START, 3 UP, 4 DOWN, 5 ESCAPE, 6 LEFT)
+ *   type      -> KEYBOARD_EVENT_PRESS or KEYBOARD_EVENT_RELEASE
+ *   state     -> Mask of keys down after the event, bit (key - 1) for each key
+ *   flags     -> Repeats of the same key folded into this event by the
+ *                KEYBOARD_QUEUE_COALESCE policy (up to 255), 0 otherwise
+ */
+struct keyboard_event {
+	uint64_t timestamp;
+	uint32_t sequence;
+	uint8_t key;
+	uint8_t type;
+	uint8_t state;
+	uint8_t flags;
+};
+
+#define KEYBOARD_EVENT_PRESS 1
+#define KEYBOARD_EVENT_RELEASE 2
+
+/* Gesture events, only queued for files in KEYBOARD_FORMAT_GESTURES. They
+ * follow the press or release that completed them and carry the time the
+ * gesture happened, taken from the irq timestamps:
+ *   TAP          -> released before the long press threshold and not pressed
+ *                   again within the double tap window, time of the release
+ *   DOUBLE_TAP   -> second press within the double tap window, time of that
+ *                   press (its release gives no TAP)
+ *   LONG_PRESS   -> still down after the long press threshold, time of the
+ *                   press + threshold
+ *   HOLD_RELEASE -> release after a LONG_PRESS, time of the release
+ */
+#define KEYBOARD_EVENT_TAP 3
+#define KEYBOARD_EVENT_DOUBLE_TAP 4
+#define KEYBOARD_EVENT_LONG_PRESS 5
+#define KEYBOARD_EVENT_HOLD_RELEASE 6
+
+/* Overrun marker, queued in place of events a file lost because its queue
+ * was full, before the next event it gets. key is 0 and sequence holds the
+ * number of events lost since the previous marker.
+ */
+#define KEYBOARD_EVENT_OVERRUN 7
+
+/* Clock correlation record, queued every clock_sync_ms (module parameter,
+ * 1000 by default) for files that asked for it with KEYBOARD_CLOCK_SYNC. It
+ * says CLOCK_REALTIME was exactly sequence seconds (a whole second, until
+ * 2106) when the clock of the file read timestamp. key is 0, state the keys
+ * down. Events are placed in wall time by adding their distance to the last
+ * record, without a clock_gettime() per event.
+ */
+#define KEYBOARD_EVENT_CLOCK_SYNC 8
+
+/* Timestamp clocks for IO_KEYBOARD_SET_CLOCK, KEYBOARD_CLOCK_SYNC may be or'ed
+ * to get KEYBOARD_EVENT_CLOCK_SYNC records too
+ */
+#define KEYBOARD_CLOCK_MONOTONIC 0	//Default
+#define KEYBOARD_CLOCK_MONOTONIC_RAW 1
+#define KEYBOARD_CLOCK_BOOTTIME 2
+#define KEYBOARD_CLOCK_NUM 3
+#define KEYBOARD_CLOCK_SYNC 0x100
+
+/* Read formats for IO_KEYBOARD_SET_FORMAT */
+#define KEYBOARD_FORMAT_ASCII 0		//One character '0' + key per press (default)
+#define KEYBOARD_FORMAT_EVENTS 1	//struct keyboard_event records, presses and releases
+#define KEYBOARD_FORMAT_GESTURES 2	//Same records, gesture events included
+
+/* Ring of events of an open file, it can be mapped with mmap() (offset 0,
+ * length given by IO_KEYBOARD_GET_RING_SIZE) to consume events without
+ * copying them. The driver writes events and advances head, the reader
+ * consumes events[tail & mask] and advances tail. Both counters run freely,
+ * head - tail is the number of events pending. Use acquire/release ordering
+ * on head and tail. A file must be consumed either through the ring or
+ * through read(), never both.
+ */
+struct keyboard_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t mask;		//Number of slots - 1
+	uint32_t dropped;	//Events lost because the ring was full
+	struct keyboard_event events[];
+};
+
 
 #define KEYBOARD_RESET 0
 #define KEYBOARD_CONFIG_MULTI_LINE 1
 #define KEYBOARD_CONFIG_SINGLE_LINE 2
 #define KEYBOARD_CONFIG_PINMUX 3
+#define KEYBOARD_INJECT 4
+#define KEYBOARD_SET_FORMAT 5
+#define KEYBOARD_GET_RING_SIZE 6
+#define KEYBOARD_SET_EVENTFD 7
+#define KEYBOARD_GET_STATE 8
+#define KEYBOARD_GET_CONFIG 9
+#define KEYBOARD_SET_CONFIG 10
+#define KEYBOARD_GET_PLAN 11
+#define KEYBOARD_SET_FILTER 12
+#define KEYBOARD_GET_GESTURES 13
+#define KEYBOARD_SET_GESTURES 14
+#define KEYBOARD_GET_QUEUE 15
+#define KEYBOARD_SET_QUEUE 16
+#define KEYBOARD_SET_CLOCK 17
 
 #define KEYBOARD_MAGIC (0xDA) //Magic number 0xDA is unused in this kernel currently
 
 
+/* Eventfd registration for IO_KEYBOARD_SET_EVENTFD. fd is an eventfd of the
+ * caller (-1 to drop the current one) and key_mask has bit (key - 1) set for
+ * every key of interest.
+ */
+struct keyboard_eventfd {
+	int32_t fd;
+	uint32_t key_mask;
+};
+
+/* Answer of IO_KEYBOARD_GET_STATE, also shown by the "state" attribute of
+ * the device in sysfs as "<keys in hex> <timestamp> <sequence>"
+ */
+struct keyboard_state {
+	uint64_t timestamp;	//Time of the last change of keys (CLOCK_MONOTONIC, ns)
+	uint32_t keys;		//Bit (key - 1) set for every key down
+	uint32_t sequence;	//Sequence number the next event will carry
+};
+
+/* Irqs come on rising edges only, so a handler reads its line again before
+ * returning and the lines are sampled every reconcile_ms (module parameter,
+ * 100 by default) in irq modes. A change found that way is queued as a normal
+ * press or release carrying the time it was noticed, and counted in the
+ * "recovered" attribute of the device as "<presses> <releases>". Presses
+ * there are edges the irqs missed. In MULTI_LINE mode releases have no irq,
+ * most of them are found this way. A line read low right after its press is
+ * released even inside the debounce window.
+ */
+
+/* Whole configuration of the device, read with IO_KEYBOARD_GET_CONFIG and
+ * applied in one step with IO_KEYBOARD_SET_CONFIG. version must be
+ * KEYBOARD_CONFIG_VERSION.
+ */
+#define KEYBOARD_CONFIG_VERSION 1
+
+#define KEYBOARD_MODE_NONE 0		//Not configured, no pins nor irqs in use
+#define KEYBOARD_MODE_MULTI_LINE 1	//One irq per key
+#define KEYBOARD_MODE_SINGLE_LINE 2	//Shared irq line, keys sampled on it
+#define KEYBOARD_MODE_TIMER_POLL 3	//No irq, keys sampled periodically
+#define KEYBOARD_MODE_AUTO 4		//Only for SET_CONFIG, the planner picks one
+
+struct keyboard_config {
+	uint32_t version;
+	uint32_t mode;		//KEYBOARD_MODE_*
+	uint64_t debounce_ns;	//Edges of a key closer than this are ignored
+	struct pin_conf pins;
+};
+
+/* Acquisition plan, returned by IO_KEYBOARD_GET_PLAN. Pins are indexed in
+ * struct pin_conf order (irq, vcc, right, start, up, down, escape, left).
+ * Banks are gpio controllers, each one feeds a limited number of edge irqs.
+ */
+#define KEYBOARD_PLAN_PINS 8
+#define KEYBOARD_PLAN_BANKS 8
+#define KEYBOARD_PLAN_NO_BANK 0xff	//Pin not used by the plan or invalid
+
+struct keyboard_plan {
+	uint32_t mode;				//KEYBOARD_MODE_* chosen
+	int32_t multi_line;			//0 if MULTI_LINE fits, -errno why not (EOPNOTSUPP: not built in)
+	int32_t single_line;			//0 if SINGLE_LINE fits, -errno why not (EOPNOTSUPP: not built in)
+	uint32_t poll_interval_us;		//Sampling period in TIMER_POLL mode
+	uint8_t bank[KEYBOARD_PLAN_PINS];	//Bank of every pin
+	uint8_t bank_free[KEYBOARD_PLAN_BANKS];	//Irqs left to this driver per bank, minus bank_irqs_used
+	uint8_t bank_used[KEYBOARD_PLAN_BANKS];	//Irqs taken by the chosen mode per bank
+};
+
+/* Event filter of an open file, a classic BPF program (struct sock_filter
+ * instructions, see <linux/filter.h>) given to IO_KEYBOARD_SET_FILTER.
+ * filter is the address of the instructions and len their number, len 0
+ * removes the filter.
+ *
+ * The program runs on every event before it is queued to the file and reads
+ * a struct keyboard_filter_data with 32 bit absolute loads
+ * (BPF_LD | BPF_W | BPF_ABS, k = offsetof(struct keyboard_filter_data, ...)).
+ * It returns:
+ *   KEYBOARD_FILTER_DROP                 -> the event is not queued
+ *   KEYBOARD_FILTER_REWRITE(key, type)   -> queued with a new key and type
+ *   anything else                        -> queued as it is
+ */
+struct keyboard_filter {
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t filter;
+};
+
+struct keyboard_filter_data {
+	uint32_t key;
+	uint32_t type;		//KEYBOARD_EVENT_*
+	uint32_t state;		//Keys down after the event
+	uint32_t sequence;
+	uint32_t held_us;	//Releases: time the key was down, 0 for presses
+	uint32_t idle_us;	//Time since the previous event seen by this filter
+	uint32_t history;	//Last 8 keys pressed, 4 bits each, newest in bits 0-3
+};
+
+#define KEYBOARD_FILTER_DROP 0
+#define KEYBOARD_FILTER_ACCEPT 0xffffffff
+#define KEYBOARD_FILTER_REWRITE(key, type) (0x80000000 | ((type) << 8) | (key))
+
+/* Gesture thresholds of IO_KEYBOARD_SET_GESTURES, indexed by key - 1 and in
+ * us. 0 turns the gesture off for the key: without a long press threshold
+ * every press is a tap, without a double tap window taps are reported as
+ * soon as the key is released. Gestures need the releases, so the keyboard
+ * should run in a mode that samples the lines (SINGLE_LINE or TIMER_POLL).
+ */
+#define KEYBOARD_NUM_KEYS 6
+
+struct keyboard_gestures {
+	uint32_t long_press_us[KEYBOARD_NUM_KEYS];
+	uint32_t double_tap_us[KEYBOARD_NUM_KEYS];
+};
+
+/* Event queue of an open file, set with IO_KEYBOARD_SET_QUEUE (depth and
+ * policy only) and read back with IO_KEYBOARD_GET_QUEUE. depth is a power of
+ * 2 between KEYBOARD_QUEUE_MIN_DEPTH and KEYBOARD_QUEUE_MAX_DEPTH. The policy
+ * says what a full queue does with a new event:
+ *   DROP_NEWEST -> the new event is lost (default)
+ *   DROP_OLDEST -> the oldest events are lost to make room, not allowed on a
+ *                  mapped ring
+ *   COALESCE    -> a repeat of the newest queued event (same key and type)
+ *                  is folded into it (see flags), other events are lost as in
+ *                  DROP_NEWEST
+ * Counters run from the open of the file and wrap around.
+ */
+#define KEYBOARD_QUEUE_DROP_NEWEST 0
+#define KEYBOARD_QUEUE_DROP_OLDEST 1
+#define KEYBOARD_QUEUE_COALESCE 2
+
+#define KEYBOARD_QUEUE_MIN_DEPTH 4
+#define KEYBOARD_QUEUE_MAX_DEPTH 65536
+
+struct keyboard_queue {
+	uint32_t depth;
+	uint32_t policy;	//KEYBOARD_QUEUE_*
+	uint32_t len;		//Events waiting right now
+	uint32_t dropped;	//Events lost, same as the dropped field of the ring
+	uint32_t coalesced;	//Events folded into a previous one
+	uint32_t overruns;	//KEYBOARD_EVENT_OVERRUN markers queued
+};
+
+/* Recordings of the event stream, read from record and written back to
+ * replay in the "simple-keyboard" directory of debugfs. A header is followed
+ * by struct keyboard_event records as the readers got them, gesture events
+ * included. If the recorder falls behind, KEYBOARD_EVENT_OVERRUN records
+ * tell how many events it lost. Replay feeds the presses and releases back
+ * through the driver (debounce and gestures apply again, timestamps are new)
+ * at the recorded pace scaled by replay_speed, in percent, or as fast as
+ * possible when it is 0.
+ */
+#define KEYBOARD_RECORD_MAGIC 0x43524b53	//"SKRC"
+#define KEYBOARD_RECORD_VERSION 1
+
+struct keyboard_record_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;	//sizeof(struct keyboard_event)
+	uint64_t monotonic;	//CLOCK_MONOTONIC ns when the recording started
+	uint64_t realtime;	//CLOCK_REALTIME ns at the same moment
+};
+
+/* Generic netlink channel, only in drivers built with NETLINK=y. Events of
+ * every key (gestures included) are multicast to the group
+ * KEYBOARD_GENL_MCGRP of the family KEYBOARD_GENL_NAME, in every network
+ * namespace, so any number of processes get them through one socket without
+ * opening the device. Each KEYBOARD_GENL_CMD_EVENTS message carries:
+ *   KEYBOARD_GENL_ATTR_EVENTS  -> array of struct keyboard_event, up to
+ *                                 KEYBOARD_GENL_BATCH of them, oldest first
+ *   KEYBOARD_GENL_ATTR_DROPPED -> u32, events lost so far because the channel
+ *                                 could not keep up
+ */
+#define KEYBOARD_GENL_NAME "simple_keyboard"
+#define KEYBOARD_GENL_VERSION 1
+#define KEYBOARD_GENL_MCGRP "events"
+#define KEYBOARD_GENL_BATCH 32
+
+#define KEYBOARD_GENL_CMD_UNSPEC 0
+#define KEYBOARD_GENL_CMD_EVENTS 1
+
+#define KEYBOARD_GENL_ATTR_UNSPEC 0
+#define KEYBOARD_GENL_ATTR_EVENTS 1
+#define KEYBOARD_GENL_ATTR_DROPPED 2
+#define KEYBOARD_GENL_ATTR_MAX 2
+
 /* Define commnands to configure the input data mode
  *
  * IO_KEYBOARD_RESET:
@@ -44,7 +343,11 @@ struct pin_conf {
  *    Since the BeagleBone splits its GPIO pins into four different banks (x from GPIOx_Y)
  *    the user must count on that each bank can handle up to two interrupts asociated
  *    with it. Therefore within this mode only 2 interrupts last for the whole
- *    system.  USE THIS MODE WITH CAUTION
+ *    system.  USE THIS MODE WITH CAUTION. The pins and the irq budget of
+ *    every bank are checked before anything is taken, a configuration that
+ *    does not fit fails with ENOSPC (see KEYBOARD_GET_PLAN). The budget is
+ *    advisory: irqs of other users only count if the admin lists them in the
+ *    bank_irqs_used module parameter.
  *
  * KEYBOARD_CONFIG_SINGLE_LINE:
  *    Uses only one GPIO pin for interrupting the system when a key is pressed.
@@ -61,10 +364,114 @@ struct pin_conf {
  *    the correct pin configuration, this is:
  *       1 -> not overloading gpio banks with interrupts (2 per bank at most)
  *       2 -> Assign usable gpio pins for this device
+ *
+ * KEYBOARD_INJECT:
+ *    Injects synthetic key events into the same path used by the irq handlers,
+ *    so readers are woken up exactly as if a key was pressed. It needs
+ *    CAP_SYS_ADMIN and is only available when the module is built with INJECT=y,
+ *    otherwise the command is unknown. Readers do not need the device to be
+ *    configured in that build so it can be used without the keyboard attached.
+ *
+ * KEYBOARD_SET_FORMAT:
+ *    Selects what read() returns for this open file, KEYBOARD_FORMAT_ASCII,
+ *    KEYBOARD_FORMAT_EVENTS or KEYBOARD_FORMAT_GESTURES. The argument is the
+ *    format itself (not a pointer). The format also decides whether gesture
+ *    events reach the mapped ring.
+ *
+ * KEYBOARD_GET_RING_SIZE:
+ *    Returns the length to pass to mmap() to map the ring of this open file.
+ *
+ * KEYBOARD_SET_EVENTFD:
+ *    Registers an eventfd for this open file. The driver adds 1 to its counter
+ *    every time a burst of events of a key in key_mask is queued for the file,
+ *    or a KEYBOARD_EVENT_CLOCK_SYNC record the file asked for, so it can be
+ *    driven from an event loop instead of a blocked read().
+ *    Events are still taken with read() or from the mapped ring.
+ *
+ * KEYBOARD_GET_STATE:
+ *    Returns the keys down right now and when they last changed, without
+ *    blocking. When the device is configured the key lines are sampled and
+ *    any change is queued as events first, like an interrupt would do. While
+ *    another process runs a configuration command the lines are not sampled
+ *    and the state known from the events is returned instead. Like the other
+ *    commands that only concern the calling file (SET_FORMAT, SET_CLOCK,
+ *    GET/SET_QUEUE, GET_RING_SIZE, SET_EVENTFD, SET_FILTER) it never waits
+ *    for configuration commands.
+ *
+ * KEYBOARD_GET_CONFIG:
+ *    Returns the active configuration (mode, pins and debounce) as a
+ *    struct keyboard_config, to be saved and handed back to SET_CONFIG.
+ *
+ * KEYBOARD_SET_CONFIG:
+ *    Applies a struct keyboard_config in one call, replacing the
+ *    RESET -> PINMUX -> CONFIG sequence. Configuration commands of all
+ *    processes are serialized so no other one can interleave. If the device
+ *    already runs with the same mode and pins nothing is touched, only the
+ *    debounce is updated. If the new configuration cannot be set up the old
+ *    one is restored and the error returned. Changing the mode or pins of a
+ *    configured device fails with EBUSY while readers are blocked on it.
+ *    With KEYBOARD_MODE_AUTO the planner picks the cheapest mode the pins
+ *    allow: one irq per key, then the shared irq line, then timer polling.
+ *    A mode left out of the module at build time fails with EOPNOTSUPP and
+ *    is never picked by the planner.
+ *
+ * KEYBOARD_GET_PLAN:
+ *    Returns the acquisition plan of the active configuration, or the one
+ *    KEYBOARD_MODE_AUTO would choose for the current pins if the device is
+ *    not configured. It tells which modes fit and how the irqs of every
+ *    bank are used, so misconfigured boards can be found without trying.
+ *
+ * KEYBOARD_SET_FILTER:
+ *    Attaches a filter program (struct keyboard_filter) to this open file,
+ *    replacing the previous one. Dropped events never reach the queue, so
+ *    they do not wake up read(), poll() or the eventfd of the file. Needs a
+ *    kernel with classic BPF support, otherwise it fails with EOPNOTSUPP.
+ *
+ * KEYBOARD_GET_GESTURES:
+ *    Returns the gesture thresholds of every key (struct keyboard_gestures).
+ *
+ * KEYBOARD_SET_GESTURES:
+ *    Sets the gesture thresholds of every key for the whole device. Gestures
+ *    are recognized in the driver, with the timers it needs, so readers get
+ *    them without waking up after every key event. A gesture in progress is
+ *    only dropped for keys whose thresholds change.
+ *
+ * KEYBOARD_GET_QUEUE:
+ *    Returns the queue depth, overflow policy and loss counters of this open
+ *    file (struct keyboard_queue).
+ *
+ * KEYBOARD_SET_QUEUE:
+ *    Resizes the queue of this open file and sets its overflow policy, events
+ *    waiting are kept. Fails with EBUSY once the ring has been mapped, except
+ *    to change the policy alone. The default for new files comes from the
+ *    queue_depth and queue_policy module parameters.
+ *
+ * KEYBOARD_SET_CLOCK:
+ *    Selects the clock of the event timestamps of this open file, one of
+ *    KEYBOARD_CLOCK_MONOTONIC, _MONOTONIC_RAW or _BOOTTIME, optionally or'ed
+ *    with KEYBOARD_CLOCK_SYNC. The argument is the value itself (not a
+ *    pointer). Edges are still timed once in the irq, the time is moved to
+ *    the clock of every file as it is queued. Events already queued keep
+ *    their clock. IO_KEYBOARD_GET_STATE and the sysfs state stay in
+ *    CLOCK_MONOTONIC.
  */
 #define IO_KEYBOARD_RESET _IO(KEYBOARD_MAGIC, KEYBOARD_RESET)	//Reset the configuration
 #define IO_KEYBOARD_CONFIG_MULTI_LINE _IO(KEYBOARD_MAGIC, KEYBOARD_CONFIG_MULTI_LINE)
 #define IO_KEYBOARD_CONFIG_SINGLE_LINE _IO(KEYBOARD_MAGIC, KEYBOARD_CONFIG_SINGLE_LINE)
 #define IO_KEYBOARD_CONFIG_PINMUX _IOW(KEYBOARD_MAGIC, KEYBOARD_CONFIG_PINMUX, struct pin_conf)
+#define IO_KEYBOARD_INJECT _IOW(KEYBOARD_MAGIC, KEYBOARD_INJECT, struct keyboard_inject)
+#define IO_KEYBOARD_SET_FORMAT _IO(KEYBOARD_MAGIC, KEYBOARD_SET_FORMAT)
+#define IO_KEYBOARD_GET_RING_SIZE _IOR(KEYBOARD_MAGIC, KEYBOARD_GET_RING_SIZE, uint32_t)
+#define IO_KEYBOARD_SET_EVENTFD _IOW(KEYBOARD_MAGIC, KEYBOARD_SET_EVENTFD, struct keyboard_eventfd)
+#define IO_KEYBOARD_GET_STATE _IOR(KEYBOARD_MAGIC, KEYBOARD_GET_STATE, struct keyboard_state)
+#define IO_KEYBOARD_GET_CONFIG _IOR(KEYBOARD_MAGIC, KEYBOARD_GET_CONFIG, struct keyboard_config)
+#define IO_KEYBOARD_SET_CONFIG _IOW(KEYBOARD_MAGIC, KEYBOARD_SET_CONFIG, struct keyboard_config)
+#define IO_KEYBOARD_GET_PLAN _IOR(KEYBOARD_MAGIC, KEYBOARD_GET_PLAN, struct keyboard_plan)
+#define IO_KEYBOARD_SET_FILTER _IOW(KEYBOARD_MAGIC, KEYBOARD_SET_FILTER, struct keyboard_filter)
+#define IO_KEYBOARD_GET_GESTURES _IOR(KEYBOARD_MAGIC, KEYBOARD_GET_GESTURES, struct keyboard_gestures)
+#define IO_KEYBOARD_SET_GESTURES _IOW(KEYBOARD_MAGIC, KEYBOARD_SET_GESTURES, struct keyboard_gestures)
+#define IO_KEYBOARD_GET_QUEUE _IOR(KEYBOARD_MAGIC, KEYBOARD_GET_QUEUE, struct keyboard_queue)
+#define IO_KEYBOARD_SET_QUEUE _IOW(KEYBOARD_MAGIC, KEYBOARD_SET_QUEUE, struct keyboard_queue)
+#define IO_KEYBOARD_SET_CLOCK _IO(KEYBOARD_MAGIC, KEYBOARD_SET_CLOCK)
 
 #endif
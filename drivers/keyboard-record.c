@@ -0,0 +1,341 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/signal.h>
+#endif
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+
+#include "keyboard-driver.h"
+#include "keyboard-interrupt.h"
+#include "keyboard-record.h"
+#include "keyboard-pm.h"
+
+#define RECORD_QUEUE_SIZE 4096		//Events buffered for a slow recorder, 64KB
+#define REPLAY_CHUNK 16			//Records copied from user space at once
+#define REPLAY_SLACK_NS 20000		//Allowed lateness of a replayed event
+
+static struct keyboard_dev *dev;
+static struct dentry *record_dir;
+static u32 replay_speed = 100;		//Percent of the recorded pace, 0 no waits
+static atomic_t replaying = ATOMIC_INIT(0);	//Only one replay at a time
+
+/* An open record file */
+struct recorder {
+	struct event_reader node;	//Linked into the hub of the device
+	wait_queue_head_t wait;
+	struct mutex read_lock;
+	uint8_t header_sent;
+	struct keyboard_record_header header;
+};
+
+/* An open replay file, records may be split across writes */
+struct replayer {
+	struct keyboard_record_header header;
+	size_t header_got;
+	struct keyboard_event partial;
+	size_t partial_got;
+	uint8_t started;
+	uint8_t aborted;		//A signal stopped the replay
+	uint32_t speed;			//replay_speed when the first record came
+	uint64_t first;			//Timestamp of the first record
+	ktime_t start;			//When it was replayed
+};
+
+static int record_open(struct inode *inode, struct file *filp);
+static ssize_t record_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos);
+static int record_release(struct inode *inode, struct file *filp);
+static void record_notify(struct event_reader *node, uint8_t keys);
+static int replay_open(struct inode *inode, struct file *filp);
+static ssize_t replay_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos);
+static int replay_release(struct inode *inode, struct file *filp);
+static int replay_event(struct replayer *rp, const struct keyboard_event *event);
+
+static const struct file_operations record_fops = {
+	.owner = THIS_MODULE,
+	.open = record_open,
+	.read = record_read,
+	.release = record_release,
+};
+
+static const struct file_operations replay_fops = {
+	.owner = THIS_MODULE,
+	.open = replay_open,
+	.write = replay_write,
+	.release = replay_release,
+};
+
+
+/**
+ *		RECORD
+ */
+
+/* Called by the hub with the device lock held, possibly in irq context */
+static void record_notify(struct event_reader *node, uint8_t keys){
+	struct recorder *rec = container_of(node, struct recorder, node);
+
+	wake_up_interruptible(&rec->wait);
+}
+
+/* The recorder counts as a user, the keyboard stays powered while it runs */
+static int record_open(struct inode *inode, struct file *filp){
+	struct keyboard_ring *ring;
+	struct recorder *rec;
+	unsigned long flags;
+	int err;
+
+	rec = kzalloc(sizeof(struct recorder), GFP_KERNEL);
+	if (!rec) return -ENOMEM;
+	ring = vmalloc(EVENT_RING_BYTES(RECORD_QUEUE_SIZE));
+	if (!ring) {
+		err = -ENOMEM;
+		goto free_rec;
+	}
+	err = pm_get();
+	if (err < 0) goto free_ring;
+
+	init_waitqueue_head(&rec->wait);
+	mutex_init(&rec->read_lock);
+	event_queue_init(&rec->node.queue, ring, RECORD_QUEUE_SIZE);
+	rec->header.magic = KEYBOARD_RECORD_MAGIC;
+	rec->header.version = KEYBOARD_RECORD_VERSION;
+	rec->header.record_size = sizeof(struct keyboard_event);
+	rec->header.monotonic = ktime_get_ns();
+	rec->header.realtime = ktime_get_real_ns();
+
+	spin_lock_irqsave(&dev->lock, flags);
+	event_hub_add(&dev->hub, &rec->node);
+	rec->node.notify = record_notify;
+	rec->node.gestures = 1;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	filp->private_data = rec;
+	return nonseekable_open(inode, filp);
+
+free_ring:
+	vfree(ring);
+free_rec:
+	kfree(rec);
+	return err;
+}
+
+/* The first read returns the header alone, then whole records. Losses of the
+ * queue are already in place as overrun markers.
+ */
+static ssize_t record_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos){
+	struct recorder *rec = filp->private_data;
+	struct keyboard_event event;
+	size_t num = 0, max = count / sizeof(struct keyboard_event);
+	uint32_t pos;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&rec->read_lock)) return -ERESTARTSYS;
+
+	if (!rec->header_sent) {
+		if (count < sizeof(struct keyboard_record_header)) {
+			ret = -EINVAL;
+		} else if (copy_to_user(buf, &rec->header, sizeof(struct keyboard_record_header))) {
+			ret = -EFAULT;
+		} else {
+			rec->header_sent = 1;
+			ret = sizeof(struct keyboard_record_header);
+		}
+		goto unlock;
+	}
+	if (!max) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	while (num == 0) {
+		/* An event leaves the queue only once copied, a fault keeps it and
+		 * returns what was already copied */
+		while (num < max && event_queue_peek(&rec->node.queue, &event, &pos) == 0) {
+			if (copy_to_user(buf + num * sizeof(event), &event, sizeof(event))) {
+				if (num) break;
+				ret = -EFAULT;
+				goto unlock;
+			}
+			event_queue_advance(&rec->node.queue, pos);
+			num++;
+		}
+		if (num) break;
+
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+		if (wait_event_interruptible(rec->wait, !event_queue_empty(&rec->node.queue))) {
+			ret = -ERESTARTSYS;
+			goto unlock;
+		}
+	}
+	ret = num * sizeof(struct keyboard_event);
+
+unlock:
+	mutex_unlock(&rec->read_lock);
+	return ret;
+}
+
+static int record_release(struct inode *inode, struct file *filp){
+	struct recorder *rec = filp->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	event_hub_remove(&dev->hub, &rec->node);
+	spin_unlock_irqrestore(&dev->lock, flags);
+	vfree(rec->node.queue.ring);
+	kfree(rec);
+	pm_put();
+	return 0;
+}
+
+
+/**
+ *		REPLAY
+ */
+
+static int replay_open(struct inode *inode, struct file *filp){
+	struct replayer *rp;
+
+	if (atomic_cmpxchg(&replaying, 0, 1) != 0) return -EBUSY;
+	rp = kzalloc(sizeof(struct replayer), GFP_KERNEL);
+	if (!rp) {
+		atomic_set(&replaying, 0);
+		return -ENOMEM;
+	}
+	filp->private_data = rp;
+	return nonseekable_open(inode, filp);
+}
+
+/* Feeds one record once its time has come. Overrun and gesture records are
+ * skipped, the driver makes its own gestures out of the replayed keys.
+ */
+static int replay_event(struct replayer *rp, const struct keyboard_event *event){
+	ktime_t due;
+
+	if (event->type != KEYBOARD_EVENT_PRESS && event->type != KEYBOARD_EVENT_RELEASE) return 0;
+
+	if (!rp->started) {
+		rp->started = 1;
+		rp->speed = READ_ONCE(replay_speed);
+		rp->first = event->timestamp;
+		rp->start = ktime_get();
+	}
+
+	if (rp->speed && event->timestamp > rp->first) {
+		due = ktime_add_ns(rp->start, div_u64((event->timestamp - rp->first) * 100, rp->speed));
+		while (ktime_before(ktime_get(), due)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout_range(&due, REPLAY_SLACK_NS, HRTIMER_MODE_ABS);
+			if (signal_pending(current)) return -EINTR;
+		}
+	} else {
+		cond_resched();
+	}
+
+	report_state(dev, event->state);
+	return 0;
+}
+
+/* Takes the header, then replays every whole record. A bad header or a
+ * signal ends the replay, later writes on the file fail.
+ */
+static ssize_t replay_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos){
+	struct replayer *rp = filp->private_data;
+	struct keyboard_event events[REPLAY_CHUNK];
+	size_t done = 0, len, num, i;
+	int err;
+
+	if (rp->aborted) return -EINTR;
+
+	if (rp->header_got < sizeof(struct keyboard_record_header)) {
+		len = min(count, sizeof(struct keyboard_record_header) - rp->header_got);
+		if (copy_from_user((char *)&rp->header + rp->header_got, buf, len)) return -EFAULT;
+		rp->header_got += len;
+		done += len;
+		if (rp->header_got < sizeof(struct keyboard_record_header)) return done;
+
+		if (rp->header.magic != KEYBOARD_RECORD_MAGIC || rp->header.version != KEYBOARD_RECORD_VERSION ||
+			rp->header.record_size != sizeof(struct keyboard_event)) {
+			rp->aborted = 1;
+			return -EINVAL;
+		}
+	}
+
+	/* A record split by the previous write goes first */
+	if (rp->partial_got && done < count) {
+		len = min(count - done, sizeof(struct keyboard_event) - rp->partial_got);
+		if (copy_from_user((char *)&rp->partial + rp->partial_got, buf + done, len)) return -EFAULT;
+		rp->partial_got += len;
+		done += len;
+		if (rp->partial_got < sizeof(struct keyboard_event)) return done;
+		rp->partial_got = 0;
+		err = replay_event(rp, &rp->partial);
+		if (err) goto abort;
+	}
+
+	while (count - done >= sizeof(struct keyboard_event)) {
+		num = min_t(size_t, (count - done) / sizeof(struct keyboard_event), REPLAY_CHUNK);
+		if (copy_from_user(events, buf + done, num * sizeof(struct keyboard_event))) return -EFAULT;
+		for (i = 0; i < num; i++) {
+			err = replay_event(rp, &events[i]);
+			if (err) goto abort;
+			done += sizeof(struct keyboard_event);
+		}
+	}
+
+	if (done < count) {
+		len = count - done;
+		if (copy_from_user(&rp->partial, buf + done, len)) return -EFAULT;
+		rp->partial_got = len;
+		done += len;
+	}
+	return done;
+
+abort:
+	rp->aborted = 1;
+	return done ? done : err;
+}
+
+static int replay_release(struct inode *inode, struct file *filp){
+	kfree(filp->private_data);
+	atomic_set(&replaying, 0);
+	return 0;
+}
+
+
+/*
+ *		RECORD GLOBAL FUNCTIONS
+ */
+
+/* debugfs may be missing, the driver works the same without it */
+void record_init(struct keyboard_dev *device){
+	dev = device; //Store pointer to device struct
+	record_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+	if (IS_ERR_OR_NULL(record_dir)) {
+		record_dir = NULL;
+		return;
+	}
+	debugfs_create_file("record", 0400, record_dir, NULL, &record_fops);
+	debugfs_create_file("replay", 0200, record_dir, NULL, &replay_fops);
+	debugfs_create_u32("replay_speed", 0600, record_dir, &replay_speed);
+}
+
+/* Open files hold a reference to the module, none is left at this point */
+void record_exit(void){
+	debugfs_remove_recursive(record_dir);
+	record_dir = NULL;
+}
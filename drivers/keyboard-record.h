@@ -0,0 +1,24 @@
+#ifndef keyboard_record_h
+#define keyboard_record_h
+
+#include "keyboard-interrupt.h"
+
+/* Record and replay of the event stream through debugfs, see
+ * KEYBOARD_RECORD_MAGIC in "keyboard-public.h":
+ *
+ *   cat /sys/kernel/debug/simple-keyboard/record > burst.skr
+ *   echo 0 > /sys/kernel/debug/simple-keyboard/replay_speed
+ *   cat burst.skr > /sys/kernel/debug/simple-keyboard/replay
+ *
+ * Every open of record is a reader of its own. A write to replay returns once
+ * its records have been fed at the recorded pace.
+ */
+#ifdef CONFIG_SIMPLE_KEYBOARD_RECORD
+void record_init(struct keyboard_dev *device);
+void record_exit(void);
+#else
+static inline void record_init(struct keyboard_dev *device) {}
+static inline void record_exit(void) {}
+#endif
+
+#endif
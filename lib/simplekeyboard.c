@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "simplekeyboard.h"
+
+#define ASCII_BUF 64	//Bytes read at once in the ascii path, 1 per press
+
+struct sk_device {
+	int fd;
+	int path;			//SK_PATH_*
+	struct keyboard_ring *ring;	//Mapped ring, SK_PATH_RING only
+	size_t ring_bytes;
+	uint32_t sequence;		//Sequence given to ascii path events
+};
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Waits until the device is readable, returns 1 if so, 0 on timeout */
+static int wait_events(struct sk_device *dev, int timeout_ms){
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) return -errno;
+	return ret > 0;
+}
+
+/* Tries to map the ring of this file, keeps the read() path otherwise */
+static void map_ring(struct sk_device *dev){
+	uint32_t size;
+	void *ring;
+
+	if (ioctl(dev->fd, IO_KEYBOARD_GET_RING_SIZE, &size) < 0) return;
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+	if (ring == MAP_FAILED) return;
+	dev->ring = ring;
+	dev->ring_bytes = size;
+	dev->path = SK_PATH_RING;
+}
+
+int sk_open(const char *path, int flags, struct sk_device **dev){
+	struct sk_device *d;
+	int err;
+
+	d = calloc(1, sizeof(*d));
+	if (!d) return -ENOMEM;
+
+	d->fd = open(path ? path : SK_DEFAULT_PATH, flags | O_NONBLOCK);
+	if (d->fd < 0) {
+		err = -errno;
+		free(d);
+		return err;
+	}
+
+	/* Drivers older than the event records only speak ascii */
+	if (ioctl(d->fd, IO_KEYBOARD_SET_FORMAT, KEYBOARD_FORMAT_EVENTS) < 0) {
+		d->path = SK_PATH_ASCII;
+	} else {
+		d->path = SK_PATH_EVENTS;
+		map_ring(d);
+	}
+
+	*dev = d;
+	return 0;
+}
+
+void sk_close(struct sk_device *dev){
+	if (!dev) return;
+	if (dev->ring) munmap(dev->ring, dev->ring_bytes);
+	close(dev->fd);
+	free(dev);
+}
+
+int sk_get_config(struct sk_device *dev, struct keyboard_config *conf){
+	if (ioctl(dev->fd, IO_KEYBOARD_GET_CONFIG, conf) < 0) return -errno;
+	return 0;
+}
+
+int sk_set_config(struct sk_device *dev, const struct keyboard_config *conf){
+	if (ioctl(dev->fd, IO_KEYBOARD_SET_CONFIG, conf) < 0) return -errno;
+	return 0;
+}
+
+int sk_get_plan(struct sk_device *dev, struct keyboard_plan *plan){
+	if (ioctl(dev->fd, IO_KEYBOARD_GET_PLAN, plan) < 0) return -errno;
+	return 0;
+}
+
+int sk_configure(struct sk_device *dev, int mode, const struct pin_conf *pins){
+	static const uint32_t modes[] = { KEYBOARD_MODE_MULTI_LINE, KEYBOARD_MODE_SINGLE_LINE,
+		KEYBOARD_MODE_TIMER_POLL, KEYBOARD_MODE_AUTO };
+	struct keyboard_config conf;
+	unsigned long cmd;
+
+	if (mode < SK_MODE_MULTI_LINE || mode > SK_MODE_AUTO) return -EINVAL;
+
+	if (sk_get_config(dev, &conf) == 0) {
+		conf.mode = modes[mode];
+		if (pins) conf.pins = *pins;
+		return sk_set_config(dev, &conf);
+	}
+
+	if (mode == SK_MODE_MULTI_LINE) cmd = IO_KEYBOARD_CONFIG_MULTI_LINE;
+	else if (mode == SK_MODE_SINGLE_LINE) cmd = IO_KEYBOARD_CONFIG_SINGLE_LINE;
+	else return -EOPNOTSUPP;
+
+	/* Reset fails when the device was not configured yet, that is fine */
+	ioctl(dev->fd, IO_KEYBOARD_RESET);
+	if (pins && ioctl(dev->fd, IO_KEYBOARD_CONFIG_PINMUX, pins) < 0) return -errno;
+	if (ioctl(dev->fd, cmd) < 0) return -errno;
+	return 0;
+}
+
+int sk_fd(const struct sk_device *dev){
+	return dev->fd;
+}
+
+int sk_set_eventfd(struct sk_device *dev, int efd, uint32_t key_mask){
+	struct keyboard_eventfd conf = { .fd = efd, .key_mask = key_mask };
+
+	if (ioctl(dev->fd, IO_KEYBOARD_SET_EVENTFD, &conf) < 0) return -errno;
+	return 0;
+}
+
+int sk_set_filter(struct sk_device *dev, const void *insns, unsigned int len){
+	struct keyboard_filter conf = { .len = len, .filter = (uint64_t)(uintptr_t)insns };
+
+	if (ioctl(dev->fd, IO_KEYBOARD_SET_FILTER, &conf) < 0) return -errno;
+	return 0;
+}
+
+int sk_get_gestures(struct sk_device *dev, struct keyboard_gestures *conf){
+	if (ioctl(dev->fd, IO_KEYBOARD_GET_GESTURES, conf) < 0) return -errno;
+	return 0;
+}
+
+int sk_set_gestures(struct sk_device *dev, const struct keyboard_gestures *conf){
+	if (ioctl(dev->fd, IO_KEYBOARD_SET_GESTURES, conf) < 0) return -errno;
+	return 0;
+}
+
+/* The ascii path has no records to carry them */
+int sk_receive_gestures(struct sk_device *dev, int on){
+	if (dev->path == SK_PATH_ASCII) return -EOPNOTSUPP;
+	if (ioctl(dev->fd, IO_KEYBOARD_SET_FORMAT, on ? KEYBOARD_FORMAT_GESTURES : KEYBOARD_FORMAT_EVENTS) < 0) return -errno;
+	return 0;
+}
+
+int sk_get_queue(struct sk_device *dev, struct keyboard_queue *queue){
+	if (ioctl(dev->fd, IO_KEYBOARD_GET_QUEUE, queue) < 0) return -errno;
+	return 0;
+}
+
+int sk_set_queue(struct sk_device *dev, uint32_t depth, uint32_t policy){
+	struct keyboard_queue queue = { .depth = depth, .policy = policy };
+
+	if (ioctl(dev->fd, IO_KEYBOARD_SET_QUEUE, &queue) < 0) return -errno;
+	return 0;
+}
+
+int sk_set_clock(struct sk_device *dev, uint32_t clock, int sync){
+	if (ioctl(dev->fd, IO_KEYBOARD_SET_CLOCK, clock | (sync ? KEYBOARD_CLOCK_SYNC : 0)) < 0) return -errno;
+	return 0;
+}
+
+int sk_get_state(struct sk_device *dev, struct keyboard_state *state){
+	if (ioctl(dev->fd, IO_KEYBOARD_GET_STATE, state) < 0) return -errno;
+	return 0;
+}
+
+int sk_path(const struct sk_device *dev){
+	return dev->path;
+}
+
+int sk_ring_peek(struct sk_device *dev, const struct keyboard_event **events){
+	struct keyboard_ring *ring = dev->ring;
+	uint32_t head, tail, num;
+
+	if (!ring) return -EINVAL;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);	//Events up to head are written
+	tail = ring->tail;
+	num = head - tail;
+	if (num > ring->mask + 1 - (tail & ring->mask))	//Stop at the end of the ring
+		num = ring->mask + 1 - (tail & ring->mask);
+	*events = &ring->events[tail & ring->mask];
+	return num;
+}
+
+void sk_ring_consume(struct sk_device *dev, int num){
+	struct keyboard_ring *ring = dev->ring;
+
+	if (!ring || num <= 0) return;
+	__atomic_store_n(&ring->tail, ring->tail + num, __ATOMIC_RELEASE);	//Slots are free again
+}
+
+static int read_ring(struct sk_device *dev, struct keyboard_event *events, int max){
+	const struct keyboard_event *first;
+	int num, total = 0;
+
+	/* Two rounds at most, the pending events may wrap around the ring */
+	while (total < max && (num = sk_ring_peek(dev, &first)) > 0) {
+		if (num > max - total) num = max - total;
+		memcpy(&events[total], first, num * sizeof(*first));
+		sk_ring_consume(dev, num);
+		total += num;
+	}
+	return total;
+}
+
+static int read_records(struct sk_device *dev, struct keyboard_event *events, int max){
+	ssize_t ret;
+
+	ret = read(dev->fd, events, max * sizeof(*events));
+	if (ret < 0) return errno == EAGAIN ? 0 : -errno;
+	return ret / sizeof(*events);
+}
+
+static int read_ascii(struct sk_device *dev, struct keyboard_event *events, int max){
+	char buf[ASCII_BUF];
+	uint64_t now;
+	ssize_t ret;
+	int i, num = 0;
+
+	if (max > ASCII_BUF) max = ASCII_BUF;
+	ret = read(dev->fd, buf, max);
+	if (ret < 0) return errno == EAGAIN ? 0 : -errno;
+
+	now = now_ns();
+	for (i = 0; i < ret; i++) {	//Every press is the character '0' + key
+		memset(&events[num], 0, sizeof(*events));
+		events[num].timestamp = now;
+		events[num].sequence = dev->sequence++;
+		events[num].key = buf[i] - '0';
+		events[num].type = KEYBOARD_EVENT_PRESS;
+		num++;
+	}
+	return num;
+}
+
+int sk_read_events(struct sk_device *dev, struct keyboard_event *events, int max, int timeout_ms){
+	int ret;
+
+	if (max <= 0) return -EINVAL;
+
+	for (;;) {
+		switch (dev->path) {
+			case SK_PATH_RING: ret = read_ring(dev, events, max); break;
+			case SK_PATH_EVENTS: ret = read_records(dev, events, max); break;
+			default: ret = read_ascii(dev, events, max); break;
+		}
+		if (ret != 0 || timeout_ms == 0) return ret;
+
+		ret = wait_events(dev, timeout_ms);
+		if (ret <= 0) return ret;
+		if (timeout_ms > 0) timeout_ms = 0;	//Woken up, take what is there and return
+	}
+}
+
+uint32_t sk_dropped(const struct sk_device *dev){
+	if (!dev->ring) return 0;
+	return __atomic_load_n(&dev->ring->dropped, __ATOMIC_RELAXED);
+}
+
+
+/*
+ *		NETLINK
+ */
+
+#define NL_BUF 8192	//Well above a message of KEYBOARD_GENL_BATCH events
+#define NL_ATTR_OK(nla, len) ((len) >= (int)sizeof(struct nlattr) && \
+	(nla)->nla_len >= sizeof(struct nlattr) && (nla)->nla_len <= (len))
+#define NL_ATTR_NEXT(nla, len) ((len) -= NLA_ALIGN((nla)->nla_len), \
+	(struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+#define NL_ATTR_DATA(nla) ((void *)((char *)(nla) + NLA_HDRLEN))
+#define NL_ATTR_LEN(nla) ((int)(nla)->nla_len - NLA_HDRLEN)
+
+struct sk_netlink {
+	int fd;
+	uint32_t dropped;
+	const struct keyboard_event *pending;	//Events of the last message not returned yet
+	int num_pending;
+	char buf[NL_BUF];
+};
+
+/* Group id of KEYBOARD_GENL_MCGRP in the CTRL_ATTR_MCAST_GROUPS nest */
+static int nl_find_group(struct nlattr *groups){
+	struct nlattr *grp, *attr;
+	int glen = NL_ATTR_LEN(groups), alen, id;
+	const char *name;
+
+	for (grp = NL_ATTR_DATA(groups); NL_ATTR_OK(grp, glen); grp = NL_ATTR_NEXT(grp, glen)) {
+		id = -1;
+		name = NULL;
+		alen = NL_ATTR_LEN(grp);
+		for (attr = NL_ATTR_DATA(grp); NL_ATTR_OK(attr, alen); attr = NL_ATTR_NEXT(attr, alen)) {
+			if (attr->nla_type == CTRL_ATTR_MCAST_GRP_ID) id = *(uint32_t *)NL_ATTR_DATA(attr);
+			else if (attr->nla_type == CTRL_ATTR_MCAST_GRP_NAME) name = NL_ATTR_DATA(attr);
+		}
+		if (id >= 0 && name && strcmp(name, KEYBOARD_GENL_MCGRP) == 0) return id;
+	}
+	return -ENOENT;
+}
+
+/* Asks the controller for the family and returns the id of the events group */
+static int nl_resolve_group(struct sk_netlink *nl){
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+		char attrs[NLA_HDRLEN + NLA_ALIGN(sizeof(KEYBOARD_GENL_NAME))];
+	} req;
+	struct nlattr *attr = (struct nlattr *)req.attrs;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)nl->buf;
+	int len;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = GENL_ID_CTRL;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.genl.cmd = CTRL_CMD_GETFAMILY;
+	req.genl.version = 1;
+	attr->nla_type = CTRL_ATTR_FAMILY_NAME;
+	attr->nla_len = NLA_HDRLEN + sizeof(KEYBOARD_GENL_NAME);
+	memcpy(NL_ATTR_DATA(attr), KEYBOARD_GENL_NAME, sizeof(KEYBOARD_GENL_NAME));
+	if (send(nl->fd, &req, sizeof(req), 0) < 0) return -errno;
+
+	len = recv(nl->fd, nl->buf, NL_BUF, 0);
+	if (len < 0) return -errno;
+	if (!NLMSG_OK(nlh, len)) return -EPROTO;
+	if (nlh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *err = NLMSG_DATA(nlh);
+		return err->error ? err->error : -EPROTO;	//ENOENT without NETLINK=y
+	}
+
+	len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	for (attr = (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN); NL_ATTR_OK(attr, len); attr = NL_ATTR_NEXT(attr, len)) {
+		if (attr->nla_type == CTRL_ATTR_MCAST_GROUPS) return nl_find_group(attr);
+	}
+	return -ENOENT;
+}
+
+int sk_nl_open(struct sk_netlink **nl){
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	struct sk_netlink *n;
+	int group, err;
+
+	n = calloc(1, sizeof(*n));
+	if (!n) return -ENOMEM;
+
+	n->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (n->fd < 0) {
+		err = -errno;
+		goto free_nl;
+	}
+	if (bind(n->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		err = -errno;
+		goto close_fd;
+	}
+
+	group = nl_resolve_group(n);
+	if (group < 0) {
+		err = group;
+		goto close_fd;
+	}
+	if (setsockopt(n->fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+		err = -errno;
+		goto close_fd;
+	}
+
+	*nl = n;
+	return 0;
+
+close_fd:
+	close(n->fd);
+free_nl:
+	free(n);
+	return err;
+}
+
+void sk_nl_close(struct sk_netlink *nl){
+	if (!nl) return;
+	close(nl->fd);
+	free(nl);
+}
+
+int sk_nl_fd(const struct sk_netlink *nl){
+	return nl->fd;
+}
+
+/* Takes one message without blocking, its events become pending.
+ * Returns 1 if a message was taken, 0 if there was none.
+ */
+static int nl_receive(struct sk_netlink *nl){
+	struct nlmsghdr *nlh = (struct nlmsghdr *)nl->buf;
+	struct nlattr *attr;
+	int len;
+
+	len = recv(nl->fd, nl->buf, NL_BUF, MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		if (errno == ENOBUFS) return 1;		//Socket overrun, messages lost, keep going
+		return -errno;
+	}
+	if (!NLMSG_OK(nlh, len) || nlh->nlmsg_type == NLMSG_ERROR) return 1;
+
+	len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	for (attr = (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN); NL_ATTR_OK(attr, len); attr = NL_ATTR_NEXT(attr, len)) {
+		if (attr->nla_type == KEYBOARD_GENL_ATTR_EVENTS) {
+			nl->pending = NL_ATTR_DATA(attr);
+			nl->num_pending = NL_ATTR_LEN(attr) / sizeof(struct keyboard_event);
+		} else if (attr->nla_type == KEYBOARD_GENL_ATTR_DROPPED) {
+			nl->dropped = *(uint32_t *)NL_ATTR_DATA(attr);
+		}
+	}
+	return 1;
+}
+
+int sk_nl_read_events(struct sk_netlink *nl, struct keyboard_event *events, int max, int timeout_ms, uint32_t *dropped){
+	struct pollfd pfd = { .fd = nl->fd, .events = POLLIN };
+	int num = 0, ret;
+
+	if (max <= 0) return -EINVAL;
+
+	for (;;) {
+		while (num < max) {
+			if (!nl->num_pending) {
+				ret = nl_receive(nl);
+				if (ret < 0) return ret;
+				if (ret == 0) break;
+				continue;
+			}
+			memcpy(&events[num], nl->pending, sizeof(struct keyboard_event));	//Records in the message may be unaligned
+			nl->pending++;
+			nl->num_pending--;
+			num++;
+		}
+		if (dropped) *dropped = nl->dropped;
+		if (num || timeout_ms == 0) return num;
+
+		do {
+			ret = poll(&pfd, 1, timeout_ms);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) return -errno;
+		if (ret == 0) return 0;
+		if (timeout_ms > 0) timeout_ms = 0;	//Woken up, take what is there and return
+	}
+}
@@ -0,0 +1,153 @@
+#ifndef simplekeyboard_h
+#define simplekeyboard_h
+
+#include <stdint.h>
+#include "../drivers/keyboard-public.h"
+
+/* libsimplekeyboard: user space client of the simple keyboard driver.
+ *
+ * It hides the ioctl sequence needed to configure the device and returns
+ * decoded events (struct keyboard_event from "keyboard-public.h") in batches,
+ * using the fastest path the running driver offers:
+ *
+ *   1. the shared ring mapped with mmap(), events are taken without copies
+ *   2. read() of event records (KEYBOARD_FORMAT_EVENTS)
+ *   3. read() of one '0' + key character per press, on drivers without event
+ *      records. Only presses are reported and they are timestamped on reception
+ *
+ * Functions return 0 (or a count) on success and -errno on failure. A handle
+ * must not be used from several threads at the same time.
+ */
+
+#define SK_DEFAULT_PATH "/dev/simple-keyboard"
+
+/* Key numbers as found in keyboard_event.key */
+#define SK_KEY_RIGHT 1
+#define SK_KEY_START 2
+#define SK_KEY_UP 3
+#define SK_KEY_DOWN 4
+#define SK_KEY_ESCAPE 5
+#define SK_KEY_LEFT 6
+#define SK_KEY_BIT(key) (1u << ((key) - 1))
+#define SK_ALL_KEYS 0x3f
+
+/* Acquisition modes for sk_configure() */
+#define SK_MODE_MULTI_LINE 0	//One irq per key line
+#define SK_MODE_SINGLE_LINE 1	//One shared irq line, keys polled on it
+#define SK_MODE_TIMER_POLL 2	//No irqs, keys polled periodically
+#define SK_MODE_AUTO 3		//Cheapest mode the pins allow, see sk_get_plan()
+
+/* Paths used to get events, see sk_path() */
+#define SK_PATH_RING 0
+#define SK_PATH_EVENTS 1
+#define SK_PATH_ASCII 2
+
+struct sk_device;
+
+/* Opens the device (SK_DEFAULT_PATH if path is NULL) and sets up the best
+ * event path. flags are passed to open(), O_NONBLOCK is always added.
+ */
+int sk_open(const char *path, int flags, struct sk_device **dev);
+void sk_close(struct sk_device *dev);
+
+/* Configures the device in one go. pins may be NULL to keep the pins the
+ * driver has now. Drivers without IO_KEYBOARD_SET_CONFIG get the old
+ * RESET -> PINMUX -> CONFIG sequence, which only knows the two irq modes.
+ */
+int sk_configure(struct sk_device *dev, int mode, const struct pin_conf *pins);
+
+/* Whole configuration as a blob: save it with sk_get_config() and hand it
+ * back to sk_set_config() after a restart, an unchanged device is not touched.
+ */
+int sk_get_config(struct sk_device *dev, struct keyboard_config *conf);
+int sk_set_config(struct sk_device *dev, const struct keyboard_config *conf);
+
+/* Acquisition plan of the device: mode in use, which modes the pins allow
+ * and how the irqs of every gpio bank are spent
+ */
+int sk_get_plan(struct sk_device *dev, struct keyboard_plan *plan);
+
+/* File descriptor to register in epoll/poll/select, readable (EPOLLIN) when
+ * events are pending. Once it is signalled sk_read_events() with a timeout of
+ * 0 must be called until it returns 0.
+ */
+int sk_fd(const struct sk_device *dev);
+
+/* Makes the driver signal the eventfd efd (see eventfd(2)) whenever events of
+ * the keys in key_mask are queued for this handle, SK_KEY_BIT() builds the
+ * mask. efd -1 stops the notifications. The counter is only a wake up, events
+ * are still taken with sk_read_events() or the ring.
+ */
+int sk_set_eventfd(struct sk_device *dev, int efd, uint32_t key_mask);
+
+/* Installs a classic BPF program (struct sock_filter, see linux/filter.h)
+ * run over struct keyboard_filter_data for every event of this handle. It
+ * returns KEYBOARD_FILTER_DROP, KEYBOARD_FILTER_ACCEPT or
+ * KEYBOARD_FILTER_REWRITE(). len 0 removes the filter.
+ */
+int sk_set_filter(struct sk_device *dev, const void *insns, unsigned int len);
+
+/* Gesture thresholds of the device (struct keyboard_gestures), shared by
+ * every handle. A handle only gets the gesture events (KEYBOARD_EVENT_TAP and
+ * up) once sk_receive_gestures() is called with on set, presses and releases
+ * keep coming either way.
+ */
+int sk_get_gestures(struct sk_device *dev, struct keyboard_gestures *conf);
+int sk_set_gestures(struct sk_device *dev, const struct keyboard_gestures *conf);
+int sk_receive_gestures(struct sk_device *dev, int on);
+
+/* Queue depth and overflow policy of this handle plus its loss counters
+ * (struct keyboard_queue). Once the ring is mapped (SK_PATH_RING) only
+ * KEYBOARD_QUEUE_DROP_NEWEST and KEYBOARD_QUEUE_COALESCE are allowed and the
+ * depth cannot change, open with the queue_depth module parameter set instead.
+ */
+int sk_get_queue(struct sk_device *dev, struct keyboard_queue *queue);
+int sk_set_queue(struct sk_device *dev, uint32_t depth, uint32_t policy);
+
+/* Clock of the event timestamps of this handle (KEYBOARD_CLOCK_*). With sync
+ * set a KEYBOARD_EVENT_CLOCK_SYNC record pairs it with CLOCK_REALTIME every
+ * clock_sync_ms, so wall time of an event is record.sequence seconds plus
+ * event.timestamp - record.timestamp.
+ */
+int sk_set_clock(struct sk_device *dev, uint32_t clock, int sync);
+
+/* Keys down right now (struct keyboard_state), never blocks. Cheap enough to
+ * be polled at a high rate.
+ */
+int sk_get_state(struct sk_device *dev, struct keyboard_state *state);
+
+/* One of SK_PATH_* */
+int sk_path(const struct sk_device *dev);
+
+/* Copies up to max pending events into events. It waits up to timeout_ms for
+ * the first one (-1 forever, 0 not at all) and returns the number of events,
+ * 0 on timeout.
+ */
+int sk_read_events(struct sk_device *dev, struct keyboard_event *events, int max, int timeout_ms);
+
+/* Zero copy access, only with SK_PATH_RING. sk_ring_peek() points events to
+ * the oldest pending events and returns how many are contiguous in the ring,
+ * they stay valid until sk_ring_consume() releases them.
+ */
+int sk_ring_peek(struct sk_device *dev, const struct keyboard_event **events);
+void sk_ring_consume(struct sk_device *dev, int num);
+
+/* Events lost by the driver because this handle did not consume them in time
+ * (ring path only, 0 otherwise)
+ */
+uint32_t sk_dropped(const struct sk_device *dev);
+
+/* Generic netlink subscription (drivers built with NETLINK=y). It gets the
+ * events of every key, gestures included, without opening the device, so it
+ * also works from containers. sk_nl_fd() can be registered in poll/epoll like
+ * sk_fd(). sk_nl_read_events() behaves as sk_read_events() and, if dropped
+ * is not NULL, stores the events the driver lost for the channel so far.
+ */
+struct sk_netlink;
+
+int sk_nl_open(struct sk_netlink **nl);
+void sk_nl_close(struct sk_netlink *nl);
+int sk_nl_fd(const struct sk_netlink *nl);
+int sk_nl_read_events(struct sk_netlink *nl, struct keyboard_event *events, int max, int timeout_ms, uint32_t *dropped);
+
+#endif
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../drivers/keyboard-driver.h"
+#include "../drivers/keyboard-events.h"
+
+/* Host benchmark of the driver event core, linked against the user space
+ * build of "keyboard-events.c" (libkeyboard-events.a). It pushes millions of
+ * synthetic edges through the same functions the irq handlers call and drains
+ * the reader queues the way read() does, so data layout and branch changes
+ * can be measured with perf without a board:
+ *
+ *   perf stat -e cycles,instructions,branch-misses ./bench-events -n 50000000
+ *   perf record -g ./bench-events -m state
+ *
+ * Modes:
+ *   edge  -> one rising edge per event, cycling keys (MULTI_LINE handlers)
+ *   state -> one sampled state word per event (SINGLE_LINE handler)
+ *   -f    -> the key states of a recording taken from the record file of the
+ *            driver in debugfs, looped until -n inputs, with its own timing
+ *
+ * A JSON object with the results is printed at the end.
+ */
+
+#define MAX_READERS 64
+#define DRAIN_EVERY 16		//Events dispatched between two drains of the queues
+
+enum bench_mode { MODE_EDGE, MODE_STATE, MODE_RECORDING };
+
+static uint64_t num_events = 10000000;
+static uint32_t queue_size = 64;
+static uint64_t debounce_ns = 0;
+static int num_readers = 1;
+static enum bench_mode mode = MODE_EDGE;
+static struct keyboard_event *recording;
+static uint64_t recording_len;
+
+static void usage(const char *name){
+	printf("Usage: %s [options]\n", name);
+	printf("  -n <n>      events to generate (default %llu)\n", (unsigned long long)num_events);
+	printf("  -r <n>      readers attached to the hub (default %d, max %d)\n", num_readers, MAX_READERS);
+	printf("  -q <n>      queue size of every reader, power of 2 (default %u)\n", queue_size);
+	printf("  -d <ns>     debounce window (default 0)\n");
+	printf("  -m <mode>   edge or state (default edge)\n");
+	printf("  -f <file>   replay a recording of the driver instead\n");
+}
+
+/* Keeps the presses and releases of a recording, returns 0 on success */
+static int load_recording(const char *path){
+	struct keyboard_record_header header;
+	struct keyboard_event ev;
+	uint64_t size = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) return -1;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != KEYBOARD_RECORD_MAGIC ||
+		header.version != KEYBOARD_RECORD_VERSION || header.record_size != sizeof(ev)) {
+		fclose(f);
+		return -1;
+	}
+	while (fread(&ev, sizeof(ev), 1, f) == 1) {
+		if (ev.type != KEYBOARD_EVENT_PRESS && ev.type != KEYBOARD_EVENT_RELEASE) continue;
+		if (recording_len == size) {
+			size = size ? size * 2 : 1024;
+			recording = realloc(recording, size * sizeof(ev));
+			if (!recording) {
+				fclose(f);
+				return -1;
+			}
+		}
+		recording[recording_len++] = ev;
+	}
+	fclose(f);
+	return recording_len ? 0 : -1;
+}
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Drains every queue as read() would, returns the number of events taken */
+static uint64_t drain(struct event_reader *readers, int num, uint64_t *checksum){
+	struct keyboard_event ev;
+	uint64_t taken = 0;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		while (event_queue_pop(&readers[i].queue, &ev) == 0) {
+			*checksum += ev.key;
+			taken++;
+		}
+	}
+	return taken;
+}
+
+int main(int argc, char *argv[]){
+	struct event_reader readers[MAX_READERS];
+	struct keyboard_event out[NUM_KEYS];
+	struct keyboard_ring *ring;
+	struct event_hub hub;
+	struct key_state ks;
+	uint64_t i, start, elapsed, generated = 0, delivered = 0, dropped = 0, checksum = 0;
+	uint64_t now = 1000000000ULL;	//Synthetic clock, 1us between events
+	uint64_t loop_base = 0, span = 0;
+	const struct keyboard_event *rec;
+	int opt, j, num;
+
+	while ((opt = getopt(argc, argv, "n:r:q:d:m:f:h")) != -1) {
+		switch (opt) {
+			case 'n': num_events = strtoull(optarg, NULL, 0); break;
+			case 'r': num_readers = atoi(optarg); break;
+			case 'q': queue_size = strtoul(optarg, NULL, 0); break;
+			case 'd': debounce_ns = strtoull(optarg, NULL, 0); break;
+			case 'm':
+				if (strcmp(optarg, "edge") == 0) mode = MODE_EDGE;
+				else if (strcmp(optarg, "state") == 0) mode = MODE_STATE;
+				else { usage(argv[0]); return -1; }
+				break;
+			case 'f':
+				if (load_recording(optarg) < 0) {
+					printf("Unable to load the recording %s\n", optarg);
+					return -1;
+				}
+				mode = MODE_RECORDING;
+				break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (num_readers < 1 || num_readers > MAX_READERS || !num_events) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	event_hub_init(&hub);
+	for (j = 0; j < num_readers; j++) {
+		ring = calloc(1, EVENT_RING_BYTES(queue_size));
+		if (!ring) return -1;
+		if (event_queue_init(&readers[j].queue, ring, queue_size) < 0) {
+			printf("Queue size must be a power of 2\n");
+			return -1;
+		}
+		event_hub_add(&hub, &readers[j]);
+	}
+	key_state_init(&ks, debounce_ns);
+
+	start = now_ns();
+	for (i = 0; i < num_events; i++, now += 1000) {
+		if (mode == MODE_EDGE) {
+			num = key_state_edge(&ks, (i % NUM_KEYS) + 1, now, out);
+		} else if (mode == MODE_STATE) {
+			num = key_state_update(&ks, (uint8_t)(i * 0x9E3779B1u >> 26), ALL_KEYS_MASK, now, out);
+		} else {
+			/* Every loop of the recording goes on after the previous one */
+			rec = &recording[i % recording_len];
+			if (i && i % recording_len == 0) loop_base += span + 1000;
+			span = rec->timestamp - recording[0].timestamp;
+			num = key_state_update(&ks, rec->state, ALL_KEYS_MASK, loop_base + span, out);
+		}
+		event_hub_dispatch(&hub, out, num);
+		generated += num;
+		if ((i % DRAIN_EVERY) == DRAIN_EVERY - 1) delivered += drain(readers, num_readers, &checksum);
+	}
+	delivered += drain(readers, num_readers, &checksum);
+	elapsed = now_ns() - start;
+
+	for (j = 0; j < num_readers; j++) dropped += readers[j].queue.ring->dropped;
+
+	printf("{\"mode\":\"%s\",\"inputs\":%llu,\"events\":%llu,\"readers\":%d,\"queue_size\":%u,"
+		"\"delivered\":%llu,\"dropped\":%llu,\"ns_per_input\":%.2f,\"inputs_per_sec\":%.0f,"
+		"\"checksum\":%llu}\n",
+		mode == MODE_EDGE ? "edge" : mode == MODE_STATE ? "state" : "recording", (unsigned long long)num_events,
+		(unsigned long long)generated, num_readers, queue_size,
+		(unsigned long long)delivered, (unsigned long long)dropped,
+		(double)elapsed / num_events, num_events * 1e9 / elapsed,
+		(unsigned long long)checksum);
+
+	for (j = 0; j < num_readers; j++) free(readers[j].queue.ring);
+	free(recording);
+	return 0;
+}
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "../drivers/keyboard-public.h"
+
+/* Latency and throughput benchmark for the simple keyboard driver.
+ *
+ * Events are generated either by the injection ioctl (module built with
+ * INJECT=y, off by default in the driver Makefile) or by toggling the pull of
+ * gpio-sim lines (module built with BACKEND=gpiosim, -s option). Every reader opens its own file, as
+ * separate processes would, and consumes events with one of these methods:
+ *
+ *   read  -> blocking read() of one key
+ *   poll  -> poll() for POLLIN followed by read() of one key
+ *   batch -> blocking read() of up to BATCH_SIZE keys
+ *
+ * Two phases are run for every method and number of readers:
+ *
+ *   latency    -> one event at a time, time from the timestamp the driver gave
+ *                 the edge to read() returning in every reader (p50/p99/p99.9).
+ *                 Readers take event records (KEYBOARD_FORMAT_EVENTS) here.
+ *   throughput -> a sustained stream of events, events per second seen by each
+ *                 reader and events lost on the way
+ *
+ * One JSON object is printed per run so results can be stored and compared
+ * between driver versions.
+ */
+
+#define BATCH_SIZE 64
+#define SIM_FIRST_LINE 1		//Default line offset of RIGHT key in gpiosim builds
+#define SETTLE_US 1000			//Time given to readers to block before an edge
+#define INJECT_LATENCY_RATE 100000	//Single event injections fire about 10us after the ioctl
+#define DRAIN_TIMEOUT_MS 1000		//Time to wait for late events after the stream
+
+enum read_mode { MODE_READ, MODE_POLL, MODE_BATCH, MODE_COUNT };
+static const char *mode_names[MODE_COUNT] = { "read", "poll", "batch" };
+
+struct reader {
+	pthread_t thread;
+	int fd;
+	enum read_mode mode;
+	int64_t *samples;		//Latency samples or receive times (ns)
+	uint32_t received;
+	uint32_t spurious;		//Presses timestamped before the edge was requested
+	volatile int done;
+};
+
+/* Benchmark settings, set from the command line */
+static const char *path = "/dev/simple-keyboard";
+static const char *sim_dir = NULL;	//gpio-sim chip directory in sysfs
+static uint32_t num_events = 100000;
+static uint32_t num_samples = 1000;
+static uint32_t burst = 10;
+static uint32_t rate = 50000;
+static int max_readers = 1;
+static int only_mode = -1;
+static int config_mode = 0;		//'s' or 'm' to configure the device first
+
+/* Shared state between the main thread and the readers */
+static volatile int stop_readers;
+static volatile int phase_latency;
+static volatile uint32_t sample_gen;	//Bumped by the main thread for every latency sample
+static volatile uint32_t ready_readers;	//Readers about to block for the current sample
+static volatile uint32_t done_readers;	//Readers done with the current sample
+static volatile int64_t edge_time;	//Time the current edge was requested (latency phase)
+static int sim_fds[6];
+
+static void usage(const char *name){
+	printf("Usage: %s [options]\n", name);
+	printf("  -d <dev>    device path (default %s)\n", path);
+	printf("  -s <dir>    drive gpio-sim lines below <dir> instead of injecting,\n");
+	printf("              e.g. /sys/devices/platform/gpio-sim.0/gpiochip1\n");
+	printf("  -c <s|m>    configure the device in single/multi line mode first\n");
+	printf("  -m <mode>   only run read, poll or batch (default all)\n");
+	printf("  -r <n>      run with 1 to n concurrent readers (default 1)\n");
+	printf("  -n <n>      events in the throughput phase (default %u)\n", num_events);
+	printf("  -l <n>      samples in the latency phase (default %u)\n", num_samples);
+	printf("  -b <n>      injection burst size (default %u)\n", burst);
+	printf("  -R <n>      injection rate in events/s (default %u)\n", rate);
+}
+
+static int64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_us(long us){
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static void wakeup_handler(int sig){
+	(void)sig;	//Only used to interrupt blocking reads
+}
+
+
+/**
+ *		EVENT SOURCES
+ */
+
+static int inject(int fd, uint32_t count, uint32_t inject_burst, uint32_t inject_rate){
+	struct keyboard_inject conf = {
+		.key = 0,		//Cycle through every key
+		.count = count,
+		.burst = inject_burst,
+		.rate = inject_rate,
+	};
+	return ioctl(fd, IO_KEYBOARD_INJECT, &conf);
+}
+
+static int sim_open(void){
+	char name[256];
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		snprintf(name, sizeof(name), "%s/sim_gpio%d/pull", sim_dir, SIM_FIRST_LINE + i);
+		sim_fds[i] = open(name, O_WRONLY);
+		if (sim_fds[i] < 0) {
+			printf("ERROR WHILE OPENING %s!!!\n", name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void sim_set(int line, int pressed){
+	const char *pull = pressed ? "pull-up" : "pull-down";
+	if (pwrite(sim_fds[line], pull, strlen(pull), 0) < 0)
+		printf("ERROR WHILE DRIVING LINE %d!!!\n", SIM_FIRST_LINE + line);
+}
+
+/* Generates a single edge, readers take its time from the event record */
+static int single_edge(int fd, uint32_t index){
+	if (sim_dir) {
+		sim_set(index % 6, 1);
+		sim_set(index % 6, 0);
+		return 0;
+	}
+	return inject(fd, 1, 1, INJECT_LATENCY_RATE);
+}
+
+/* Generates a sustained stream of edges */
+static int edge_stream(int fd){
+	int64_t next, period;
+	uint32_t i;
+
+	if (!sim_dir) return inject(fd, num_events, burst, rate);
+
+	period = 1000000000LL / rate;
+	next = now_ns();
+	for (i = 0; i < num_events; i++) {
+		sim_set(i % 6, 1);
+		sim_set(i % 6, 0);
+		next += period;
+		while (now_ns() < next);
+	}
+	return 0;
+}
+
+
+/**
+ *		READERS
+ */
+
+/* Waits for and consumes events of unit bytes (a key or a record), buf holds
+ * BATCH_SIZE of them. Returns the number of events received.
+ */
+static int consume(struct reader *r, void *buf, size_t unit){
+	struct pollfd pfd;
+	ssize_t ret;
+
+	switch (r->mode) {
+		case MODE_POLL:
+			pfd.fd = r->fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, -1) <= 0) return -1;
+			ret = read(r->fd, buf, unit);
+			break;
+		case MODE_BATCH:
+			ret = read(r->fd, buf, BATCH_SIZE * unit);
+			break;
+		default:
+			ret = read(r->fd, buf, unit);
+	}
+	return ret < 0 ? -1 : (int)(ret / unit);
+}
+
+/* Latency of a sample is taken from the driver timestamp of its press, so
+ * timer slack of the injector or gpio-sim writes are not measured. Other
+ * records (releases) are skipped.
+ */
+static void latency_reader(struct reader *r){
+	struct keyboard_event events[BATCH_SIZE];
+	const struct keyboard_event *press;
+	uint32_t gen = 0;
+	int64_t t;
+	int i, ret;
+
+	while (1) {
+		while (gen == sample_gen) sleep_us(50);
+		gen = sample_gen;
+		if (stop_readers) break;
+
+		__sync_fetch_and_add(&ready_readers, 1);
+		do {
+			ret = consume(r, events, sizeof(struct keyboard_event));
+			t = now_ns();
+			press = NULL;
+			for (i = 0; i < ret; i++) {
+				if (events[i].type != KEYBOARD_EVENT_PRESS) continue;
+				/* A press older than the request is stale data from the driver */
+				if ((int64_t)events[i].timestamp < edge_time) r->spurious++;
+				else if (!press) press = &events[i];
+			}
+		} while (ret > 0 && !press);
+		if (press && r->received < num_samples) r->samples[r->received++] = t - (int64_t)press->timestamp;
+		__sync_fetch_and_add(&done_readers, 1);
+	}
+}
+
+static void throughput_reader(struct reader *r){
+	char buf[BATCH_SIZE];
+	int64_t t;
+	int ret;
+
+	while (!stop_readers) {
+		ret = consume(r, buf, 1);
+		t = now_ns();
+		for (; ret > 0 && r->received < num_events; ret--)
+			r->samples[r->received++] = t;
+	}
+}
+
+static void *reader_thread(void *arg){
+	struct reader *r = arg;
+
+	if (phase_latency) latency_reader(r);
+	else throughput_reader(r);
+
+	r->done = 1;
+	return NULL;
+}
+
+static int start_readers(struct reader *readers, int num, enum read_mode mode, uint32_t samples){
+	int i;
+
+	for (i = 0; i < num; i++) {
+		memset(&readers[i], 0, sizeof(struct reader));
+		readers[i].mode = mode;
+		readers[i].fd = open(path, O_RDWR);
+		readers[i].samples = calloc(samples, sizeof(int64_t));
+		if (readers[i].fd < 0 || !readers[i].samples) {
+			printf("ERROR WHILE OPENING DEVICE!!!\n");
+			return -1;
+		}
+		if (phase_latency && ioctl(readers[i].fd, IO_KEYBOARD_SET_FORMAT, KEYBOARD_FORMAT_EVENTS) < 0) {
+			printf("ERROR WHILE SELECTING EVENT RECORDS!!!\n");
+			return -1;
+		}
+		pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i]);
+	}
+	return 0;
+}
+
+static void stop_all_readers(struct reader *readers, int num){
+	int i, pending;
+
+	stop_readers = 1;
+	do {
+		pending = 0;
+		for (i = 0; i < num; i++) {
+			if (readers[i].done) continue;
+			pthread_kill(readers[i].thread, SIGUSR1);
+			pending = 1;
+		}
+		if (pending) sleep_us(1000);
+	} while (pending);
+
+	for (i = 0; i < num; i++) {
+		pthread_join(readers[i].thread, NULL);
+		close(readers[i].fd);
+	}
+}
+
+
+/**
+ *		PHASES
+ */
+
+static int cmp_int64(const void *a, const void *b){
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(int64_t *sorted, uint32_t num, double p){
+	uint32_t idx;
+	if (!num) return 0;
+	idx = (uint32_t)(p * num + 0.999999);
+	if (idx > 0) idx--;
+	if (idx >= num) idx = num - 1;
+	return sorted[idx] / 1000.0;
+}
+
+/* Interrupts readers stuck on the current sample */
+static void kick_readers(struct reader *readers, int num, volatile uint32_t *counter){
+	int i;
+
+	while (*counter < (uint32_t)num) {
+		for (i = 0; i < num; i++) pthread_kill(readers[i].thread, SIGUSR1);
+		sleep_us(1000);
+	}
+}
+
+static void run_latency(int ctl_fd, enum read_mode mode, int num){
+	struct reader readers[num];
+	int64_t *all, deadline;
+	uint32_t i, total = 0, spurious = 0, missed = 0;
+	int j;
+
+	stop_readers = 0;
+	phase_latency = 1;
+	sample_gen = 0;		//Readers start waiting for the first sample
+	if (start_readers(readers, num, mode, num_samples) < 0) exit(-1);
+
+	for (i = 0; i < num_samples; i++) {
+		ready_readers = 0;
+		done_readers = 0;
+		edge_time = INT64_MAX;
+		__sync_synchronize();
+		sample_gen++;
+
+		while (ready_readers < (uint32_t)num) sleep_us(50);
+		sleep_us(SETTLE_US);	//Let them block inside the driver
+		edge_time = now_ns();
+		if (single_edge(ctl_fd, i) < 0) {
+			printf("ERROR WHILE GENERATING EVENTS!!!\n");
+			exit(-1);
+		}
+
+		/* Readers that did not get the key in time count as missed */
+		deadline = now_ns() + DRAIN_TIMEOUT_MS * 1000000LL;
+		while (done_readers < (uint32_t)num && now_ns() < deadline) sleep_us(50);
+		kick_readers(readers, num, &done_readers);
+	}
+	stop_readers = 1;
+	sample_gen++;
+	stop_all_readers(readers, num);
+
+	all = calloc((size_t)num * num_samples, sizeof(int64_t));
+	for (j = 0; j < num; j++) {
+		memcpy(&all[total], readers[j].samples, readers[j].received * sizeof(int64_t));
+		total += readers[j].received;
+		spurious += readers[j].spurious;
+		missed += num_samples - readers[j].received;
+		free(readers[j].samples);
+	}
+	qsort(all, total, sizeof(int64_t), cmp_int64);
+
+	printf("{\"phase\":\"latency\",\"mode\":\"%s\",\"readers\":%d,\"samples\":%u,"
+		"\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f,"
+		"\"spurious\":%u,\"missed\":%u}\n",
+		mode_names[mode], num, total,
+		percentile_us(all, total, 0.50), percentile_us(all, total, 0.99),
+		percentile_us(all, total, 0.999), total ? all[total - 1] / 1000.0 : 0,
+		spurious, missed);
+	free(all);
+}
+
+static void run_throughput(int ctl_fd, enum read_mode mode, int num){
+	struct reader readers[num];
+	uint64_t received = 0, dropped = 0;
+	double rate_sum = 0;
+	int64_t start, deadline;
+	int j, pending;
+
+	stop_readers = 0;
+	phase_latency = 0;
+	if (start_readers(readers, num, mode, num_events) < 0) exit(-1);
+	sleep_us(SETTLE_US * 10);
+
+	start = now_ns();
+	if (edge_stream(ctl_fd) < 0) {
+		printf("ERROR WHILE GENERATING EVENTS!!!\n");
+		exit(-1);
+	}
+
+	/* Wait for the stream to be consumed or for the readers to give up */
+	deadline = start + (int64_t)num_events * 1000000000LL / rate + DRAIN_TIMEOUT_MS * 1000000LL;
+	do {
+		pending = 0;
+		for (j = 0; j < num; j++)
+			if (readers[j].received < num_events) pending = 1;
+		if (pending) sleep_us(1000);
+	} while (pending && now_ns() < deadline);
+	stop_all_readers(readers, num);
+
+	for (j = 0; j < num; j++) {
+		struct reader *r = &readers[j];
+		received += r->received;
+		dropped += num_events - r->received;
+		if (r->received > 1 && r->samples[r->received - 1] > r->samples[0])
+			rate_sum += (r->received - 1) * 1e9 / (r->samples[r->received - 1] - r->samples[0]);
+		free(r->samples);
+	}
+
+	printf("{\"phase\":\"throughput\",\"mode\":\"%s\",\"readers\":%d,\"events\":%u,"
+		"\"rate\":%u,\"burst\":%u,\"received\":%llu,\"dropped\":%llu,"
+		"\"events_per_sec\":%.1f}\n",
+		mode_names[mode], num, num_events, rate, sim_dir ? 1 : burst,
+		(unsigned long long)received, (unsigned long long)dropped, rate_sum / num);
+}
+
+
+/**
+ *		SETUP
+ */
+
+static int configure(int fd){
+	if (ioctl(fd, IO_KEYBOARD_RESET) < 0 && errno != EINVAL) return -1;
+	return ioctl(fd, config_mode == 's' ? IO_KEYBOARD_CONFIG_SINGLE_LINE : IO_KEYBOARD_CONFIG_MULTI_LINE);
+}
+
+static void print_header(void){
+	char version[32] = "unknown";
+	FILE *f = fopen("/sys/module/simple_keyboard/version", "r");
+
+	if (f) {
+		if (fgets(version, sizeof(version), f)) version[strcspn(version, "\n")] = 0;
+		fclose(f);
+	}
+	printf("{\"driver_version\":\"%s\",\"source\":\"%s\"}\n", version, sim_dir ? "gpio-sim" : "inject");
+}
+
+int main(int argc, char *argv[]){
+	struct sigaction sa;
+	int fd, opt, num, mode;
+
+	while ((opt = getopt(argc, argv, "d:s:c:m:r:n:l:b:R:h")) != -1) {
+		switch (opt) {
+			case 'd': path = optarg; break;
+			case 's': sim_dir = optarg; break;
+			case 'c': config_mode = optarg[0]; break;
+			case 'm':
+				for (mode = 0; mode < MODE_COUNT; mode++)
+					if (strcmp(optarg, mode_names[mode]) == 0) only_mode = mode;
+				if (only_mode < 0) { usage(argv[0]); return -1; }
+				break;
+			case 'r': max_readers = atoi(optarg); break;
+			case 'n': num_events = strtoul(optarg, NULL, 0); break;
+			case 'l': num_samples = strtoul(optarg, NULL, 0); break;
+			case 'b': burst = strtoul(optarg, NULL, 0); break;
+			case 'R': rate = strtoul(optarg, NULL, 0); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+	if (max_readers < 1 || !num_events || !num_samples || !burst || !rate) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	/* Blocking reads are interrupted with SIGUSR1 when a run is over */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wakeup_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	fd = open(path, O_RDWR);	//Control file, used to configure and inject
+	if (fd < 0) {
+		printf("ERROR WHILE OPENING DEVICE!!!\n");
+		return -1;
+	}
+	if (config_mode && configure(fd) < 0) {
+		printf("ERROR WHILE CONFIGURING DEVICE!!!\n");
+		return -1;
+	}
+	if (sim_dir && sim_open() < 0) return -1;
+
+	print_header();
+	for (mode = 0; mode < MODE_COUNT; mode++) {
+		if (only_mode >= 0 && mode != only_mode) continue;
+		for (num = 1; num <= max_readers; num++) {
+			run_latency(fd, mode, num);
+			run_throughput(fd, mode, num);
+		}
+	}
+
+	close(fd);
+	return 0;
+}